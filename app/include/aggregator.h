@@ -0,0 +1,104 @@
+/**
+ * Created on Sun Dec 22 2024
+ *
+ * @brief Streaming window aggregator, used to summarize a stream of samples (e.g. for a
+ *        dashboard) instead of sending every sample over USB.
+ *
+ *        Samples are grouped into windows of a fixed number of samples, or of a fixed
+ *        duration (or both, in which case a window ends at whichever limit is reached
+ *        first). Only a running min/max/sum/sum of squares is kept for the window being
+ *        filled (O(1) memory), and one summary (min/max/mean/RMS) is output per window.
+ *
+ *        Time windows are aligned with the first sample aggregated (window 'k' covers
+ *        [start + k * duration, start + (k + 1) * duration)), and are closed by the first
+ *        sample past them. Empty windows are skipped (so their indexes are missing).
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include "sample.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define SUMMARY_BLOCK_MAX_SUMMARIES SAMPLE_BLOCK_MAX_SAMPLES
+
+/* Type definitions */
+
+// A block of window summaries (from any channel), laid out as a structure of arrays
+// (just like sample_block_t)
+typedef struct {
+    uint16_t n_summaries;
+    uint8_t channel[SUMMARY_BLOCK_MAX_SUMMARIES];
+    uint32_t index[SUMMARY_BLOCK_MAX_SUMMARIES];          // Index of the window (since the aggregation started)
+    uint32_t timestamp_us[SUMMARY_BLOCK_MAX_SUMMARIES];   // Start of the window (capture time of its first sample, for sample windows)
+    uint32_t n_samples[SUMMARY_BLOCK_MAX_SUMMARIES];      // Number of samples in the window
+    sample_value_t min[SUMMARY_BLOCK_MAX_SUMMARIES];
+    sample_value_t max[SUMMARY_BLOCK_MAX_SUMMARIES];
+    sample_value_t mean[SUMMARY_BLOCK_MAX_SUMMARIES];
+    sample_value_t rms[SUMMARY_BLOCK_MAX_SUMMARIES];
+} summary_block_t;
+
+// Sums are kept in double (or in 64-bit integers, for fixed-point samples), so long
+// windows don't lose precision
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+typedef int64_t aggregator_sum_t;
+#else
+typedef double aggregator_sum_t;
+#endif
+
+// The square of an int32 value takes up to 62 bits, so a few of them overflow a 64-bit sum.
+// Their sum is kept in 96 bits instead (there's no 128-bit integer type on 32-bit cores).
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES) && defined(CONFIG_APP_SAMPLE_VALUE_INT32)
+typedef struct {
+    uint32_t high;
+    uint64_t low;
+} aggregator_sum_sq_t;
+#else
+typedef aggregator_sum_t aggregator_sum_sq_t;
+#endif
+
+typedef struct {
+    uint32_t window_samples;   // Max number of samples per window (0 for no limit)
+    uint32_t window_us;        // Max duration of a window (0 for no limit)
+    uint32_t index;            // Index of the current window
+    uint32_t start_us;         // Start of the current window
+    uint32_t n_samples;        // Number of samples in the current window
+    sample_value_t min;
+    sample_value_t max;
+    aggregator_sum_t sum;
+    aggregator_sum_sq_t sum_sq;
+} aggregator_t;
+
+/**
+ * @brief Initialize (or restart) an aggregator.
+ *
+ * @param aggregator The aggregator.
+ * @param window_samples The max number of samples per window (0 for no limit).
+ * @param window_us The max duration of a window in us (0 for no limit).
+ */
+void aggregator_init(aggregator_t* aggregator, uint32_t window_samples, uint32_t window_us);
+
+/**
+ * @brief Check if an aggregator is enabled (i.e. if any of its window limits is set).
+ *
+ * @param aggregator The aggregator.
+ * @return True if enabled, false otherwise.
+ */
+bool aggregator_is_enabled(const aggregator_t* aggregator);
+
+/**
+ * @brief Add a sample to the current window. The summary of each window ended is appended
+ *        to a block (if the block is full, the summary is dropped).
+ *
+ * @param aggregator The aggregator.
+ * @param channel The channel of the sample.
+ * @param timestamp_us The capture time of the sample.
+ * @param value The sample value.
+ * @param summaries The block the summaries are appended to (output).
+ * @return 0 on success, -ENOBUFS if a summary was dropped.
+ */
+int aggregator_add(aggregator_t* aggregator, uint8_t channel, uint32_t timestamp_us, sample_value_t value, summary_block_t* summaries);
@@ -0,0 +1,98 @@
+/**
+ * Created on Fri Dec 27 2024
+ *
+ * @brief Pool of sample blocks, used to hand the samples read from the sensor thread over
+ *        to the data thread without copying them (see CONFIG_APP_BLOCK_POOL).
+ *
+ *        The sensor thread reads the samples straight into a block taken from the pool, and
+ *        hands the whole block over to the data thread once it is done with it (through a
+ *        FIFO). The data thread then encodes and sends the samples straight from the block,
+ *        and returns it to the pool. So the samples are never copied in between, and the
+ *        threads only synchronize once per block (instead of once per sample).
+ *
+ *        When every block is in use, the ring buffer overflow policies apply to whole blocks:
+ *        the oldest block queued is reused (drop oldest), the block just read is discarded
+ *        (drop newest), or the sensor thread waits for the data thread to free up a block
+ *        (block). The stats are kept the same way as for the ring buffer (in samples).
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include "ring_buffer.h"
+#include "sample.h"
+
+#include <zephyr/kernel.h>
+
+#include <stdint.h>
+
+/* Constants */
+#if defined(CONFIG_APP_BLOCK_POOL)
+#define BLOCK_POOL_N_BLOCKS CONFIG_APP_BLOCK_POOL_N_BLOCKS
+#else
+#define BLOCK_POOL_N_BLOCKS 0
+#endif
+
+// Max number of samples held by the pool at once
+#define BLOCK_POOL_CAPACITY (BLOCK_POOL_N_BLOCKS * SAMPLE_BLOCK_MAX_SAMPLES)
+
+/**
+ * @brief Take an empty block from the pool (without waiting for one).
+ *
+ * @return The block on success, NULL if every block is in use.
+ */
+sample_block_t* block_pool_alloc(void);
+
+/**
+ * @brief Hand a block of samples over to the consumer, and take the next block to fill in.
+ *        Empty blocks are not handed over (they are simply returned to be filled in). If
+ *        every block is in use, the overflow policy set decides which samples are discarded.
+ *        Must only be called from a single (producer) thread.
+ *
+ * @param block The block of samples to hand over (taken from the pool).
+ * @return The next block to fill in (empty).
+ */
+sample_block_t* block_pool_submit(sample_block_t* block);
+
+/**
+ * @brief Get the oldest block of samples handed over by the producer. Once done with it,
+ *        the block must be returned to the pool (see block_pool_free()).
+ *
+ * @param timeout Max time to wait for a block (K_NO_WAIT / K_FOREVER are also allowed).
+ * @return The block on success, NULL on timeout (or if the wait was cancelled).
+ */
+sample_block_t* block_pool_get(k_timeout_t timeout);
+
+/**
+ * @brief Return a block to the pool.
+ *
+ * @param block The block to return (taken from the pool).
+ */
+void block_pool_free(sample_block_t* block);
+
+/**
+ * @brief Make the thread waiting on block_pool_get() (if any) return right away.
+ */
+void block_pool_cancel_wait(void);
+
+/**
+ * @brief Set what happens to the samples read when every block is in use (safe to call
+ *        from any thread). The timeout is only used by the RING_BUFFER_BLOCK policy.
+ *
+ * @param policy The overflow policy (applied to whole blocks).
+ * @param timeout_ms The max time the producer waits for a free block.
+ * @return 0 on success, negative errno on failure.
+ */
+int block_pool_set_policy(ring_buffer_policy_t policy, uint32_t timeout_ms);
+
+/**
+ * @brief Get the pool stats (in samples), since boot or since they were last reset.
+ *
+ * @param stats The stats (output).
+ */
+void block_pool_get_stats(ring_buffer_stats_t* stats);
+
+/**
+ * @brief Reset the pool stats (safe to call from any thread).
+ */
+void block_pool_reset_stats(void);
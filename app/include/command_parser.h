@@ -3,6 +3,11 @@
  *
  * @brief Provides methods to parse and execute commands received over USB.
  *
+ *        Commands are lines of space separated numbers (the command type, followed by its
+ *        arguments), terminated by '\n' or '\r'. They are parsed incrementally, straight
+ *        from the bytes received - so a command can be split across any number of reads,
+ *        and a read can hold any number of commands.
+ *
  * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
  */
 #pragma once
@@ -11,30 +16,85 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define MAX_COMMAND_ARGS 4
+#define MAX_COMMAND_ARGS 7
+
+// Commands can be prefixed by a request ID (e.g. "@42 0 100"), in which case the device
+// replies with "ack id=<id> err=0 value=<value>" once the command has taken effect, or
+// with "nack id=<id> err=<errno> value=<value>" if it failed (see command_reply())
+#define COMMAND_REQUEST_ID_PREFIX '@'
 
 /* Type definitions */
 typedef enum {
-    COMMAND_SET_DATA_RATE = 0,
-    COMMAND_SET_READ_RATE = 1,
-    COMMAND_SET_SEND_RATE = 2,
-    COMMAND_START_PATTERN = 3,
+    COMMAND_SET_DATA_RATE      = 0,
+    COMMAND_SET_READ_RATE      = 1,
+    COMMAND_SET_SEND_RATE      = 2,
+    COMMAND_START_PATTERN      = 3,
+    COMMAND_SET_STREAM_MODE    = 4,
+    COMMAND_GET_TELEMETRY      = 5,
+    COMMAND_RESET_TELEMETRY    = 6,
+    COMMAND_BENCHMARK_PATTERNS = 7,
+    COMMAND_SET_RESAMPLING     = 8,
+    COMMAND_SET_AGGREGATION    = 9,
+    COMMAND_BENCHMARK_RING     = 10,
+    COMMAND_SET_OVERFLOW       = 11,
+    COMMAND_SET_ADAPTIVE_SEND  = 12,
+    COMMAND_SET_LATENCY_MODE   = 13,
+    COMMAND_QUEUE_PATTERN      = 14,
+    COMMAND_SET_NOISE          = 15,
+    COMMAND_STRESS_RING        = 16,
     COMMAND_MAX_VALUE,
 } command_type_t;
 
 typedef struct {
     command_type_t type;
     float args[MAX_COMMAND_ARGS];
+    uint8_t n_args;        // Number of arguments received (the missing ones are 0)
+    bool has_request_id;   // Set if the command carries a request ID (and expects a reply)
+    uint32_t request_id;
 } command_t;
 
+typedef enum {
+    COMMAND_TOKEN_NONE,             // Between numbers
+    COMMAND_TOKEN_SIGN,             // After the sign of a number
+    COMMAND_TOKEN_INTEGER,          // In the integer digits
+    COMMAND_TOKEN_FRACTION,         // In the fraction digits
+    COMMAND_TOKEN_EXPONENT_START,   // After the exponent 'e'
+    COMMAND_TOKEN_EXPONENT_SIGN,    // After the sign of the exponent
+    COMMAND_TOKEN_EXPONENT,         // In the exponent digits
+} command_token_state_t;
+
+// State of the command being parsed (see command_parser_feed)
+typedef struct {
+    command_t command;             // Command parsed (once complete)
+    int error;                     // First error found on the current line (0 if none)
+    bool done;                     // Set once the command is complete (the next byte starts a new one)
+    bool in_request_id;            // Set while parsing the request ID
+    uint8_t n_fields;              // Number of numbers parsed (the command type and its arguments)
+    command_token_state_t state;   // State of the number being parsed
+    bool negative;
+    bool has_digits;
+    bool exponent_negative;
+    uint64_t mantissa;             // Significant digits of the number
+    uint8_t n_digits;
+    int16_t exponent;              // Decimal exponent of the mantissa (from the digits dropped or after the point)
+    int16_t exponent_value;        // Exponent written after 'e'
+} command_parser_t;
+
 /**
- * @brief Parse a command received over USB.
+ * @brief Parse the bytes received over USB, up to the end of the next command. Parsing
+ *        stops right after each command completed, so it can be executed before the next
+ *        one is parsed (the remaining bytes can then be fed again). Bytes of incomplete
+ *        commands are kept track of by the parser (they don't need to be fed again).
  *
- * @param data A null-terminated string to be parsed.
- * @param command The command parsed (output).
- * @return 0 on success, negative errno on failure.
+ * @param parser The parser state (zero initialized before the first call).
+ * @param data The bytes received.
+ * @param n_bytes The number of bytes received.
+ * @param result Set to 0 once a command is parsed, to a negative errno if the command
+ *               completed is invalid, or to -EAGAIN if all the bytes were consumed without
+ *               completing a command (output).
+ * @return The number of bytes consumed.
  */
-int command_parse(char* data, command_t* command);
+size_t command_parser_feed(command_parser_t* parser, const uint8_t* data, size_t n_bytes, int* result);
 
 /**
  * @brief Execute a command.
@@ -42,4 +102,17 @@ int command_parse(char* data, command_t* command);
  * @param command The command to be executed.
  * @return 0 on success, negative errno on failure.
  */
-int command_execute(command_t* command);
\ No newline at end of file
+int command_execute(command_t* command);
+
+/**
+ * @brief Reply to a command that carries a request ID (commands without one are not replied
+ *        to). The reply carries the result of the command and the value it actually applied
+ *        (rates are reported in mHz, as they are rounded to it, and other commands report 0).
+ *        Replies are sent in order with the data, so once the host gets one, the command has
+ *        taken effect on all the data that follows.
+ *
+ * @param command The command parsed (even partially, if it failed to parse).
+ * @param result The result of the command (0 on success, negative errno on failure).
+ * @return 0 on success, negative errno on failure.
+ */
+int command_reply(const command_t* command, int result);
\ No newline at end of file
@@ -8,22 +8,137 @@
  */
 #pragma once
 
+#include "rate_timer.h"
 #include "ring_buffer.h"
+#include "stream_encoder.h"
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Constants */
+#define DATA_THREAD_MAX_WINDOW_SAMPLES 1000000   // Max number of samples per aggregation window
+#define DATA_THREAD_MAX_WINDOW_MS      3600000   // Max duration of an aggregation window (1h)
+#define DATA_THREAD_MAX_COALESCE_US    1000000   // Max duration of a coalescing window (latency mode)
+
+/* Type definitions */
+typedef struct {
+    uint32_t n_samples_sent;     // Number of samples sent
+    uint32_t n_summaries_sent;   // Number of window summaries sent (see data_thread_set_aggregation)
+    uint32_t n_bytes_sent;       // Number of bytes sent (samples, summaries and messages, after encoding)
+    uint32_t n_bursts;           // Number of times the ring buffer was drained at link speed (see data_thread_set_adaptive_send)
+    uint32_t n_wakeups;          // Number of times the data thread was woken up by new samples (see data_thread_set_latency_mode)
+} data_thread_stats_t;
+
+/**
+ * @brief Set the data rate at which sensor data will be sent over USB. On
+ *        each send period, all the samples queued are sent at once.
+ *
+ * @param send_rate The send rate in Hz (fractional rates are supported, max: RATE_MAX_HZ).
+ * @return 0 on success, negative errno on failure.
+ */
+int data_thread_set_send_rate(float send_rate);
+
+/**
+ * @brief Get the current send rate.
+ *
+ * @return The send rate in mHz.
+ */
+uint32_t data_thread_get_send_rate(void);
+
+/**
+ * @brief Enable (or disable) the adaptive send mode. Samples are still sent at the send
+ *        rate, but whenever the ring buffer fills up to its high-water mark the data thread
+ *        wakes up right away and sends the samples queued back to back (as fast as the USB
+ *        link takes them), until the buffer drains back to its low-water mark. So samples
+ *        are only lost when the link can't keep up with the data, and not when the send
+ *        rate is too slow for a burst of samples.
+ *
+ * @param enabled True to enable the adaptive send mode, false to send at a fixed rate.
+ */
+void data_thread_set_adaptive_send(bool enabled);
+
+/**
+ * @brief Enable (or disable) the latency mode. Instead of waiting for the next send period,
+ *        the data thread sleeps until the sensor thread signals that new samples were queued
+ *        (see data_thread_notify()), and sends them right away. So it never wakes up while
+ *        there is nothing to send, and the samples are sent as soon as they are read.
+ *
+ *        To send fewer (bigger) frames, the samples can be coalesced: once woken up, the
+ *        data thread waits for up to 'window_us' for up to 'n_samples' samples to be queued
+ *        before sending them.
+ *
+ * @param enabled True to enable the latency mode, false to send at the send rate.
+ * @param n_samples The max number of samples to coalesce (0 for no limit).
+ * @param window_us The max time to wait for more samples to coalesce (0 to send the samples
+ *                  right away, max: DATA_THREAD_MAX_COALESCE_US).
+ * @return 0 on success, negative errno on failure.
+ */
+int data_thread_set_latency_mode(bool enabled, uint32_t n_samples, uint32_t window_us);
+
+/**
+ * @brief Signal the data thread that new samples were queued in the ring buffer (only used
+ *        in latency mode, where it wakes the data thread up). Called by the sensor thread.
+ *
+ * @param n_samples The number of samples queued.
+ */
+void data_thread_notify(uint32_t n_samples);
+
+/**
+ * @brief Set the aggregation of a channel. Aggregated channels are sent as one summary
+ *        (min/max/mean/RMS) per window of samples instead of sample by sample (see
+ *        aggregator.h), which cuts down the USB bandwidth needed to monitor them.
+ *
+ * @param channel The channel (from 0 to SIM_SENSOR_MAX_CHANNELS - 1).
+ * @param window_samples The max number of samples per window (0 for no limit, max: DATA_THREAD_MAX_WINDOW_SAMPLES).
+ * @param window_ms The max duration of a window in ms (0 for no limit, max: DATA_THREAD_MAX_WINDOW_MS).
+ *                  Setting neither limit disables the aggregation.
+ * @return 0 on success, negative errno on failure.
+ */
+int data_thread_set_aggregation(uint8_t channel, uint32_t window_samples, float window_ms);
+
+/**
+ * @brief Get the timing stats of the send loop (periods elapsed, overruns and
+ *        wakeup jitter), since the send rate was last changed.
+ *
+ * @param stats The timing stats (output).
+ */
+void data_thread_get_timer_stats(rate_timer_stats_t* stats);
+
+/**
+ * @brief Get the send stats, since boot or since they were last reset.
+ *
+ * @param stats The send stats (output).
+ */
+void data_thread_get_stats(data_thread_stats_t* stats);
+
+/**
+ * @brief Reset the send stats and the timing stats of the send loop.
+ */
+void data_thread_reset_stats(void);
+
+/**
+ * @brief Send a text message over USB, in the same stream as the sensor data (so
+ *        it is encoded with the current stream mode and never splits a frame).
+ *
+ * @param message The null-terminated message (see STREAM_MESSAGE_MAX_SIZE).
+ * @return 0 on success, negative errno on failure.
+ */
+int data_thread_send_message(const char* message);
+
 /**
- * @brief Set the data rate at which sensor data will be sent over USB.
+ * @brief Set the mode used to stream the data (see stream_encoder_set_mode()), and declare
+ *        it at the start of the new stream with a "stream ..." message (see
+ *        stream_encoder_describe()), so the host knows how to decode the values.
  *
- * @param read_rate The send rate in Hz (max: 1000Hz).
+ * @param mode The stream mode.
+ * @return 0 on success, negative errno on failure.
  */
-void data_thread_set_send_rate(uint16_t send_rate);
+int data_thread_set_stream_mode(stream_mode_t mode);
 
 /**
  * @brief Start the data thread.
  *
  * @param ring_buffer The ring buffer used to store the sensor data.
  */
-void data_thread_start(ring_buffer_t* ring_buffer);
\ No newline at end of file
+void data_thread_start(sample_ring_t* ring_buffer);
\ No newline at end of file
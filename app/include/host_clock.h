@@ -0,0 +1,23 @@
+/**
+ * Created on Fri Dec 20 2024
+ *
+ * @brief Provides access to the host clock on native_sim builds.
+ *
+ *        On native_sim the app code runs in zero simulated time (the system clock only
+ *        moves forward while the app is idle), so the time taken by a piece of code can
+ *        only be measured with the clock of the host running the simulation.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Get the current time of the host monotonic clock.
+ *
+ * @return The host time in ns (from an arbitrary starting point).
+ *
+ * @note Only available on native_sim builds (see native/host_clock.c).
+ */
+uint64_t host_clock_get_ns(void);
@@ -0,0 +1,165 @@
+/**
+ * Created on Mon Dec 16 2024
+ *
+ * @brief Provides a periodic timer used to run a thread loop at a fixed rate.
+ *
+ *        Periods are scheduled in absolute system ticks from a time base, so they
+ *        never drift, and timers sharing the same base and rate expire at the exact
+ *        same ticks. Rates are set in mHz and period start times are computed with
+ *        integer arithmetic (see rate_clock_t), so any rate is hit exactly on average
+ *        even when the period is not a whole number of ticks.
+ *
+ *        The waiting thread is woken up at most once per period. Above a max wakeup
+ *        rate, several periods are served per wakeup instead (the caller gets the
+ *        start time of each of them). The timer also keeps track of the periods the
+ *        thread was late to serve (overruns) and of how late it was woken up (jitter).
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include <zephyr/kernel.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define RATE_MHZ_PER_HZ      1000
+#define RATE_MAX_HZ          50000   // Hz
+#define RATE_MAX_WAKEUP_RATE 4000    // Hz (higher rates serve several periods per wakeup)
+
+// Wakeup delays are also kept in a log2 histogram: bucket 0 counts delays of 0 us,
+// bucket 'i' delays of [2^(i-1), 2^i) us, and the last bucket everything above.
+#define RATE_TIMER_JITTER_BUCKETS 16
+
+// Convert a rate in Hz (float) to mHz
+#define RATE_HZ_TO_MHZ(rate) ((uint32_t) ((rate) * RATE_MHZ_PER_HZ + 0.5f))
+
+/* Type definitions */
+
+// Tracks the start of the periods of a given rate. Period 'k' starts at:
+//
+//   base + floor((k * TICKS_PER_SEC * 1000 + rem) / rate)   (ticks)
+//
+// The fractional part of the base ('rem / rate' ticks) is kept as an exact remainder,
+// so the clock can be moved forward (rebased) without ever accumulating rounding errors.
+typedef struct {
+    uint32_t rate;   // mHz
+    int64_t base;    // ticks
+    uint32_t rem;    // Fractional part of the base (in 1/rate ticks)
+} rate_clock_t;
+
+typedef struct {
+    uint32_t n_periods;                                // Number of periods served
+    uint32_t n_wakeups;                                // Number of times the thread was woken up
+    uint32_t n_overruns;                               // Number of periods that only started because the thread was late
+    uint32_t jitter_avg_us;                            // Average wakeup delay (after the scheduled wakeup time)
+    uint32_t jitter_max_us;                            // Max wakeup delay (after the scheduled wakeup time)
+    uint32_t jitter_hist[RATE_TIMER_JITTER_BUCKETS];   // Wakeup delays (log2 histogram)
+} rate_timer_stats_t;
+
+typedef struct {
+    struct k_timer timer;
+    struct k_spinlock lock;
+    rate_clock_t clock;       // Period 0 is the next period to be served
+    rate_clock_t served;      // Period 0 is the first period served on the last wakeup
+    int64_t wakeup;           // Scheduled time of the next wakeup (ticks)
+    bool woken;               // Set by rate_timer_wake() until the waiting thread returns
+    uint64_t jitter_sum_us;   // Sum of all the wakeup delays
+    rate_timer_stats_t stats;
+} rate_timer_t;
+
+/**
+ * @brief Initialize a rate clock.
+ *
+ * @param clock The rate clock.
+ * @param rate The rate in mHz (must not be 0).
+ * @param base The time at which period 0 starts, in system ticks.
+ */
+void rate_clock_init(rate_clock_t* clock, uint32_t rate, int64_t base);
+
+/**
+ * @brief Get the time at which a given period starts.
+ *
+ * @param clock The rate clock.
+ * @param index The period index.
+ * @return The period start time in system ticks.
+ */
+int64_t rate_clock_period_start(const rate_clock_t* clock, uint32_t index);
+
+/**
+ * @brief Get the number of periods that have started up to a given time (inclusive).
+ *
+ * @param clock The rate clock.
+ * @param time The time in system ticks.
+ * @return The number of periods started (0 if the time is before period 0).
+ */
+uint64_t rate_clock_periods_started(const rate_clock_t* clock, int64_t time);
+
+/**
+ * @brief Move the clock forward, so that period 'n_periods' becomes period 0.
+ *
+ * @param clock The rate clock.
+ * @param n_periods The number of periods to move forward.
+ */
+void rate_clock_advance(rate_clock_t* clock, uint64_t n_periods);
+
+/**
+ * @brief Initialize a rate timer (must be called before any other function).
+ *
+ * @param rate_timer The rate timer.
+ */
+void rate_timer_init(rate_timer_t* rate_timer);
+
+/**
+ * @brief (Re)start a rate timer. Periods start at the times given by a rate clock
+ *        with the given rate and base. The first period served is the latest one
+ *        that has already started (if any). This also resets the timer stats.
+ *
+ * @param rate_timer The rate timer.
+ * @param rate The timer rate in mHz (must not be 0).
+ * @param base The time base in system ticks (e.g. 0 to align with other timers).
+ */
+void rate_timer_start(rate_timer_t* rate_timer, uint32_t rate, int64_t base);
+
+/**
+ * @brief Block until the next period (or periods) must be served.
+ *
+ * @param rate_timer The rate timer.
+ * @return The number of periods to be served (see rate_timer_get_period_start), or 0 if
+ *         the thread was woken up by rate_timer_wake() before the next period started.
+ */
+uint32_t rate_timer_wait(rate_timer_t* rate_timer);
+
+/**
+ * @brief Wake up the thread waiting on a rate timer before its next period starts (if it
+ *        isn't waiting, its next wait returns right away). The periods are not affected.
+ *
+ * @param rate_timer The rate timer.
+ */
+void rate_timer_wake(rate_timer_t* rate_timer);
+
+/**
+ * @brief Get the start time of one of the periods returned by the last wait.
+ *
+ * @param rate_timer The rate timer.
+ * @param index The period index (from 0 to the number of periods returned - 1).
+ * @return The period start time in system ticks.
+ */
+int64_t rate_timer_get_period_start(rate_timer_t* rate_timer, uint32_t index);
+
+/**
+ * @brief Get the timer stats, since the timer was (re)started or its stats were reset.
+ *
+ * @param rate_timer The rate timer.
+ * @param stats The timer stats (output).
+ */
+void rate_timer_get_stats(rate_timer_t* rate_timer, rate_timer_stats_t* stats);
+
+/**
+ * @brief Reset the timer stats (without restarting the timer).
+ *
+ * @param rate_timer The rate timer.
+ */
+void rate_timer_reset_stats(rate_timer_t* rate_timer);
@@ -0,0 +1,96 @@
+/**
+ * Created on Sat Dec 21 2024
+ *
+ * @brief Polyphase FIR resampler, used to convert a stream of samples from one rate
+ *        (e.g. the sensor data rate) to any other rate (e.g. the rate the host asked for).
+ *
+ *        Each output sample is computed by a windowed-sinc low-pass FIR filter over the
+ *        last 'n_taps' input samples. The filter is precomputed for RESAMPLER_PHASES + 1
+ *        fractional offsets between two inputs (the polyphase bank), and each output uses
+ *        the bank entry nearest to its exact position. The filter cutoff follows the lower
+ *        of the two rates, so decimated streams are anti-aliased and interpolated streams
+ *        don't get any image frequencies.
+ *
+ *        Output positions are tracked with integer arithmetic (rates are set in mHz), so
+ *        the output rate is exact on average. Each output is delayed by n_taps / 2 inputs
+ *        (the filter needs them), but it is timestamped with the time it represents.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include "sample.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define RESAMPLER_MAX_TAPS 32   // max: 254 (must be even)
+#define RESAMPLER_PHASES   16   // Fractional offsets between two inputs (the output timing error is at most half of one)
+#define RESAMPLER_CUTOFF   0.9f // Filter cutoff, relative to the Nyquist frequency of the lower rate
+
+/* Type definitions */
+typedef struct {
+    uint32_t in_rate;    // mHz
+    uint32_t out_rate;   // mHz
+    uint8_t n_taps;
+    float coeffs[RESAMPLER_PHASES + 1][RESAMPLER_MAX_TAPS];
+    float history[2 * RESAMPLER_MAX_TAPS];   // Last n_taps inputs (stored twice, so they can always be read in one go)
+    float last_value;                        // Last input received
+    uint32_t first_timestamp_us;             // Capture time of the first input
+    uint64_t n_inputs;                       // Number of inputs received
+    uint64_t next_pos;                       // Position of the next output (integer part, in inputs)
+    uint32_t next_frac;                      // Position of the next output (fractional part, in 1/out_rate inputs)
+    uint32_t n_outputs;                      // Number of outputs produced (i.e. the index of the next output)
+    int64_t end_pos;                         // Position of the last input when the stream ended (-1 while ongoing)
+} resampler_t;
+
+/**
+ * @brief Initialize a resampler (and compute its filter bank).
+ *
+ * @param resampler The resampler.
+ * @param in_rate The input rate in mHz.
+ * @param out_rate The output rate in mHz.
+ * @param n_taps The number of filter taps (even, from 2 to RESAMPLER_MAX_TAPS). More taps
+ *               give a sharper filter at the cost of more processing and a longer delay.
+ * @return 0 on success, negative errno on failure.
+ */
+int resampler_init(resampler_t* resampler, uint32_t in_rate, uint32_t out_rate, uint8_t n_taps);
+
+/**
+ * @brief Drop all the inputs received, so a new stream can be started (the output indexes
+ *        restart from 0).
+ *
+ * @param resampler The resampler.
+ */
+void resampler_reset(resampler_t* resampler);
+
+/**
+ * @brief Feed the next input to the resampler.
+ *
+ * @param resampler The resampler.
+ * @param timestamp_us The capture time of the input.
+ * @param value The input value.
+ * @return 0 on success, -EBUSY if there are outputs still to be pulled (all the outputs
+ *         must be pulled before the next input is pushed), or -EINVAL if the stream ended.
+ */
+int resampler_push(resampler_t* resampler, uint32_t timestamp_us, sample_value_t value);
+
+/**
+ * @brief Mark the end of the input stream. The last inputs are held, so the outputs up to the
+ *        last input can still be pulled.
+ *
+ * @param resampler The resampler.
+ */
+void resampler_end(resampler_t* resampler);
+
+/**
+ * @brief Append all the outputs available (up to the space left in the block) to a block.
+ *
+ * @param resampler The resampler.
+ * @param channel The channel of the outputs.
+ * @param block The block the outputs are appended to (output).
+ * @return The number of outputs appended.
+ */
+uint16_t resampler_pull(resampler_t* resampler, uint8_t channel, sample_block_t* block);
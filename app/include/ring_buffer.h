@@ -2,7 +2,17 @@
  * Created on Mon Nov 25 2024
  *
  * @brief Simple ring buffer implementation, which keeps a static number of items in a FIFO order.
- *        Once full, the oldest items are discarded.
+ *        What happens once full depends on the buffer policy: the oldest items are overwritten
+ *        (the default), the new items are discarded, or the producer waits for a free slot
+ *        (up to a timeout, after which the new item is discarded).
+ *
+ *        The ring buffer is generated for a given item type (and capacity) by macros, so items
+ *        are copied as typed structs (no per-item size is kept) and the capacity is known at
+ *        compile time. The capacity must be a power of two, so the slot of an item is found
+ *        by masking its counter (instead of a division).
+ *
+ *        The buffer is lock-free and safe to use from a single producer and a single consumer
+ *        thread, even when both threads run in parallel on different cores (SMP).
  *
  * @note Zephyr RTOS provides it's own ring buffer implementation (zephyr/sys/ring_buffer.h),
  *       so I'm only adding this one for demonstration purposes.
@@ -11,40 +21,419 @@
  */
 #pragma once
 
+#include "sample.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 /* Constants */
-#define RING_BUFFER_MAX_ITEMS 10              // max: 65535
-#define RING_BUFFER_ITEM_SIZE sizeof(float)   // max: 255 bytes
+#define RING_BUFFER_MAX_CAPACITY 0x10000   // Keeps a lap of the producer far from the counter wrap-around (2^32)
+
+// Number of samples kept by the sample ring buffer (see CONFIG_APP_RING_BUFFER_SIZE)
+#define SAMPLE_RING_SIZE CONFIG_APP_RING_BUFFER_SIZE
 
 /* Type definitions */
+
+// What to do with a new item when the buffer is full
+typedef enum {
+    RING_BUFFER_DROP_OLDEST = 0,   // Overwrite the oldest item (the default)
+    RING_BUFFER_DROP_NEWEST = 1,   // Discard the new item (so the items kept have no gaps)
+    RING_BUFFER_BLOCK       = 2,   // Wait for the consumer to free up a slot (discarding the new item on timeout)
+    RING_BUFFER_POLICY_MAX_VALUE,
+} ring_buffer_policy_t;
+
+typedef enum {
+    RING_BUFFER_HIGH_WATERMARK,   // The number of items stored went up to the high-water mark
+    RING_BUFFER_LOW_WATERMARK,    // The number of items stored went back down to the low-water mark
+} ring_buffer_watermark_t;
+
+// Called when the number of items stored crosses a water mark (from the thread that made it
+// cross, so it must be short and must not block)
+typedef void (*ring_buffer_watermark_cb_t)(ring_buffer_watermark_t watermark, uint32_t count, void* user_data);
+
 typedef struct {
-    uint8_t items[RING_BUFFER_MAX_ITEMS][RING_BUFFER_ITEM_SIZE];
-    uint8_t sizes[RING_BUFFER_MAX_ITEMS];
-    uint16_t start_idx;
-    uint16_t end_idx;
-    uint16_t n_items;
-} ring_buffer_t;
+    uint32_t n_overwrites;        // Number of old items discarded because the buffer was full (drop oldest)
+    uint32_t n_dropped;           // Number of new items discarded because the buffer was full (drop newest, or block timeouts)
+    uint32_t n_waits;             // Number of times the producer waited for a free slot (block)
+    uint32_t n_high_watermarks;   // Number of times the high-water mark was reached
+    uint32_t peak_count;          // Max number of items stored at once
+} ring_buffer_stats_t;
 
 /**
- * @brief Add a new item to the ring buffer. This will copy the item to the buffer,
- *        overwriting the oldest item if the buffer is full.
+ * @brief Declare a ring buffer of 'capacity' items of type 'item_type', i.e. the buffer type
+ *        (name_t), the type of its spans (name_span_t) and its functions:
+ *
+ *        - void name_init(name_t* buffer)
+ *          Initialize (or reset) the ring buffer, which is then empty and set to drop the
+ *          oldest items once full, with no water marks.
+ *
+ *        - int name_set_policy(name_t* buffer, ring_buffer_policy_t policy, uint32_t timeout_ms)
+ *          Set what happens to new items when the buffer is full (safe to call from any
+ *          thread). The timeout is only used by the RING_BUFFER_BLOCK policy. Returns 0 on
+ *          success, negative errno on failure.
+ *
+ *        - int name_set_watermarks(name_t* buffer, uint32_t high, uint32_t low, ring_buffer_watermark_cb_t callback, void* user_data)
+ *          Set a callback called when the number of items stored goes up to 'high' items,
+ *          and when it then goes back down to 'low' items (0 < low < high <= capacity, or
+ *          high = 0 to disable). Must be called before the buffer is in use. Returns 0 on
+ *          success, negative errno on failure.
+ *
+ *        - int name_add(name_t* buffer, const item_type* item)
+ *          Add a new item to the ring buffer (copying it). If the buffer is full, the item
+ *          is handled according to the buffer policy. Returns 0 on success, -ENOBUFS if the
+ *          new item was discarded, or another negative errno on failure.
+ *
+ *        - int name_get(name_t* buffer, item_type* item)
+ *          Retrieve the oldest item from the ring buffer (and remove it). Returns 0 on
+ *          success, -ENODATA if the buffer is empty, or another negative errno on failure.
+ *
+ *        - int name_get_batch(name_t* buffer, item_type* items, uint32_t max_items, uint32_t* n_items)
+ *          Retrieve (and remove) all the items queued in the ring buffer in a single call,
+ *          up to a maximum number of items, in FIFO order. Returns 0 on success, negative
+ *          errno on failure.
  *
- * @param buffer The ring buffer to add the item to.
- * @param item The item to add.
- * @param item_size The size of the item do add.
- * @return 0 on success, negative errno on failure.
+ *        - int name_peek_contiguous(name_t* buffer, name_span_t spans[2])
+ *          Peek at all the items queued in the ring buffer without copying them. Since the
+ *          items may wrap around the end of the buffer they are returned in (up to) two
+ *          contiguous spans, in FIFO order (unused spans have no items). The items stay in
+ *          the buffer until they are released with name_consume(). Returns the total number
+ *          of items peeked, or negative errno on failure.
+ *
+ *        - int name_consume(name_t* buffer, uint32_t n_items)
+ *          Remove the first 'n_items' items returned by name_peek_contiguous() from the ring
+ *          buffer. Returns 0 on success, -EAGAIN if the producer overwrote some of the items
+ *          peeked in the meantime (in which case their contents can't be trusted and nothing
+ *          is removed), or another negative errno on failure.
+ *
+ *        - uint32_t name_count(name_t* buffer)
+ *          Get the number of items currently stored in the ring buffer.
+ *
+ *        - void name_get_stats(name_t* buffer, ring_buffer_stats_t* stats)
+ *          Get the ring buffer stats, since the buffer was created or its stats were reset.
+ *
+ *        - void name_reset_stats(name_t* buffer)
+ *          Reset the ring buffer stats (safe to call from any thread).
+ *
+ *        The add function must only be called from a single (producer) thread, and the
+ *        get/peek/consume functions from a single (consumer) thread. The functions are
+ *        implemented by RING_BUFFER_DEFINE().
+ *
+ * @param name The name of the ring buffer type (used as a prefix for its functions).
+ * @param item_type The type of the items stored.
+ * @param capacity The number of items stored (a power of two, up to RING_BUFFER_MAX_CAPACITY).
+ */
+#define RING_BUFFER_DECLARE(name, item_type, capacity)                                                                                       \
+    BUILD_ASSERT(IS_POWER_OF_TWO(capacity) && (capacity) <= RING_BUFFER_MAX_CAPACITY,                                                        \
+        "The capacity of a ring buffer must be a power of two (up to RING_BUFFER_MAX_CAPACITY)");                                            \
+                                                                                                                                             \
+    typedef struct {                                                                                                                         \
+        item_type items[capacity];                                                                                                           \
+        atomic_t head;           /* Counter of the next item to be written (only changed by the producer) */                                 \
+        atomic_t tail;           /* Counter of the oldest item stored (changed by the consumer, or by the producer when full) */             \
+        uint32_t peek_tail;      /* Counter of the oldest item returned by the last peek (only used by the consumer) */                      \
+        atomic_t policy;         /* ring_buffer_policy_t */                                                                                  \
+        atomic_t timeout_ms;     /* Max time the producer waits for a free slot (RING_BUFFER_BLOCK) */                                       \
+        atomic_t waiting;        /* Set while the producer waits for a free slot */                                                          \
+        struct k_sem space;      /* Given by the consumer when it frees up slots (while the producer waits) */                               \
+        uint32_t high;           /* High/low-water marks (0 if disabled) */                                                                  \
+        uint32_t low;                                                                                                                        \
+        ring_buffer_watermark_cb_t callback;                                                                                                 \
+        void* user_data;                                                                                                                     \
+        atomic_t above_high;     /* Set from the time the high-water mark is reached until the low-water mark is */                          \
+        atomic_t n_overwrites;                                                                                                               \
+        atomic_t n_dropped;                                                                                                                  \
+        atomic_t n_waits;                                                                                                                    \
+        atomic_t n_high_watermarks;                                                                                                          \
+        atomic_t peak_count;                                                                                                                 \
+    } name##_t;                                                                                                                              \
+                                                                                                                                             \
+    typedef struct {                                                                                                                         \
+        item_type* items;   /* First item of the span */                                                                                     \
+        uint32_t n_items;   /* Number of items in the span */                                                                                \
+    } name##_span_t;                                                                                                                         \
+                                                                                                                                             \
+    void name##_init(name##_t* buffer);                                                                                                      \
+    int name##_set_policy(name##_t* buffer, ring_buffer_policy_t policy, uint32_t timeout_ms);                                               \
+    int name##_set_watermarks(name##_t* buffer, uint32_t high, uint32_t low, ring_buffer_watermark_cb_t callback, void* user_data);          \
+    int name##_add(name##_t* buffer, const item_type* item);                                                                                 \
+    int name##_get(name##_t* buffer, item_type* item);                                                                                       \
+    int name##_get_batch(name##_t* buffer, item_type* items, uint32_t max_items, uint32_t* n_items);                                         \
+    int name##_peek_contiguous(name##_t* buffer, name##_span_t spans[2]);                                                                    \
+    int name##_consume(name##_t* buffer, uint32_t n_items);                                                                                  \
+    uint32_t name##_count(name##_t* buffer);                                                                                                 \
+    void name##_get_stats(name##_t* buffer, ring_buffer_stats_t* stats);                                                                     \
+    void name##_reset_stats(name##_t* buffer)
+
+/*
+ * The ring buffer is shared between a single producer (e.g. the sensor thread) and
+ * a single consumer (e.g. the data thread), which may run in parallel on different
+ * cores. No locks are used - instead:
+ *
+ * - The producer is the only one writing the 'head' counter. An item is fully
+ *   copied into its slot before 'head' is advanced past it, so the consumer
+ *   never sees a partially written item as available.
+ *
+ * - There is no shared item count (the count is derived from 'head - tail').
+ *
+ * - The 'tail' counter is normally advanced by the consumer, but when the buffer
+ *   is full the producer advances it too (to drop the oldest item). Both sides
+ *   only ever advance it through a compare-and-swap. The consumer copies an item
+ *   out first and only then tries to advance 'tail' - if that fails, the producer
+ *   has dropped (and possibly overwritten) the item mid-copy, so the copy is
+ *   discarded and the consumer retries with the next oldest item.
+ *
+ * - With the drop newest and block policies the producer never touches 'tail'.
+ *   To block, the producer flags that it is waiting and then checks 'tail' again
+ *   before sleeping on a semaphore, which the consumer gives after advancing
+ *   'tail' whenever the flag is set (so a wakeup can't be missed).
+ *
+ * - The counters are free-running 32-bit values. Since the capacity is a power of
+ *   two (so it divides 2^32), the slot of an item ('counter & (capacity - 1)') stays
+ *   continuous across their wrap-around, and the producer would have to add 2^32
+ *   items while the consumer copies a single one out for a counter to come back to
+ *   the same value.
+ *
+ * Zephyr's atomic operations are sequentially consistent (i.e. they also act as
+ * full memory barriers), so the item copies can't be reordered across them.
  */
-int ring_buffer_add(ring_buffer_t* buffer, void* item, uint8_t item_size);
 
 /**
- * @brief Retrieve the oldest item from the ring buffer (and remove it).
+ * @brief Implement the functions of a ring buffer declared with RING_BUFFER_DECLARE() (in a
+ *        single source file).
  *
- * @param buffer The ring buffer to get the item from.
- * @param item The item retrieved (output).
- * @param item_size The size of the item retrieved (output).
- * @return 0 on success, negative errno on failure.
+ * @param name The name of the ring buffer type.
+ * @param item_type The type of the items stored.
  */
-int ring_buffer_get(ring_buffer_t* buffer, void* item, uint8_t* item_size);
\ No newline at end of file
+#define RING_BUFFER_DEFINE(name, item_type)                                                                                                  \
+    static inline uint32_t name##_mask(const name##_t* buffer) { return ARRAY_SIZE(buffer->items) - 1; }                                     \
+                                                                                                                                             \
+    void name##_init(name##_t* buffer) {                                                                                                     \
+        memset(buffer, 0, sizeof(name##_t));                                                                                                 \
+        k_sem_init(&buffer->space, 0, 1);                                                                                                    \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    int name##_set_policy(name##_t* buffer, ring_buffer_policy_t policy, uint32_t timeout_ms) {                                              \
+        if (buffer == NULL || policy < 0 || policy >= RING_BUFFER_POLICY_MAX_VALUE) {                                                        \
+            return -EINVAL;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        atomic_set(&buffer->timeout_ms, timeout_ms);                                                                                         \
+        atomic_set(&buffer->policy, policy);                                                                                                 \
+                                                                                                                                             \
+        return 0;                                                                                                                            \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    int name##_set_watermarks(name##_t* buffer, uint32_t high, uint32_t low, ring_buffer_watermark_cb_t callback, void* user_data) {         \
+        if (buffer == NULL || (high > 0 && (callback == NULL || low == 0 || low >= high || high > ARRAY_SIZE(buffer->items)))) {             \
+            return -EINVAL;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        buffer->high      = high;                                                                                                            \
+        buffer->low       = low;                                                                                                             \
+        buffer->callback  = callback;                                                                                                        \
+        buffer->user_data = user_data;                                                                                                       \
+        atomic_set(&buffer->above_high, 0);                                                                                                  \
+                                                                                                                                             \
+        return 0;                                                                                                                            \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    /* Wait (up to the buffer timeout) for the consumer to free up a slot. Returns true if a slot is free. */                                \
+    static bool name##_wait_for_space(name##_t* buffer, uint32_t head) {                                                                     \
+        atomic_inc(&buffer->n_waits);                                                                                                        \
+                                                                                                                                             \
+        /* Flag the wait before checking the tail again, so the consumer either frees up a slot */                                           \
+        /* before the check, or sees the flag (and wakes the producer up) after it */                                                        \
+        k_sem_reset(&buffer->space);                                                                                                         \
+        atomic_set(&buffer->waiting, 1);                                                                                                     \
+        if (head - (uint32_t) atomic_get(&buffer->tail) >= ARRAY_SIZE(buffer->items)) {                                                      \
+            k_sem_take(&buffer->space, K_MSEC(atomic_get(&buffer->timeout_ms)));                                                             \
+        }                                                                                                                                    \
+        atomic_set(&buffer->waiting, 0);                                                                                                     \
+                                                                                                                                             \
+        return head - (uint32_t) atomic_get(&buffer->tail) < ARRAY_SIZE(buffer->items);                                                      \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    /* Called by the consumer after removing items (wakes the producer up, and checks the low-water mark) */                                 \
+    static void name##_on_removed(name##_t* buffer) {                                                                                        \
+        if (atomic_get(&buffer->waiting)) {                                                                                                  \
+            k_sem_give(&buffer->space);                                                                                                      \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        if (atomic_get(&buffer->above_high)) {                                                                                               \
+            uint32_t count = name##_count(buffer);                                                                                           \
+            if (count <= buffer->low && atomic_cas(&buffer->above_high, 1, 0)) {                                                             \
+                buffer->callback(RING_BUFFER_LOW_WATERMARK, count, buffer->user_data);                                                       \
+            }                                                                                                                                \
+        }                                                                                                                                    \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    int name##_add(name##_t* buffer, const item_type* item) {                                                                                \
+        if (buffer == NULL || item == NULL) {                                                                                                \
+            return -EINVAL;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        uint32_t head = atomic_get(&buffer->head);                                                                                           \
+        uint32_t tail = atomic_get(&buffer->tail);                                                                                           \
+                                                                                                                                             \
+        /* If the buffer is full, make room for the new item (or discard it) according to the policy */                                      \
+        if (head - tail >= ARRAY_SIZE(buffer->items)) {                                                                                      \
+            switch (atomic_get(&buffer->policy)) {                                                                                           \
+                case RING_BUFFER_DROP_NEWEST: atomic_inc(&buffer->n_dropped); return -ENOBUFS;                                               \
+                case RING_BUFFER_BLOCK:                                                                                                      \
+                    if (!name##_wait_for_space(buffer, head)) {                                                                              \
+                        atomic_inc(&buffer->n_dropped);                                                                                      \
+                        return -ENOBUFS;                                                                                                     \
+                    }                                                                                                                        \
+                    break;                                                                                                                   \
+                default:                                                                                                                     \
+                    /* Advance the tail (discarding the oldest item). If this fails the consumer */                                          \
+                    /* has just retrieved the oldest item, which frees up a slot all the same. */                                            \
+                    if (atomic_cas(&buffer->tail, tail, tail + 1)) {                                                                         \
+                        atomic_inc(&buffer->n_overwrites);                                                                                   \
+                    }                                                                                                                        \
+                    break;                                                                                                                   \
+            }                                                                                                                                \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        /* Then copy the item to the buffer, and publish it to the consumer */                                                               \
+        buffer->items[head & name##_mask(buffer)] = *item;                                                                                   \
+        atomic_set(&buffer->head, head + 1);                                                                                                 \
+                                                                                                                                             \
+        /* Keep track of the peak occupancy (only the producer ever raises it) */                                                            \
+        uint32_t count = name##_count(buffer);                                                                                               \
+        if (count > (uint32_t) atomic_get(&buffer->peak_count)) {                                                                            \
+            atomic_set(&buffer->peak_count, count);                                                                                          \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        /* And of the high-water mark */                                                                                                     \
+        if (buffer->high > 0 && count >= buffer->high && atomic_cas(&buffer->above_high, 0, 1)) {                                            \
+            atomic_inc(&buffer->n_high_watermarks);                                                                                          \
+            buffer->callback(RING_BUFFER_HIGH_WATERMARK, count, buffer->user_data);                                                          \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        return 0;                                                                                                                            \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    int name##_get(name##_t* buffer, item_type* item) {                                                                                      \
+        if (buffer == NULL || item == NULL) {                                                                                                \
+            return -EINVAL;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        while (true) {                                                                                                                       \
+            uint32_t tail = atomic_get(&buffer->tail);                                                                                       \
+            uint32_t head = atomic_get(&buffer->head);                                                                                       \
+            if (head == tail) {                                                                                                              \
+                return -ENODATA;                                                                                                             \
+            }                                                                                                                                \
+                                                                                                                                             \
+            /* Copy the oldest item, and remove it from the buffer (unless the producer discarded it mid-copy) */                            \
+            *item = buffer->items[tail & name##_mask(buffer)];                                                                               \
+            if (atomic_cas(&buffer->tail, tail, tail + 1)) {                                                                                 \
+                name##_on_removed(buffer);                                                                                                   \
+                return 0;                                                                                                                    \
+            }                                                                                                                                \
+        }                                                                                                                                    \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    int name##_peek_contiguous(name##_t* buffer, name##_span_t spans[2]) {                                                                   \
+        if (buffer == NULL || spans == NULL) {                                                                                               \
+            return -EINVAL;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        uint32_t tail = atomic_get(&buffer->tail);                                                                                           \
+        uint32_t head = atomic_get(&buffer->head);                                                                                           \
+                                                                                                                                             \
+        /* Only the latest items are valid if the producer has lapped the tail read above */                                                 \
+        uint32_t n_items = MIN(head - tail, ARRAY_SIZE(buffer->items));                                                                      \
+        uint32_t start   = tail & name##_mask(buffer);                                                                                       \
+                                                                                                                                             \
+        /* Split the items into the ones up to the end of the buffer and the ones wrapped around */                                          \
+        spans[0].items   = &buffer->items[start];                                                                                            \
+        spans[0].n_items = MIN(n_items, ARRAY_SIZE(buffer->items) - start);                                                                  \
+        spans[1].items   = &buffer->items[0];                                                                                                \
+        spans[1].n_items = n_items - spans[0].n_items;                                                                                       \
+                                                                                                                                             \
+        buffer->peek_tail = tail;                                                                                                            \
+                                                                                                                                             \
+        return n_items;                                                                                                                      \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    int name##_consume(name##_t* buffer, uint32_t n_items) {                                                                                 \
+        if (buffer == NULL) {                                                                                                                \
+            return -EINVAL;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        /* Advance the tail past the items consumed. If the producer has advanced it since */                                                \
+        /* the items were peeked, they may have been overwritten while being used. */                                                        \
+        uint32_t tail = buffer->peek_tail;                                                                                                   \
+        if (!atomic_cas(&buffer->tail, tail, tail + n_items)) {                                                                              \
+            return -EAGAIN;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        buffer->peek_tail = tail + n_items;                                                                                                  \
+        name##_on_removed(buffer);                                                                                                           \
+                                                                                                                                             \
+        return 0;                                                                                                                            \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    int name##_get_batch(name##_t* buffer, item_type* items, uint32_t max_items, uint32_t* n_items) {                                        \
+        if (buffer == NULL || items == NULL || n_items == NULL) {                                                                            \
+            return -EINVAL;                                                                                                                  \
+        }                                                                                                                                    \
+                                                                                                                                             \
+        name##_span_t spans[2] = {0};                                                                                                        \
+        int ret                = 0;                                                                                                          \
+                                                                                                                                             \
+        do {                                                                                                                                 \
+            *n_items = 0;                                                                                                                    \
+                                                                                                                                             \
+            /* Copy the items queued (up to the max number requested) */                                                                     \
+            ret = name##_peek_contiguous(buffer, spans);                                                                                     \
+            if (ret < 0) {                                                                                                                   \
+                return ret;                                                                                                                  \
+            }                                                                                                                                \
+                                                                                                                                             \
+            for (int i = 0; i < ARRAY_SIZE(spans) && *n_items < max_items; i++) {                                                            \
+                uint32_t n_copy = MIN(spans[i].n_items, max_items - *n_items);                                                               \
+                memcpy(&items[*n_items], spans[i].items, n_copy * sizeof(item_type));                                                        \
+                *n_items += n_copy;                                                                                                          \
+            }                                                                                                                                \
+                                                                                                                                             \
+            /* Remove them from the buffer (retrying if the producer discarded any of them mid-copy) */                                      \
+            ret = name##_consume(buffer, *n_items);                                                                                          \
+        } while (ret == -EAGAIN);                                                                                                            \
+                                                                                                                                             \
+        return ret;                                                                                                                          \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    uint32_t name##_count(name##_t* buffer) {                                                                                                \
+        uint32_t tail = atomic_get(&buffer->tail);                                                                                           \
+        uint32_t head = atomic_get(&buffer->head);                                                                                           \
+        return MIN(head - tail, ARRAY_SIZE(buffer->items));                                                                                  \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    void name##_get_stats(name##_t* buffer, ring_buffer_stats_t* stats) {                                                                    \
+        stats->n_overwrites      = atomic_get(&buffer->n_overwrites);                                                                        \
+        stats->n_dropped         = atomic_get(&buffer->n_dropped);                                                                           \
+        stats->n_waits           = atomic_get(&buffer->n_waits);                                                                             \
+        stats->n_high_watermarks = atomic_get(&buffer->n_high_watermarks);                                                                   \
+        stats->peak_count        = atomic_get(&buffer->peak_count);                                                                          \
+    }                                                                                                                                        \
+                                                                                                                                             \
+    void name##_reset_stats(name##_t* buffer) {                                                                                              \
+        atomic_set(&buffer->n_overwrites, 0);                                                                                                \
+        atomic_set(&buffer->n_dropped, 0);                                                                                                   \
+        atomic_set(&buffer->n_waits, 0);                                                                                                     \
+        atomic_set(&buffer->n_high_watermarks, 0);                                                                                           \
+        atomic_set(&buffer->peak_count, 0);                                                                                                  \
+    }
+
+// The ring buffer used to carry the samples from the sensor thread to the data thread
+RING_BUFFER_DECLARE(sample_ring, sample_t, SAMPLE_RING_SIZE);
@@ -0,0 +1,87 @@
+/**
+ * Created on Tue Dec 17 2024
+ *
+ * @brief Defines the record used to carry each sensor sample from the sensor thread
+ *        to the host (through the ring buffer and the stream encoder).
+ *
+ *        Besides the value, each sample carries the channel and the index of the sensor
+ *        sample it was read from, and the time at which it was captured. This allows the
+ *        host to tell duplicated reads from repeated values, and to count the samples
+ *        missed or overwritten along the way.
+ *
+ *        Values are floats by default. With CONFIG_APP_FIXED_POINT_SAMPLES they are signed
+ *        Q-format fixed-point integers instead (int16 or int32, with SAMPLE_VALUE_FRAC_BITS
+ *        fractional bits), which are smaller and need no float support to be processed
+ *        or printed.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include <stdint.h>
+
+/* Constants */
+#define SAMPLE_BLOCK_MAX_SAMPLES 64
+
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+#define SAMPLE_VALUE_FRAC_BITS CONFIG_APP_SAMPLE_VALUE_FRAC_BITS
+#if defined(CONFIG_APP_SAMPLE_VALUE_INT32)
+#define SAMPLE_VALUE_MIN INT32_MIN
+#define SAMPLE_VALUE_MAX INT32_MAX
+#else
+#define SAMPLE_VALUE_MIN INT16_MIN
+#define SAMPLE_VALUE_MAX INT16_MAX
+#endif
+#endif
+
+/* Type definitions */
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES) && defined(CONFIG_APP_SAMPLE_VALUE_INT32)
+typedef int32_t sample_value_t;   // Q-format (value * 2^SAMPLE_VALUE_FRAC_BITS)
+#elif defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+typedef int16_t sample_value_t;   // Q-format (value * 2^SAMPLE_VALUE_FRAC_BITS)
+#else
+typedef float sample_value_t;
+#endif
+
+typedef struct {
+    uint32_t index;          // Index of the sensor sample (since the pattern was started)
+    uint32_t timestamp_us;   // Capture time since boot (wraps around every ~71 minutes)
+    sample_value_t value;
+    uint8_t channel;         // Sensor channel the sample was read from
+} sample_t;
+
+// A block of samples (from any channel, in the order they were read) laid out as a
+// structure of arrays, so that each field can be processed in bulk by later stages.
+typedef struct {
+    uint16_t n_samples;
+    uint8_t channel[SAMPLE_BLOCK_MAX_SAMPLES];
+    uint32_t index[SAMPLE_BLOCK_MAX_SAMPLES];
+    uint32_t timestamp_us[SAMPLE_BLOCK_MAX_SAMPLES];
+    sample_value_t value[SAMPLE_BLOCK_MAX_SAMPLES];
+} sample_block_t;
+
+// Convert a float to a sample value (fixed-point values are rounded to the nearest step,
+// and saturated to their range)
+static inline sample_value_t sample_value_from_float(float value) {
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+    float scaled = value * (float) (1UL << SAMPLE_VALUE_FRAC_BITS);
+    if (!(scaled > (float) SAMPLE_VALUE_MIN)) {
+        return SAMPLE_VALUE_MIN;
+    }
+    if (scaled >= (float) SAMPLE_VALUE_MAX) {
+        return SAMPLE_VALUE_MAX;
+    }
+    return (sample_value_t) ((scaled >= 0) ? scaled + 0.5f : scaled - 0.5f);
+#else
+    return value;
+#endif
+}
+
+// Convert a sample value to a float
+static inline float sample_value_to_float(sample_value_t value) {
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+    return (float) value / (float) (1UL << SAMPLE_VALUE_FRAC_BITS);
+#else
+    return value;
+#endif
+}
@@ -0,0 +1,69 @@
+/**
+ * Created on Mon Dec 23 2024
+ *
+ * @brief Lossless compression of blocks of samples, used by the compressed stream mode (the
+ *        binary stream mode packs the channels, indexes and timestamps the same way too).
+ *
+ *        Consecutive samples of a channel are highly correlated (e.g. ramps, or constant
+ *        values), so each field is encoded against the previous sample of the same channel
+ *        (in the same block), one field (column) after the other:
+ *
+ *          | channel (u8 * n) | index (varint * n) | timestamp_us (varint * n) | value (bits) |
+ *
+ *        - index: the difference to the previous index, zigzag encoded as a LEB128 varint
+ *          (1 byte for consecutive samples).
+ *        - timestamp_us: the difference between the last two time deltas (delta of delta),
+ *          zigzag encoded as a LEB128 varint (1 byte for a steady read rate).
+ *        - value: XOR with the previous value, Gorilla style. A '0' bit for an unchanged
+ *          value, '10' + the meaningful bits if they fit the previous leading/trailing zeros,
+ *          or '11' + leading zeros (5 bits) + meaningful length - 1 (5 bits) + the meaningful
+ *          bits otherwise. The bitstream is written MSB first, and padded to a whole byte.
+ *          Fixed-point values are integers, so they are sent as the difference to the
+ *          previous value instead, zigzag encoded as a LEB128 varint (1 byte for steps of
+ *          up to +-63).
+ *
+ *        The first sample of each channel is encoded against an all-zero sample, so each
+ *        block can be decoded on its own.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include "sample.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+// Max number of bytes needed to compress a given number of samples (channel + 2 varints + value bits)
+#define SAMPLE_CODEC_MAX_SIZE(n_samples) ((n_samples) * (1 + 5 + 5 + 6))
+
+// Max number of bytes needed to pack the channels, indexes and timestamps of a given number of samples
+#define SAMPLE_CODEC_HEADER_MAX_SIZE(n_samples) ((n_samples) * (1 + 5 + 5))
+
+/**
+ * @brief Compress a range of samples of a block.
+ *
+ * @param block The samples to compress.
+ * @param first The first sample of the block to compress.
+ * @param n_samples The number of samples to compress.
+ * @param buffer Buffer to store the compressed data (output).
+ * @param buffer_len The size of the buffer (see SAMPLE_CODEC_MAX_SIZE).
+ * @return The number of bytes written on success, negative errno on failure.
+ */
+int sample_codec_compress(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* buffer, size_t buffer_len);
+
+/**
+ * @brief Pack the channels, indexes and timestamps of a range of samples of a block, the same
+ *        way they are compressed (but leaving the values out). Used by the binary stream mode,
+ *        which sends the values raw right after them.
+ *
+ * @param block The samples to pack.
+ * @param first The first sample of the block to pack.
+ * @param n_samples The number of samples to pack.
+ * @param buffer Buffer to store the packed fields (output).
+ * @param buffer_len The size of the buffer (see SAMPLE_CODEC_HEADER_MAX_SIZE).
+ * @return The number of bytes written on success, negative errno on failure.
+ */
+int sample_codec_pack_header(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* buffer, size_t buffer_len);
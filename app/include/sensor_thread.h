@@ -8,22 +8,83 @@
  */
 #pragma once
 
+#include "rate_timer.h"
 #include "ring_buffer.h"
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Constants */
+#define SENSOR_THREAD_MAX_OVERFLOW_TIMEOUT_MS 60000   // Max time the sensor thread waits for a free slot in the ring buffer
+
+/**
+ * @brief Set the data rate at which sensor data will be read from a channel.
+ *
+ * @param channel The channel (from 0 to SIM_SENSOR_MAX_CHANNELS - 1).
+ * @param read_rate The read rate in Hz (fractional rates are supported, max: RATE_MAX_HZ).
+ *                  For resampled channels, this is the rate of the resampled samples.
+ * @return 0 on success, negative errno on failure.
+ */
+int sensor_thread_set_read_rate(uint8_t channel, float read_rate);
+
+/**
+ * @brief Get the current read rate of a channel.
+ *
+ * @param channel The channel.
+ * @return The read rate in mHz (0 if the channel is invalid).
+ */
+uint32_t sensor_thread_get_read_rate(uint8_t channel);
+
+/**
+ * @brief Enable (or disable) the resampling of a channel. Resampled channels are read once
+ *        per sensor sample (at the data rate), and their samples are then resampled to the
+ *        read rate with a polyphase FIR filter (see resampler.h). This gives an anti-aliased
+ *        stream at exactly the read rate, with no duplicated or skipped samples.
+ *
+ *        Resampled samples are indexed from 0 (when the simulation starts) at the read rate.
+ *        Up to CONFIG_APP_RESAMPLER_MAX_CHANNELS channels can be resampled at the same time.
+ *
+ * @param channel The channel (from 0 to SIM_SENSOR_MAX_CHANNELS - 1).
+ * @param n_taps The number of filter taps (even, up to RESAMPLER_MAX_TAPS), or 0 to disable
+ *               the resampling.
+ * @return 0 on success, -ENOMEM if as many channels are already resampled, or another
+ *         negative errno on failure.
+ */
+int sensor_thread_set_resampling(uint8_t channel, uint8_t n_taps);
+
 /**
- * @brief Set the data rate at which sensor data will be read
+ * @brief Set what happens to the new samples read when the ring buffer is full: the oldest
+ *        samples queued are overwritten (the default), the new samples are discarded (so
+ *        the samples queued have no gaps), or the sensor thread waits for the data thread
+ *        to free up a slot (up to a timeout, after which the new sample is discarded).
  *
- * @param read_rate The read rate in Hz (max: 1000Hz).
+ *        While the sensor thread waits, the reads due are delayed (and samples produced by
+ *        the sensor in the meantime may be skipped).
+ *
+ * @param policy The overflow policy.
+ * @param timeout_ms The max time to wait for a free slot (only used by RING_BUFFER_BLOCK, max: SENSOR_THREAD_MAX_OVERFLOW_TIMEOUT_MS).
+ * @return 0 on success, negative errno on failure.
+ */
+int sensor_thread_set_overflow_policy(ring_buffer_policy_t policy, uint32_t timeout_ms);
+
+/**
+ * @brief Get the timing stats of the read loop (periods elapsed, overruns and
+ *        wakeup jitter), since the fastest read rate was last changed. The loop
+ *        runs at the fastest read rate of all channels.
+ *
+ * @param stats The timing stats (output).
+ */
+void sensor_thread_get_timer_stats(rate_timer_stats_t* stats);
+
+/**
+ * @brief Reset the timing stats of the read loop.
  */
-void sensor_thread_set_read_rate(uint16_t read_rate);
+void sensor_thread_reset_timer_stats(void);
 
 /**
  * @brief Start the sensor thread.
  *
  * @param ring_buffer The ring buffer used to store the sensor data.
  */
-void sensor_thread_start(ring_buffer_t* ring_buffer);
\ No newline at end of file
+void sensor_thread_start(sample_ring_t* ring_buffer);
\ No newline at end of file
@@ -3,15 +3,29 @@
  *
  * @brief Provides methods to simulate sensor data.
  *
+ *        Up to SIM_SENSOR_MAX_CHANNELS independent channels are simulated (e.g. an IMU,
+ *        a temperature and a pressure sensor), each one with its own pattern and rate.
+ *
  * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
  */
 #pragma once
 
+#include "rate_timer.h"
+#include "sample.h"
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Constants */
+#define SIM_SENSOR_MAX_CHANNELS 16   // max: 255
+#define SIM_SENSOR_PLAYLIST_SIZE 8    // Patterns queued per channel (see sim_sensor_queue_pattern())
+
+/* Type definitions */
 typedef enum {
+    // No pattern: stops the current simulation (only valid when starting a pattern).
+    PATTERN_NONE = -1,
+
     // The sensor will repeatedly return a the same value until
     // a certain number of samples is reached.
     // arg1: constant value
@@ -38,32 +52,94 @@ typedef enum {
     // arg2: maximum value (inclusive)
     // arg3: number of samples
     PATTERN_RANDOM = 3,
+
+    // The sensor will return a periodic waveform (centered on 0) until
+    // a certain number of samples is reached. Waveforms are generated from
+    // a phase accumulator (and a sine lookup table), without libm calls.
+    // Noise can be overlaid on them (see sim_sensor_set_noise()).
+    // arg1: amplitude
+    // arg2: period, in samples (fractional periods are supported, min: 2)
+    // arg3: number of samples
+    PATTERN_SINE     = 4,
+    PATTERN_SQUARE   = 5,
+    PATTERN_TRIANGLE = 6,
+    PATTERN_SAWTOOTH = 7,
+
+    // The sensor will return a sine wave whose frequency increases linearly
+    // from 0 until a certain number of samples is reached (noise can be
+    // overlaid on it, like on the periodic waveforms).
+    // arg1: amplitude
+    // arg2: period at the last sample, in samples (min: 2)
+    // arg3: number of samples
+    PATTERN_CHIRP = 8,
+
+    // The sensor will repeatedly return a value with noise added to it (with
+    // a triangular distribution) until a certain number of samples is reached.
+    // arg1: value
+    // arg2: noise amplitude (peak)
+    // arg3: number of samples
+    PATTERN_NOISE = 9,
+
+    PATTERN_MAX_VALUE,
 } sim_sensor_pattern_t;
 
+typedef struct {
+    uint32_t n_produced;     // Number of samples produced by the sensor (up to the last one read)
+    uint32_t n_read;         // Number of samples read
+    uint32_t n_duplicated;   // Number of reads that returned the same sample as the previous read
+    uint32_t n_skipped;      // Number of samples produced that were never read
+} sim_sensor_stats_t;
+
+/**
+ * @brief Set the data rate at which simulated data will be produced on a channel.
+ *
+ * @param channel The channel (from 0 to SIM_SENSOR_MAX_CHANNELS - 1).
+ * @param data_rate The data rate in Hz (fractional rates are supported, max: RATE_MAX_HZ).
+ * @return 0 on success, negative errno on failure.
+ */
+int sim_sensor_set_data_rate(uint8_t channel, float data_rate);
+
 /**
- * @brief Set the data rate at which simulated data will be produced.
+ * @brief Get the current data rate of a channel.
  *
- * @param data_rate The data rate in Hz (max: 1000Hz).
+ * @param channel The channel.
+ * @return The data rate in mHz (0 if the channel is invalid).
  */
-void sim_sensor_set_data_rate(uint16_t data_rate);
+uint32_t sim_sensor_get_data_rate(uint8_t channel);
 
 /**
- * @brief Get the current period between simulated data samples.
+ * @brief Overlay noise (with a triangular distribution) on the waveform patterns of a
+ *        channel (sine, square, triangle, sawtooth and chirp). This applies to the pattern
+ *        being simulated, from its next samples on, and to the patterns played after it.
  *
- * @return The sample period in milliseconds.
+ * @param channel The channel (from 0 to SIM_SENSOR_MAX_CHANNELS - 1).
+ * @param amplitude The noise amplitude (peak), or 0 for no noise.
+ * @return 0 on success, negative errno on failure.
  */
-uint16_t sim_sensor_get_sample_period(void);
+int sim_sensor_set_noise(uint8_t channel, float amplitude);
 
 /**
- * @brief Start the simulation of a given data pattern. Once the pattern
- *        is started, data will be produced at the data rate set until a
- *        certain stop condition (pattern-specific) is reached, at which
- *        point no more data will be produced.
+ * @brief Get the time base of the simulated samples of a channel. Samples are produced
+ *        at the data rate from this point on (see rate_clock_t), until it is changed.
  *
+ * @param channel The channel.
+ * @return The time base in system ticks (since boot).
+ */
+int64_t sim_sensor_get_time_base(uint8_t channel);
+
+/**
+ * @brief Start the simulation of a given data pattern on a channel. Once
+ *        the pattern is started, data will be produced at the data rate set
+ *        until a certain stop condition (pattern-specific) is reached, at
+ *        which point no more data will be produced. Starting PATTERN_NONE
+ *        stops the current simulation.
+ *
+ * @param channel The channel.
  * @param pattern The pattern to be simulated.
  * @param arg1 The first argument for the pattern.
  * @param arg2 The second argument for the pattern.
  * @param arg3 The third argument for the pattern.
+ * @return 0 on success, negative errno on failure.
  *
  * @note There are several ways I could have passed the arguments of the
  *       pattern here (e.g. a union struct, void pointers, etc). I chose
@@ -71,22 +147,115 @@ uint16_t sim_sensor_get_sample_period(void);
  *       be the simplest way to send the arguments over USB and directly
  *       pass them into this function.
  */
-void sim_sensor_start_pattern(sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3);
+int sim_sensor_start_pattern(uint8_t channel, sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3);
+
+/**
+ * @brief Queue a pattern to be simulated on a channel, right after the patterns already
+ *        queued (or right away, if no simulation is ongoing). Patterns queued are played
+ *        back to back with no gap in between: each one starts right when the first sample
+ *        the previous one didn't produce would have been produced, and the sample indexes
+ *        carry on from the previous pattern. So long stimulus profiles can be simulated
+ *        without any host round trip. Starting a pattern with sim_sensor_start_pattern()
+ *        clears the patterns queued.
+ *
+ * @param channel The channel.
+ * @param pattern The pattern to be simulated.
+ * @param arg1 The first argument for the pattern.
+ * @param arg2 The second argument for the pattern.
+ * @param arg3 The third argument for the pattern.
+ * @param data_rate The data rate in Hz the pattern is simulated at (0 to keep the current one).
+ * @param n_repeats The number of times the pattern is played again once it ends (0 to play
+ *                  it once). Patterns that don't produce any samples are not repeated.
+ * @return 0 on success, -ENOBUFS if SIM_SENSOR_PLAYLIST_SIZE patterns are already queued,
+ *         or another negative errno on failure.
+ */
+int sim_sensor_queue_pattern(uint8_t channel, sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3, float data_rate,
+    uint32_t n_repeats);
 
 /**
- * @brief Check if a new simulated sensor sample is ready to be read.
+ * @brief Check if a simulation is ongoing on a channel.
  *
+ * @param channel The channel.
+ * @return True if a pattern is being simulated, false otherwise.
+ */
+bool sim_sensor_is_running(uint8_t channel);
+
+/**
+ * @brief Check if a new simulated sensor sample is ready to be read on a channel.
+ *
+ * @param channel The channel.
  * @return True if a new sample is ready, false otherwise.
  */
-bool sim_sensor_new_sample_ready(void);
+bool sim_sensor_new_sample_ready(uint8_t channel);
+
+/**
+ * @brief Retrieve a simulated sensor sample. It will be up to the user to
+ *        make sure this function is called exactly once per sample period.
+ *        Calling this function more than once per sample period will result
+ *        in duplicated data (just like a real sensor would), which can be
+ *        told apart by the sample index.
+ *
+ * @param channel The channel.
+ * @param sample The simulated sensor sample, along with its channel, index
+ *               and capture time (output).
+ * @return 0 on success, -ENODATA if no simulation is currently ongoing.
+ */
+int sim_sensor_read_sample(uint8_t channel, sample_t* sample);
 
 /**
- * @brief Retrieve a simulated sensor sample. Returns NaN if no simulation
- *        is currently ongoing. It will be up to the user to make sure this
- *        function is called exactly once per sample period. Calling this
- *        function more than once per sample period will result in duplicated
- *        data (just like a real sensor would).
+ * @brief Same as sim_sensor_read_sample(), but reads the sample the sensor produced at
+ *        a given point in time. This allows readers that wake up once for several read
+ *        periods (at high read rates) to read each sample exactly when it was due.
  *
- * @return The simulated sensor sample (or NaN).
+ * @param channel The channel.
+ * @param time The read time in system ticks (must not be earlier than the previous read).
+ * @param sample The simulated sensor sample, captured at the given time (output).
+ * @return 0 on success, -ENODATA if no simulation is ongoing at the given time.
+ */
+int sim_sensor_read_sample_at(uint8_t channel, int64_t time, sample_t* sample);
+
+/**
+ * @brief Read all the samples the sensor produced at the start of a number of read periods
+ *        in one go (e.g. all the reads due on a reader wakeup). The samples are appended to
+ *        a block, and their values are generated with a single call to the pattern's block
+ *        function (see sim_sensor_generate_block()), or one call per pattern if the reads
+ *        span several patterns queued. The values are generated with the interrupts on (the
+ *        simulation is only locked to take a snapshot of the channel, and to update it).
+ *
+ * @param channel The channel.
+ * @param read_clock The clock of the reader (reads are done at the start of its periods
+ *                   0 to 'n_reads' - 1, which must not be earlier than the previous read).
+ * @param n_reads The number of reads (limited to the space left in the block).
+ * @param block The block the samples are appended to (output).
+ * @return The number of samples read (fewer than 'n_reads' if the simulation ended or had not
+ *         started yet at some of the read times), or negative errno on failure.
+ */
+int sim_sensor_read_block_at(uint8_t channel, const rate_clock_t* read_clock, uint16_t n_reads, sample_block_t* block);
+
+/**
+ * @brief Generate the values of a block of samples of a given pattern, without touching the
+ *        state of any channel (used to benchmark the patterns). No noise is overlaid.
+ *
+ * @param pattern The pattern to be simulated.
+ * @param arg1 The first argument for the pattern.
+ * @param arg2 The second argument for the pattern.
+ * @param arg3 The third argument for the pattern.
+ * @param index The index of each sample (since the pattern was started).
+ * @param out The value of each sample (output).
+ * @param n The number of samples.
+ * @return The number of valid samples generated (the pattern ends at the first invalid sample).
+ */
+size_t sim_sensor_generate_block(sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3, const uint32_t* index, sample_value_t* out,
+    size_t n);
+
+/**
+ * @brief Get the simulation stats (of all channels), since boot or since they were last reset.
+ *
+ * @param stats The simulation stats (output).
+ */
+void sim_sensor_get_stats(sim_sensor_stats_t* stats);
+
+/**
+ * @brief Reset the simulation stats.
  */
-float sim_sensor_read_sample(void);
\ No newline at end of file
+void sim_sensor_reset_stats(void);
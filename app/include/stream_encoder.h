@@ -0,0 +1,153 @@
+/**
+ * Created on Mon Dec 09 2024
+ *
+ * @brief Provides methods to encode sensor samples before they are sent over USB.
+ *
+ *        Besides samples, short text messages (e.g. telemetry reports) can be sent in
+ *        the same stream. Three stream modes are supported:
+ *
+ *        - Text: each sample is sent as a "<channel> <index> <timestamp_us> <value>\n" line, with
+ *          the value printed as "%.1f" (easy to read on a terminal). Fixed-point values are
+ *          printed with all their decimals (up to STREAM_TEXT_MAX_DECIMALS), using integer
+ *          math only. Messages are sent as "# <message>\n" lines, and window summaries (see
+ *          aggregator.h) as "S <channel> <index> <timestamp_us> <n_samples> <min> <max> <mean>
+ *          <rms>\n" lines.
+ *
+ *        - Binary: samples are sent in frames, each one delimited by a 0x00 byte and
+ *          encoded with COBS (Consistent Overhead Byte Stuffing) so that 0x00 never
+ *          shows up inside a frame. Before COBS encoding, a frame is laid out as
+ *          (all fields little-endian):
+ *
+ *            | type (u8) | seq (u16) | n_samples (u8) | samples | crc (u16) |
+ *
+ *          where the samples are laid out one field after the other (as in sample_block_t):
+ *
+ *            | channel (u8 * n) | index (varint * n) | timestamp_us (varint * n) | value (f32 * n) |
+ *
+ *          The indexes and timestamps are packed as in the compressed stream mode (see
+ *          sample_codec.h): zigzag LEB128 varints of the index delta and of the time delta of
+ *          delta, against the previous sample of the same channel in the frame. Samples read at
+ *          a steady rate take 1 byte each, so a sample takes 7 bytes (against about 20 in text
+ *          mode), and 15 bytes at most. With fixed-point samples, values are sent as their raw
+ *          integers (i16 or i32) instead, and the sample size shrinks accordingly (e.g. 5 bytes
+ *          with i16 values).
+ *
+ *          Message frames have the same layout, with a text (u8 * n) payload instead. So do
+ *          summary frames, with n summaries (29 bytes each) laid out one field after the other:
+ *
+ *            | channel (u8 * n) | index (u32 * n) | timestamp_us (u32 * n) | n_samples (u32 * n) |
+ *            | min (f32 * n) | max (f32 * n) | mean (f32 * n) | rms (f32 * n) |
+ *
+ *          The sequence number is increased on every frame (so lost frames can be
+ *          detected), and the CRC (CRC-16/CCITT-FALSE) covers all the previous fields.
+ *
+ *        - Compressed: same as binary, but samples are sent in compressed frames, with
+ *          the samples compressed as described in sample_codec.h (each frame can still
+ *          be decoded on its own):
+ *
+ *            | type (u8) | seq (u16) | n_samples (u8) | compressed samples | crc (u16) |
+ *
+ *        The format of the values is declared once per stream, when the stream mode is set, with
+ *        a "stream mode=<mode> value=<format>" message (where the format is "f32" for floats, or
+ *        "i<bits>q<fractional bits>" for fixed-point values, e.g. "i16q4").
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include "aggregator.h"
+#include "sample.h"
+#include "sample_codec.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+#define STREAM_FRAME_MAX_SAMPLES     SAMPLE_BLOCK_MAX_SAMPLES            // samples per binary frame
+#define STREAM_FRAME_SAMPLE_SIZE     (11 + sizeof(sample_value_t))       // max bytes per binary sample
+#define STREAM_TEXT_SAMPLE_MAX_SIZE  48                                  // bytes per text sample
+#define STREAM_MESSAGE_MAX_SIZE      255                                 // bytes per message
+#define STREAM_FRAME_MAX_SUMMARIES   SUMMARY_BLOCK_MAX_SUMMARIES         // summaries per binary frame
+#define STREAM_FRAME_SUMMARY_SIZE    (13 + 4 * sizeof(sample_value_t))   // bytes per binary summary
+#define STREAM_TEXT_SUMMARY_MAX_SIZE 160                                 // bytes per text summary
+#define STREAM_TEXT_MAX_DECIMALS     6                                   // decimals printed for fixed-point values
+
+// Max number of bytes needed to encode a given number of samples (in any mode)
+#define STREAM_ENCODER_MAX_SIZE(n_samples) ((n_samples) * STREAM_TEXT_SAMPLE_MAX_SIZE)
+
+// Max number of bytes needed to encode a given number of summaries (in any mode)
+#define STREAM_ENCODER_SUMMARIES_MAX_SIZE(n_summaries) ((n_summaries) * STREAM_TEXT_SUMMARY_MAX_SIZE)
+
+// Max number of bytes needed to encode a message (in any mode)
+#define STREAM_ENCODER_MESSAGE_MAX_SIZE (STREAM_MESSAGE_MAX_SIZE + 16)
+
+/* Type definitions */
+typedef enum {
+    STREAM_MODE_TEXT       = 0,
+    STREAM_MODE_BINARY     = 1,
+    STREAM_MODE_COMPRESSED = 2,
+    STREAM_MODE_MAX_VALUE,
+} stream_mode_t;
+
+typedef enum {
+    STREAM_FRAME_SAMPLES            = 0,
+    STREAM_FRAME_MESSAGE            = 1,
+    STREAM_FRAME_SUMMARIES          = 2,
+    STREAM_FRAME_COMPRESSED_SAMPLES = 3,
+} stream_frame_type_t;
+
+/**
+ * @brief Set the mode used to encode the samples. This also resets the frame
+ *        sequence number (see data_thread_set_stream_mode(), which also declares the
+ *        format of the values in the stream).
+ *
+ * @param mode The stream mode.
+ * @return 0 on success, negative errno on failure.
+ */
+int stream_encoder_set_mode(stream_mode_t mode);
+
+/**
+ * @brief Write the "stream mode=<mode> value=<format>" message that declares the current
+ *        stream mode and the format of the sample values.
+ *
+ * @param message Buffer to store the message (output).
+ * @param message_len The size of the buffer.
+ */
+void stream_encoder_describe(char* message, size_t message_len);
+
+/**
+ * @brief Encode a block of samples using the current stream mode. In binary (and compressed)
+ *        mode, the samples are split into as many frames as needed.
+ *
+ * @param block The samples to encode.
+ * @param buffer Buffer to store the encoded data (output).
+ * @param buffer_len The size of the buffer (see STREAM_ENCODER_MAX_SIZE).
+ * @param n_bytes The number of bytes encoded (output).
+ * @return 0 on success, negative errno on failure.
+ */
+int stream_encoder_encode(const sample_block_t* block, uint8_t* buffer, size_t buffer_len, size_t* n_bytes);
+
+/**
+ * @brief Encode a text message using the current stream mode. Messages longer than
+ *        STREAM_MESSAGE_MAX_SIZE are truncated.
+ *
+ * @param message The null-terminated message to encode (without a line terminator).
+ * @param buffer Buffer to store the encoded data (output).
+ * @param buffer_len The size of the buffer (see STREAM_ENCODER_MESSAGE_MAX_SIZE).
+ * @param n_bytes The number of bytes encoded (output).
+ * @return 0 on success, negative errno on failure.
+ */
+int stream_encoder_encode_message(const char* message, uint8_t* buffer, size_t buffer_len, size_t* n_bytes);
+
+/**
+ * @brief Encode a block of window summaries using the current stream mode. In binary mode,
+ *        the summaries are split into as many frames as needed.
+ *
+ * @param summaries The summaries to encode.
+ * @param buffer Buffer to store the encoded data (output).
+ * @param buffer_len The size of the buffer (see STREAM_ENCODER_SUMMARIES_MAX_SIZE).
+ * @param n_bytes The number of bytes encoded (output).
+ * @return 0 on success, negative errno on failure.
+ */
+int stream_encoder_encode_summaries(const summary_block_t* summaries, uint8_t* buffer, size_t buffer_len, size_t* n_bytes);
@@ -0,0 +1,107 @@
+/**
+ * Created on Wed Dec 18 2024
+ *
+ * @brief Provides methods to collect and report the pipeline telemetry, i.e. the
+ *        counters kept by each stage of the pipeline (sensor, ring buffer, data
+ *        thread and USB) and the timing stats of the sensor and data threads.
+ *
+ *        The counters are always on (they are only plain/atomic increments), and
+ *        can be reported and reset at any time by command.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#pragma once
+
+#include "data_thread.h"
+#include "rate_timer.h"
+#include "ring_buffer.h"
+#include "sim_sensor.h"
+#include "usb_comm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Type definitions */
+typedef struct {
+    sim_sensor_stats_t sensor;
+    ring_buffer_stats_t ring_buffer;
+    data_thread_stats_t data;
+    usb_comm_stats_t usb;
+    rate_timer_stats_t read_timer;
+    rate_timer_stats_t send_timer;
+} telemetry_t;
+
+/**
+ * @brief Initialize the telemetry (must be called before any other function).
+ *
+ * @param ring_buffer The ring buffer used to store the sensor data.
+ */
+void telemetry_init(sample_ring_t* ring_buffer);
+
+/**
+ * @brief Get a snapshot of the pipeline telemetry.
+ *
+ * @param telemetry The telemetry snapshot (output).
+ */
+void telemetry_get(telemetry_t* telemetry);
+
+/**
+ * @brief Reset all the pipeline counters and timing stats.
+ */
+void telemetry_reset(void);
+
+/**
+ * @brief Send a snapshot of the pipeline telemetry over USB. It is sent as a few
+ *        "telemetry <stage> <key>=<value> ..." messages (see stream_encoder.h).
+ *
+ * @return 0 on success, negative errno on failure.
+ */
+int telemetry_send(void);
+
+/**
+ * @brief Measure how fast each simulation pattern generates its samples (in blocks, just like
+ *        the sensor thread does), and how many bits per sample they take once compressed (in
+ *        full blocks, see sample_codec.h), and send the results over USB. They are sent as one
+ *        "benchmark pattern=<pattern> samples=<n> time_us=<t> samples_per_sec=<rate> ns_per_sample=<ns> bits_per_sample=<bits>"
+ *        message per pattern.
+ *
+ * @param n_samples The number of samples generated per pattern (0 for the default).
+ * @return 0 on success, negative errno on failure.
+ *
+ * @note This blocks the calling thread while the patterns are generated.
+ */
+int telemetry_benchmark_patterns(uint32_t n_samples);
+
+/**
+ * @brief Measure how long it takes to add an item to a ring buffer, and to get it back (one
+ *        at a time, or in batches), and send the results over USB. The items go through a
+ *        small ring buffer of samples dedicated to the benchmark (generated from the same
+ *        code as the sample ring buffer, but with a fixed size). They are sent as a
+ *        "benchmark ring_buffer items=<n> size=<size> add_ns=<ns> get_ns=<ns> get_batch_ns=<ns>"
+ *        message, with the average time per item.
+ *
+ * @param n_items The number of items added (and retrieved) per operation (0 for the default).
+ * @return 0 on success, negative errno on failure.
+ *
+ * @note This blocks the calling thread while the benchmark runs.
+ */
+int telemetry_benchmark_ring_buffer(uint32_t n_items);
+
+/**
+ * @brief Stress a ring buffer from two threads at once: a producer adds items as fast as it can
+ *        (overwriting the oldest ones once the buffer is full), while a consumer gets them back
+ *        and checks that none of them is torn, duplicated or out of order. On SMP builds the
+ *        threads are pinned to separate cores, so they really run in parallel. The items go
+ *        through the ring buffer dedicated to the benchmark (see telemetry_benchmark_ring_buffer()).
+ *        The results are sent as a
+ *        "stress ring_buffer items=<n> size=<size> cpus=<n> received=<n> overwrites=<n> torn=<n> reordered=<n>"
+ *        message.
+ *
+ * @param n_items The number of items added by the producer (0 for the default).
+ * @return 0 on success, -EIO if any item was torn or out of order, or another negative errno
+ *         on failure.
+ *
+ * @note This blocks the calling thread while the test runs.
+ */
+int telemetry_stress_ring_buffer(uint32_t n_items);
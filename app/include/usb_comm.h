@@ -7,10 +7,19 @@
  */
 #pragma once
 
+#include <zephyr/kernel.h>
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Type definitions */
+typedef struct {
+    uint32_t n_bytes_written;   // Number of bytes queued to be sent
+    uint32_t n_timeouts;        // Number of writes that timed out (with data dropped)
+    uint32_t stall_time_us;     // Time writers spent waiting for space to queue data
+} usb_comm_stats_t;
+
 /**
  * @brief Initializes the USB communication.
  *
@@ -21,22 +30,70 @@
 int usb_comm_init(void);
 
 /**
- * @brief Read data received over USB. This will read as many bytes as there
- *        are available, up to the size of the buffer. If no data is available,
- *        this function returns immediately.
+ * @brief Get the data received over USB in place (without copying it), sleeping until
+ *        some is received. The data is read by the UART interrupt handler into a ring
+ *        buffer, so it may come in two chunks (when it wraps around the end of the buffer).
+ *        Once done with the data, it must be released with usb_comm_rx_finish(). Must only
+ *        be called from a single (reader) thread.
  *
- * @param buffer Buffer to store the data read (output).
- * @param size The size of the buffer (or the max number of bytes you want to read).
- * @param n_bytes The number of bytes read (output).
- * @return 0 on success, negative errno on failure.
+ * @param data Set to the first byte received (output).
+ * @param timeout The max time to wait for data (e.g. K_FOREVER or K_NO_WAIT).
+ * @return The number of bytes available at 'data', -EAGAIN if no data was received in
+ *         time, or another negative errno on failure.
+ */
+int usb_comm_rx_claim(uint8_t** data, k_timeout_t timeout);
+
+/**
+ * @brief Release the data received, once done with it (see usb_comm_rx_claim()).
+ *
+ * @param n_bytes The number of bytes to release (up to the number of bytes claimed).
  */
-int usb_comm_read(uint8_t* buffer, size_t buffer_len, size_t* n_bytes);
+void usb_comm_rx_finish(size_t n_bytes);
 
 /**
- * @brief Write data over USB.
+ * @brief Write data over USB. The data is queued to be sent by the UART interrupt
+ *        handler - if there is no space to queue all of it, the calling thread
+ *        sleeps until the UART frees up some space (it never busy-waits).
  *
  * @param buffer Buffer containing the data to be written.
  * @param n_bytes The number of bytes to be sent.
  * @return 0 on success, negative errno on failure.
  */
-int usb_comm_write(uint8_t* buffer, size_t n_bytes);
\ No newline at end of file
+int usb_comm_write(uint8_t* buffer, size_t n_bytes);
+
+/**
+ * @brief Queue data to be sent over USB, without blocking. Only as many bytes as
+ *        there is space for are queued (the caller is responsible for the rest).
+ *
+ * @param buffer Buffer containing the data to be written.
+ * @param n_bytes The number of bytes to be sent.
+ * @return The number of bytes queued, or negative errno on failure.
+ */
+int usb_comm_write_async(uint8_t* buffer, size_t n_bytes);
+
+/**
+ * @brief Get the number of bytes queued that are still waiting to be sent.
+ *
+ * @return The number of bytes pending.
+ */
+size_t usb_comm_tx_pending(void);
+
+/**
+ * @brief Wait until all the data queued has been sent.
+ *
+ * @param timeout The max time to wait.
+ * @return 0 on success, -ETIMEDOUT if the data wasn't sent in time.
+ */
+int usb_comm_flush(k_timeout_t timeout);
+
+/**
+ * @brief Get the USB TX stats, since boot or since they were last reset.
+ *
+ * @param stats The USB TX stats (output).
+ */
+void usb_comm_get_stats(usb_comm_stats_t* stats);
+
+/**
+ * @brief Reset the USB TX stats.
+ */
+void usb_comm_reset_stats(void);
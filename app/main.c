@@ -12,14 +12,15 @@
 #include "led.h"
 #include "ring_buffer.h"
 #include "sensor_thread.h"
+#include "telemetry.h"
 #include "usb_comm.h"
 
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
-LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
+#include <errno.h>
 
-#define COMMAND_BUFFER_SIZE 64
+LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
 
 int init_board(void) {
     // Initialize the board leds
@@ -39,8 +40,19 @@ int init_board(void) {
     return 0;
 }
 
+// The ring buffer is statically allocated (it can be sized to many thousands of samples).
+// With CONFIG_APP_BLOCK_POOL, the samples are handed over in blocks instead (see block_pool.h).
+#if defined(CONFIG_APP_BLOCK_POOL)
+static sample_ring_t* const ring_buffer = NULL;
+#else
+static sample_ring_t sample_ring        = {0};
+static sample_ring_t* const ring_buffer = &sample_ring;
+#endif
+
+// Keeps track of the command being parsed (commands can be split across USB transfers)
+static command_parser_t parser = {0};
+
 int main(void) {
-    ring_buffer_t ring_buffer = {0};
 
     // Initialize the board
     int ret = init_board();
@@ -49,11 +61,17 @@ int main(void) {
         return ret;
     }
 
+    // Keep track of the ring buffer stats
+    if (ring_buffer != NULL) {
+        sample_ring_init(ring_buffer);
+    }
+    telemetry_init(ring_buffer);
+
     // Start the sensor thread
-    sensor_thread_start(&ring_buffer);
+    sensor_thread_start(ring_buffer);
 
     // Start the data thread
-    data_thread_start(&ring_buffer);
+    data_thread_start(ring_buffer);
 
     // Turn on the board led (to indicate the board is ready)
     led_on();
@@ -62,33 +80,31 @@ int main(void) {
 
     // Start the main loop
     while (true) {
-        uint8_t buffer[COMMAND_BUFFER_SIZE + 1] = {0};
-        command_t command                       = {0};
-        size_t n_bytes                          = 0;
+        uint8_t* data = NULL;
 
-        // Check if any data was received over USB
-        ret = usb_comm_read(buffer, COMMAND_BUFFER_SIZE, &n_bytes);
-        if (ret != 0) {
+        // Wait for bytes to be received over USB (parsed in place, however they were split)
+        int n_bytes = usb_comm_rx_claim(&data, K_FOREVER);
+        if (n_bytes < 0) {
+            ret = n_bytes;
             break;
         }
 
-        // If no data was received, wait some time and try again
-        if (n_bytes <= 0) {
-            k_msleep(1000);
-            continue;
-        }
+        // Parse and execute every command completed by the bytes received
+        for (size_t n_parsed = 0; n_parsed < (size_t) n_bytes;) {
+            n_parsed += command_parser_feed(&parser, &data[n_parsed], n_bytes - n_parsed, &ret);
+            if (ret == -EAGAIN) {
+                break;
+            }
 
-        // Parse the command received
-        ret = command_parse(buffer, &command);
-        if (ret != 0) {
-            continue;
-        }
+            if (ret == 0) {
+                ret = command_execute(&parser.command);
+            }
 
-        // Execute the command
-        ret = command_execute(&command);
-        if (ret != 0) {
-            continue;
+            // Let the host know the outcome (if the command carries a request ID)
+            command_reply(&parser.command, ret);
         }
+
+        usb_comm_rx_finish(n_bytes);
     }
 
     // Turn off the board led (if an error took place)
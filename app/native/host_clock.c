@@ -0,0 +1,16 @@
+/**
+ * Created on Fri Dec 20 2024
+ *
+ * @brief Provides access to the host clock on native_sim builds. This file is built
+ *        in the native simulator runner context (against the host C library).
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include <stdint.h>
+#include <time.h>
+
+uint64_t host_clock_get_ns(void) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,134 @@
+/**
+ * Created on Sun Dec 22 2024
+ *
+ * @brief Streaming window aggregator, used to summarize a stream of samples.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include "aggregator.h"
+
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+void aggregator_init(aggregator_t* aggregator, uint32_t window_samples, uint32_t window_us) {
+    memset(aggregator, 0, sizeof(aggregator_t));
+    aggregator->window_samples = window_samples;
+    aggregator->window_us      = window_us;
+}
+
+bool aggregator_is_enabled(const aggregator_t* aggregator) { return aggregator->window_samples > 0 || aggregator->window_us > 0; }
+
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+// Integer square root (rounded down), so fixed-point summaries need no float math
+static sample_value_t aggregator_sqrt(aggregator_sum_t value) {
+    uint64_t root = 0;
+    for (uint64_t bit = 1ULL << 62; bit > 0; bit >>= 2) {
+        if ((uint64_t) value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return MIN(root, SAMPLE_VALUE_MAX);
+}
+#else
+static sample_value_t aggregator_sqrt(aggregator_sum_t value) { return sqrt(value); }
+#endif
+
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES) && defined(CONFIG_APP_SAMPLE_VALUE_INT32)
+static void aggregator_sum_sq_clear(aggregator_sum_sq_t* sum_sq) {
+    sum_sq->high = 0;
+    sum_sq->low  = 0;
+}
+
+static void aggregator_sum_sq_add(aggregator_sum_sq_t* sum_sq, sample_value_t value) {
+    uint64_t square = (uint64_t) ((int64_t) value * value);
+    sum_sq->low += square;
+    sum_sq->high += (sum_sq->low < square) ? 1 : 0;
+}
+
+// Mean of the squares (which fits in 64 bits again), by long division of the 96-bit sum
+// in 32-bit digits
+static aggregator_sum_t aggregator_sum_sq_mean(const aggregator_sum_sq_t* sum_sq, uint32_t n_samples) {
+    uint64_t remainder = sum_sq->high % n_samples;
+    uint64_t digit     = (remainder << 32) | (sum_sq->low >> 32);
+    uint64_t high      = digit / n_samples;
+    digit              = ((digit % n_samples) << 32) | (sum_sq->low & UINT32_MAX);
+    return (aggregator_sum_t) ((high << 32) | (digit / n_samples));
+}
+#else
+static void aggregator_sum_sq_clear(aggregator_sum_sq_t* sum_sq) { *sum_sq = 0; }
+
+static void aggregator_sum_sq_add(aggregator_sum_sq_t* sum_sq, sample_value_t value) { *sum_sq += (aggregator_sum_t) value * value; }
+
+static aggregator_sum_t aggregator_sum_sq_mean(const aggregator_sum_sq_t* sum_sq, uint32_t n_samples) { return *sum_sq / n_samples; }
+#endif
+
+// Output the summary of the current window (if it has any samples) and move on to the next one
+static int aggregator_close(aggregator_t* aggregator, uint8_t channel, summary_block_t* summaries) {
+    int ret = 0;
+
+    if (aggregator->n_samples == 0) {
+        return 0;
+    }
+
+    if (summaries->n_summaries < SUMMARY_BLOCK_MAX_SUMMARIES) {
+        uint16_t i                 = summaries->n_summaries++;
+        summaries->channel[i]      = channel;
+        summaries->index[i]        = aggregator->index;
+        summaries->timestamp_us[i] = aggregator->start_us;
+        summaries->n_samples[i]    = aggregator->n_samples;
+        summaries->min[i]          = aggregator->min;
+        summaries->max[i]          = aggregator->max;
+        summaries->mean[i]         = aggregator->sum / aggregator->n_samples;
+        summaries->rms[i]          = aggregator_sqrt(aggregator_sum_sq_mean(&aggregator->sum_sq, aggregator->n_samples));
+    } else {
+        ret = -ENOBUFS;
+    }
+
+    aggregator->index++;
+    aggregator->n_samples = 0;
+
+    return ret;
+}
+
+int aggregator_add(aggregator_t* aggregator, uint8_t channel, uint32_t timestamp_us, sample_value_t value, summary_block_t* summaries) {
+    int ret = 0;
+
+    // Close the current time window once a sample past its end shows up. The next window
+    // starts where it ended (skipping any empty windows in between).
+    uint32_t elapsed_us = timestamp_us - aggregator->start_us;
+    if (aggregator->n_samples > 0 && aggregator->window_us > 0 && elapsed_us >= aggregator->window_us) {
+        uint32_t n_windows = elapsed_us / aggregator->window_us;
+        ret                = aggregator_close(aggregator, channel, summaries);
+        aggregator->index += n_windows - 1;
+        aggregator->start_us += n_windows * aggregator->window_us;
+    } else if (aggregator->n_samples == 0) {
+        aggregator->start_us = timestamp_us;
+    }
+
+    // Keep track of the window stats
+    if (aggregator->n_samples == 0) {
+        aggregator->min    = value;
+        aggregator->max    = value;
+        aggregator->sum    = 0;
+        aggregator_sum_sq_clear(&aggregator->sum_sq);
+    }
+    aggregator->n_samples++;
+    aggregator->min = MIN(aggregator->min, value);
+    aggregator->max = MAX(aggregator->max, value);
+    aggregator->sum += value;
+    aggregator_sum_sq_add(&aggregator->sum_sq, value);
+
+    // Close the current window once it is full (the next one starts on the next sample)
+    if (aggregator->window_samples > 0 && aggregator->n_samples >= aggregator->window_samples) {
+        int close_ret = aggregator_close(aggregator, channel, summaries);
+        ret           = (ret != 0) ? ret : close_ret;
+    }
+
+    return ret;
+}
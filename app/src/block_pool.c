@@ -0,0 +1,131 @@
+/**
+ * Created on Fri Dec 27 2024
+ *
+ * @brief Pool of sample blocks, used to hand the samples read from the sensor thread over
+ *        to the data thread without copying them (see CONFIG_APP_BLOCK_POOL).
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include "block_pool.h"
+
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
+
+// The pool is only built in (and takes RAM) when the samples are handed over in blocks
+#if defined(CONFIG_APP_BLOCK_POOL)
+/* Type definitions */
+typedef struct {
+    void* fifo_reserved;   // Used by the kernel while the block is queued
+    sample_block_t block;
+} block_pool_item_t;
+
+/* Static variables */
+K_MEM_SLAB_DEFINE_STATIC(block_slab, sizeof(block_pool_item_t), BLOCK_POOL_N_BLOCKS, 4);
+static K_FIFO_DEFINE(block_fifo);
+
+static atomic_t policy     = ATOMIC_INIT(RING_BUFFER_DROP_OLDEST);   // ring_buffer_policy_t
+static atomic_t timeout_ms = ATOMIC_INIT(0);                         // Max time the producer waits for a free block
+static atomic_t n_queued   = ATOMIC_INIT(0);                         // Number of samples handed over (and not taken yet)
+
+static atomic_t n_overwrites = ATOMIC_INIT(0);
+static atomic_t n_dropped    = ATOMIC_INIT(0);
+static atomic_t n_waits      = ATOMIC_INIT(0);
+static atomic_t peak_count   = ATOMIC_INIT(0);
+
+static sample_block_t* block_pool_take(k_timeout_t timeout) {
+    block_pool_item_t* item = NULL;
+
+    if (k_mem_slab_alloc(&block_slab, (void**) &item, timeout) != 0) {
+        return NULL;
+    }
+
+    item->block.n_samples = 0;
+    return &item->block;
+}
+
+sample_block_t* block_pool_alloc(void) { return block_pool_take(K_NO_WAIT); }
+
+sample_block_t* block_pool_submit(sample_block_t* block) {
+    if (block->n_samples == 0) {
+        return block;
+    }
+
+    // Take the next block to fill in before handing this one over (so the overflow
+    // policy can still discard it)
+    sample_block_t* next = block_pool_take(K_NO_WAIT);
+    if (next == NULL) {
+        switch (atomic_get(&policy)) {
+            case RING_BUFFER_DROP_OLDEST:
+                // Reuse the oldest block queued (if the consumer isn't holding them all)
+                next = block_pool_get(K_NO_WAIT);
+                if (next != NULL) {
+                    atomic_add(&n_overwrites, next->n_samples);
+                    next->n_samples = 0;
+                }
+                break;
+            case RING_BUFFER_BLOCK:
+                atomic_inc(&n_waits);
+                next = block_pool_take(K_MSEC(atomic_get(&timeout_ms)));
+                break;
+            default: break;
+        }
+    }
+
+    // Discard the new samples if no block could be freed up (reusing their block)
+    if (next == NULL) {
+        atomic_add(&n_dropped, block->n_samples);
+        block->n_samples = 0;
+        return block;
+    }
+
+    // Hand the block over (the producer is the only one raising the peak)
+    uint32_t count = atomic_add(&n_queued, block->n_samples) + block->n_samples;
+    if (count > atomic_get(&peak_count)) {
+        atomic_set(&peak_count, count);
+    }
+    k_fifo_put(&block_fifo, CONTAINER_OF(block, block_pool_item_t, block));
+
+    return next;
+}
+
+sample_block_t* block_pool_get(k_timeout_t timeout) {
+    block_pool_item_t* item = k_fifo_get(&block_fifo, timeout);
+    if (item == NULL) {
+        return NULL;
+    }
+
+    atomic_sub(&n_queued, item->block.n_samples);
+    return &item->block;
+}
+
+void block_pool_free(sample_block_t* block) { k_mem_slab_free(&block_slab, CONTAINER_OF(block, block_pool_item_t, block)); }
+
+void block_pool_cancel_wait(void) { k_fifo_cancel_wait(&block_fifo); }
+
+int block_pool_set_policy(ring_buffer_policy_t new_policy, uint32_t new_timeout_ms) {
+    if (new_policy < 0 || new_policy >= RING_BUFFER_POLICY_MAX_VALUE) {
+        return -EINVAL;
+    }
+
+    atomic_set(&timeout_ms, new_timeout_ms);
+    atomic_set(&policy, new_policy);
+
+    return 0;
+}
+
+void block_pool_get_stats(ring_buffer_stats_t* stats) {
+    stats->n_overwrites      = atomic_get(&n_overwrites);
+    stats->n_dropped         = atomic_get(&n_dropped);
+    stats->n_waits           = atomic_get(&n_waits);
+    stats->n_high_watermarks = 0;
+    stats->peak_count        = atomic_get(&peak_count);
+}
+
+void block_pool_reset_stats(void) {
+    atomic_set(&n_overwrites, 0);
+    atomic_set(&n_dropped, 0);
+    atomic_set(&n_waits, 0);
+    atomic_set(&peak_count, 0);
+}
+#endif
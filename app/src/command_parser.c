@@ -10,55 +10,364 @@
 #include "data_thread.h"
 #include "sensor_thread.h"
 #include "sim_sensor.h"
+#include "stream_encoder.h"
+#include "telemetry.h"
 
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
 
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 LOG_MODULE_REGISTER(command_parser, LOG_LEVEL_INF);
 
-int command_parse(char* data, command_t* command) {
-    LOG_DBG("Parsing command: %s", data);
+/* Constants */
+#define COMMAND_MAX_DIGITS   19   // Significant digits kept per number (the most that fit a uint64_t)
+#define COMMAND_MAX_EXPONENT 99   // Larger exponents overflow (or underflow) a float anyway
 
-    memset(command, 0, sizeof(command_t));
+/* Type definitions */
+typedef int (*command_handler_t)(const command_t* command);
+typedef uint32_t (*command_value_t)(const command_t* command);
 
-    // Parse the command type
-    int ret = sscanf(data, "%d", (int*) &command->type);
-    if (ret < 1) {
-        LOG_ERR("Failed to parse the command.");
-        return -EIO;
+typedef struct {
+    command_handler_t handler;   // Executes the command
+    command_value_t value;       // Gets the value the command actually applied (NULL if none)
+    uint8_t max_args;            // Max number of arguments taken
+} command_info_t;
+
+/* Static variables */
+
+// Powers of 10 exactly representable as a float
+static const float powers_of_10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+/* Parsing */
+
+static bool command_is_digit(uint8_t c) { return c >= '0' && c <= '9'; }
+
+static void command_parser_set_error(command_parser_t* parser, int error) {
+    if (parser->error == 0) {
+        parser->error = error;
     }
+}
 
-    // Check if the command type is valid
-    if (command->type < 0 || command->type >= COMMAND_MAX_VALUE) {
-        LOG_ERR("Invalid command type: %d", command->type);
-        return -EIO;
+static void command_parser_add_digit(command_parser_t* parser, uint8_t digit, bool fraction) {
+    if (parser->n_digits < COMMAND_MAX_DIGITS) {
+        parser->mantissa = parser->mantissa * 10 + digit;
+        parser->n_digits += (parser->mantissa > 0);   // Leading zeros are not significant
+        parser->exponent -= fraction;
+    } else {
+        parser->exponent += !fraction;   // Digits past the significant ones only scale the number
     }
+}
 
-    // Parse the command arguments
-    data = strchr(data, ' ');
-    for (int i = 0; data != NULL && i < MAX_COMMAND_ARGS; i++) {
-        command->args[i] = strtof(data, &data);
+// Get the number parsed as an unsigned integer (false if it isn't one, or doesn't fit a uint32_t)
+static bool command_parser_get_uint(const command_parser_t* parser, uint32_t* value) {
+    if (parser->state != COMMAND_TOKEN_INTEGER || parser->negative || parser->exponent != 0 || parser->mantissa > UINT32_MAX) {
+        return false;
     }
 
-    LOG_DBG("Parsed command: type=%d, args=[%.1f, %.1f, %.1f, %.1f]", command->type, command->args[0], command->args[1], command->args[2],
-        command->args[3]);
+    *value = parser->mantissa;
+    return true;
+}
+
+// Get the number parsed as a float (scaling its significant digits by whole powers of 10)
+static float command_parser_get_float(const command_parser_t* parser) {
+    int32_t exponent = parser->exponent + (parser->exponent_negative ? -parser->exponent_value : parser->exponent_value);
+    float value      = (float) parser->mantissa;
 
-    return 0;
+    while (exponent != 0 && value != 0 && !isinf(value)) {
+        int32_t step = MIN(abs(exponent), (int32_t) ARRAY_SIZE(powers_of_10) - 1);
+        value        = (exponent > 0) ? value * powers_of_10[step] : value / powers_of_10[step];
+        exponent    += (exponent > 0) ? -step : step;
+    }
+
+    return parser->negative ? -value : value;
 }
 
-int command_execute(command_t* command) {
-    switch (command->type) {
-        case COMMAND_SET_DATA_RATE: sim_sensor_set_data_rate(command->args[0]); break;
-        case COMMAND_SET_READ_RATE: sensor_thread_set_read_rate(command->args[0]); break;
-        case COMMAND_SET_SEND_RATE: data_thread_set_send_rate(command->args[0]); break;
-        case COMMAND_START_PATTERN:
-            sim_sensor_start_pattern((sim_sensor_pattern_t) command->args[0], command->args[1], command->args[2], command->args[3]);
+// Store the number parsed (if any) in the command: the request ID, the command type, or an argument
+static void command_parser_end_number(command_parser_t* parser) {
+    command_t* command = &parser->command;
+    uint32_t value     = 0;
+
+    switch (parser->state) {
+        case COMMAND_TOKEN_NONE: return;
+        case COMMAND_TOKEN_SIGN:
+        case COMMAND_TOKEN_EXPONENT_START:
+        case COMMAND_TOKEN_EXPONENT_SIGN: command_parser_set_error(parser, -EIO); break;
+        default:
+            if (!parser->has_digits) {
+                command_parser_set_error(parser, -EIO);
+            } else if (parser->in_request_id) {
+                if (!command_parser_get_uint(parser, &command->request_id)) {
+                    command_parser_set_error(parser, -EIO);
+                }
+            } else if (parser->n_fields == 0) {
+                if (!command_parser_get_uint(parser, &value) || value >= COMMAND_MAX_VALUE) {
+                    command_parser_set_error(parser, -EIO);
+                }
+                command->type = value;
+                parser->n_fields++;
+            } else if (command->n_args < MAX_COMMAND_ARGS) {
+                command->args[command->n_args++] = command_parser_get_float(parser);
+                parser->n_fields++;
+            } else {
+                command_parser_set_error(parser, -E2BIG);
+            }
             break;
-        default: LOG_ERR("Invalid command type: %d", command->type); return -EINVAL;
     }
+
+    // Get ready for the next number
+    parser->in_request_id     = false;
+    parser->state             = COMMAND_TOKEN_NONE;
+    parser->negative          = false;
+    parser->has_digits        = false;
+    parser->exponent_negative = false;
+    parser->mantissa          = 0;
+    parser->n_digits          = 0;
+    parser->exponent          = 0;
+    parser->exponent_value    = 0;
+}
+
+// Parse a byte of a line (other than the line end)
+static void command_parser_parse_byte(command_parser_t* parser, uint8_t c) {
+    if (c == ' ' || c == '\t') {
+        command_parser_end_number(parser);
+        return;
+    }
+
+    // The request ID (if any) comes first, right at the start of the line
+    if (c == COMMAND_REQUEST_ID_PREFIX && !parser->command.has_request_id && parser->n_fields == 0 && parser->state == COMMAND_TOKEN_NONE) {
+        parser->command.has_request_id = true;
+        parser->in_request_id          = true;
+        return;
+    }
+
+    if (command_is_digit(c)) {
+        if (parser->state == COMMAND_TOKEN_NONE || parser->state == COMMAND_TOKEN_SIGN) {
+            parser->state = COMMAND_TOKEN_INTEGER;
+        } else if (parser->state == COMMAND_TOKEN_EXPONENT_START || parser->state == COMMAND_TOKEN_EXPONENT_SIGN) {
+            parser->state = COMMAND_TOKEN_EXPONENT;
+        }
+
+        if (parser->state == COMMAND_TOKEN_EXPONENT) {
+            parser->exponent_value = MIN(parser->exponent_value * 10 + (c - '0'), COMMAND_MAX_EXPONENT);
+        } else {
+            command_parser_add_digit(parser, c - '0', parser->state == COMMAND_TOKEN_FRACTION);
+            parser->has_digits = true;
+        }
+        return;
+    }
+
+    if ((c == '-' || c == '+') && parser->state == COMMAND_TOKEN_NONE) {
+        parser->negative = (c == '-');
+        parser->state    = COMMAND_TOKEN_SIGN;
+    } else if ((c == '-' || c == '+') && parser->state == COMMAND_TOKEN_EXPONENT_START) {
+        parser->exponent_negative = (c == '-');
+        parser->state             = COMMAND_TOKEN_EXPONENT_SIGN;
+    } else if (c == '.' && parser->state <= COMMAND_TOKEN_INTEGER) {
+        parser->state = COMMAND_TOKEN_FRACTION;
+    } else if ((c == 'e' || c == 'E') && parser->has_digits && (parser->state == COMMAND_TOKEN_INTEGER || parser->state == COMMAND_TOKEN_FRACTION)) {
+        parser->state = COMMAND_TOKEN_EXPONENT_START;
+    } else {
+        command_parser_set_error(parser, -EIO);
+    }
+}
+
+size_t command_parser_feed(command_parser_t* parser, const uint8_t* data, size_t n_bytes, int* result) {
+    for (size_t i = 0; i < n_bytes; i++) {
+        // Start a new command (once the last one was handed over)
+        if (parser->done) {
+            memset(parser, 0, sizeof(command_parser_t));
+        }
+
+        if (data[i] != '\n' && data[i] != '\r') {
+            // Skip the rest of the line once it is known to be invalid
+            if (parser->error == 0) {
+                command_parser_parse_byte(parser, data[i]);
+            }
+            continue;
+        }
+
+        // Skip empty lines (e.g. the '\n' of a "\r\n" line end)
+        command_parser_end_number(parser);
+        if (parser->n_fields == 0 && !parser->command.has_request_id && parser->error == 0) {
+            continue;
+        }
+
+        // Hand the command over
+        parser->done = true;
+        *result      = (parser->error != 0) ? parser->error : ((parser->n_fields == 0) ? -EIO : 0);
+        if (*result != 0) {
+            LOG_ERR("Failed to parse the command (err: %d)", *result);
+        } else {
+            LOG_DBG("Parsed command: type=%d, args=[%.1f, %.1f, %.1f, %.1f, %.1f]", parser->command.type, parser->command.args[0],
+                parser->command.args[1], parser->command.args[2], parser->command.args[3], parser->command.args[4]);
+        }
+        return i + 1;
+    }
+
+    *result = -EAGAIN;
+    return n_bytes;
+}
+
+/* Commands */
+
+// Convert a channel argument (invalid channels are mapped to SIM_SENSOR_MAX_CHANNELS,
+// so they are rejected by the function they are passed to)
+static uint8_t command_channel_arg(float arg) { return (arg >= 0 && arg < SIM_SENSOR_MAX_CHANNELS) ? (uint8_t) arg : SIM_SENSOR_MAX_CHANNELS; }
+
+// Convert a pattern argument (invalid patterns, including PATTERN_NONE when it isn't valid, are
+// mapped to PATTERN_MAX_VALUE, so they are rejected by the function they are passed to)
+static sim_sensor_pattern_t command_pattern_arg(float arg, bool none_valid) {
+    if (arg == PATTERN_NONE && none_valid) {
+        return PATTERN_NONE;
+    }
+    return (arg >= 0 && arg < PATTERN_MAX_VALUE && arg == (int) arg) ? (sim_sensor_pattern_t) arg : PATTERN_MAX_VALUE;
+}
+
+// Channel-specific commands take the channel as their last (optional) argument
+static int command_set_data_rate(const command_t* command) {
+    return sim_sensor_set_data_rate(command_channel_arg(command->args[1]), command->args[0]);
+}
+
+static uint32_t command_get_data_rate(const command_t* command) { return sim_sensor_get_data_rate(command_channel_arg(command->args[1])); }
+
+static int command_set_read_rate(const command_t* command) {
+    return sensor_thread_set_read_rate(command_channel_arg(command->args[1]), command->args[0]);
+}
+
+static uint32_t command_get_read_rate(const command_t* command) { return sensor_thread_get_read_rate(command_channel_arg(command->args[1])); }
+
+static int command_set_send_rate(const command_t* command) { return data_thread_set_send_rate(command->args[0]); }
+
+static uint32_t command_get_send_rate(const command_t* command) { return data_thread_get_send_rate(); }
+
+static int command_start_pattern(const command_t* command) {
+    return sim_sensor_start_pattern(command_channel_arg(command->args[4]), command_pattern_arg(command->args[0], true), command->args[1],
+        command->args[2], command->args[3]);
+}
+
+static int command_queue_pattern(const command_t* command) {
+    // Repeat counts too large to be stored are capped (negative ones are invalid)
+    if (command->args[5] < 0) {
+        LOG_ERR("Invalid repeat count: %d", (int) command->args[5]);
+        return -EINVAL;
+    }
+
+    return sim_sensor_queue_pattern(command_channel_arg(command->args[6]), command_pattern_arg(command->args[0], false), command->args[1],
+        command->args[2], command->args[3], command->args[4], (command->args[5] < UINT32_MAX) ? command->args[5] : UINT32_MAX);
+}
+
+static int command_set_noise(const command_t* command) { return sim_sensor_set_noise(command_channel_arg(command->args[1]), command->args[0]); }
+
+static int command_set_stream_mode(const command_t* command) { return data_thread_set_stream_mode((stream_mode_t) command->args[0]); }
+
+static int command_get_telemetry(const command_t* command) { return telemetry_send(); }
+
+static int command_reset_telemetry(const command_t* command) {
+    telemetry_reset();
     return 0;
-}
\ No newline at end of file
+}
+
+static int command_benchmark_patterns(const command_t* command) {
+    return telemetry_benchmark_patterns((command->args[0] > 0) ? command->args[0] : 0);
+}
+
+static int command_set_resampling(const command_t* command) {
+    // Out of range taps are mapped to an (invalid) odd number of taps
+    return sensor_thread_set_resampling(command_channel_arg(command->args[1]),
+        (command->args[0] >= 0 && command->args[0] < UINT8_MAX) ? command->args[0] : UINT8_MAX);
+}
+
+static int command_set_aggregation(const command_t* command) {
+    // Out of range window sizes are mapped to an (invalid) window size above the max
+    return data_thread_set_aggregation(command_channel_arg(command->args[2]),
+        (command->args[0] >= 0 && command->args[0] <= DATA_THREAD_MAX_WINDOW_SAMPLES) ? command->args[0] : UINT32_MAX, command->args[1]);
+}
+
+static int command_benchmark_ring(const command_t* command) {
+    return telemetry_benchmark_ring_buffer((command->args[0] > 0) ? command->args[0] : 0);
+}
+
+static int command_stress_ring(const command_t* command) {
+    return telemetry_stress_ring_buffer((command->args[0] > 0) ? command->args[0] : 0);
+}
+
+static int command_set_overflow(const command_t* command) {
+    // Out of range policies/timeouts are mapped to an invalid policy/timeout above the max
+    return sensor_thread_set_overflow_policy((command->args[0] >= 0) ? (ring_buffer_policy_t) command->args[0] : RING_BUFFER_POLICY_MAX_VALUE,
+        (command->args[1] >= 0 && command->args[1] <= SENSOR_THREAD_MAX_OVERFLOW_TIMEOUT_MS) ? command->args[1] : UINT32_MAX);
+}
+
+static int command_set_adaptive_send(const command_t* command) {
+    data_thread_set_adaptive_send(command->args[0] != 0);
+    return 0;
+}
+
+static int command_set_latency_mode(const command_t* command) {
+    // Out of range coalescing windows are mapped to an (invalid) window above the max
+    return data_thread_set_latency_mode(command->args[0] != 0,
+        (command->args[1] >= 0 && command->args[1] <= SAMPLE_RING_SIZE) ? command->args[1] : UINT32_MAX,
+        (command->args[2] >= 0 && command->args[2] <= DATA_THREAD_MAX_COALESCE_US) ? command->args[2] : UINT32_MAX);
+}
+
+// Commands indexed by type (dispatched in constant time, without parsing their name)
+static const command_info_t commands[COMMAND_MAX_VALUE] = {
+    [COMMAND_SET_DATA_RATE]      = {command_set_data_rate, command_get_data_rate, 2},
+    [COMMAND_SET_READ_RATE]      = {command_set_read_rate, command_get_read_rate, 2},
+    [COMMAND_SET_SEND_RATE]      = {command_set_send_rate, command_get_send_rate, 1},
+    [COMMAND_START_PATTERN]      = {command_start_pattern, NULL, 5},
+    [COMMAND_SET_STREAM_MODE]    = {command_set_stream_mode, NULL, 1},
+    [COMMAND_GET_TELEMETRY]      = {command_get_telemetry, NULL, 0},
+    [COMMAND_RESET_TELEMETRY]    = {command_reset_telemetry, NULL, 0},
+    [COMMAND_BENCHMARK_PATTERNS] = {command_benchmark_patterns, NULL, 1},
+    [COMMAND_SET_RESAMPLING]     = {command_set_resampling, NULL, 2},
+    [COMMAND_SET_AGGREGATION]    = {command_set_aggregation, NULL, 3},
+    [COMMAND_BENCHMARK_RING]     = {command_benchmark_ring, NULL, 1},
+    [COMMAND_SET_OVERFLOW]       = {command_set_overflow, NULL, 2},
+    [COMMAND_SET_ADAPTIVE_SEND]  = {command_set_adaptive_send, NULL, 1},
+    [COMMAND_SET_LATENCY_MODE]   = {command_set_latency_mode, NULL, 3},
+    [COMMAND_QUEUE_PATTERN]      = {command_queue_pattern, NULL, 7},
+    [COMMAND_SET_NOISE]          = {command_set_noise, NULL, 2},
+    [COMMAND_STRESS_RING]        = {command_stress_ring, NULL, 1},
+};
+
+int command_execute(command_t* command) {
+    if (command->type < 0 || command->type >= COMMAND_MAX_VALUE || commands[command->type].handler == NULL) {
+        LOG_ERR("Invalid command type: %d", command->type);
+        return -EINVAL;
+    }
+
+    if (command->n_args > commands[command->type].max_args) {
+        LOG_ERR("Too many arguments for command %d: %d", command->type, command->n_args);
+        return -E2BIG;
+    }
+
+    return commands[command->type].handler(command);
+}
+
+// The value a command actually applied
+static uint32_t command_effective_value(const command_t* command) {
+    if (command->type < 0 || command->type >= COMMAND_MAX_VALUE || commands[command->type].value == NULL) {
+        return 0;
+    }
+
+    return commands[command->type].value(command);
+}
+
+int command_reply(const command_t* command, int result) {
+    char message[STREAM_MESSAGE_MAX_SIZE + 1] = {0};
+
+    if (!command->has_request_id) {
+        return 0;
+    }
+
+    snprintf(message, sizeof(message), "%s id=%u err=%d value=%u", (result == 0) ? "ack" : "nack", command->request_id, result,
+        (result == 0) ? command_effective_value(command) : 0);
+
+    return data_thread_send_message(message);
+}
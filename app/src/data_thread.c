@@ -8,81 +8,478 @@
  */
 #include "data_thread.h"
 
+#include "aggregator.h"
+#include "block_pool.h"
+#include "sim_sensor.h"
+#include "stream_encoder.h"
 #include "usb_comm.h"
 
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
 #include <errno.h>
-#include <stdio.h>
 
 LOG_MODULE_REGISTER(data_thread, LOG_LEVEL_INF);
 
 /* Constants */
 #define DATA_THREAD_STACK_SIZE 1000
 #define DATA_THREAD_PRIO       5
+#define DATA_THREAD_CPU        1   // Only used on SMP builds
 #define DEFAULT_SEND_RATE      1   // Hz
 
+// Max number of samples sent at once (the blocks of the pool are sent whole)
+#if defined(CONFIG_APP_BLOCK_POOL)
+#define DATA_THREAD_BLOCK_SIZE SAMPLE_BLOCK_MAX_SAMPLES
+#else
+#define DATA_THREAD_BLOCK_SIZE MIN(SAMPLE_RING_SIZE, SAMPLE_BLOCK_MAX_SAMPLES)
+#endif
+
+// Max number of window summaries sent on each send period (each sample can end up to two windows)
+#define DATA_THREAD_MAX_SUMMARIES MIN(2 * DATA_THREAD_BLOCK_SIZE, SUMMARY_BLOCK_MAX_SUMMARIES)
+
+// Occupancy of the ring buffer at which the data thread is notified (see data_thread_on_watermark)
+#define DATA_THREAD_HIGH_WATERMARK MAX(SAMPLE_RING_SIZE * CONFIG_APP_RING_BUFFER_HIGH_WATERMARK / 100, 2)
+#define DATA_THREAD_LOW_WATERMARK  MAX(SAMPLE_RING_SIZE * CONFIG_APP_RING_BUFFER_LOW_WATERMARK / 100, 1)
+
+#define DATA_THREAD_SEND_BUFFER_SIZE                                                                                                      \
+    MAX(MAX(STREAM_ENCODER_MAX_SIZE(DATA_THREAD_BLOCK_SIZE), STREAM_ENCODER_SUMMARIES_MAX_SIZE(DATA_THREAD_MAX_SUMMARIES)),              \
+        STREAM_ENCODER_MESSAGE_MAX_SIZE)
+
 /* Static variables */
 K_THREAD_STACK_DEFINE(data_thread_stack, DATA_THREAD_STACK_SIZE);
 static struct k_thread data_thread = {0};
+static rate_timer_t send_timer     = {0};
+static data_thread_stats_t stats   = {0};
+
+// Sending is serialized, so that messages sent by other threads never end up in the
+// middle of the data frames (the send buffer and the stats are also protected by it)
+static K_MUTEX_DEFINE(send_mutex);
+static uint8_t send_buffer[DATA_THREAD_SEND_BUFFER_SIZE] = {0};
+
+// Channels with aggregation enabled are sent as window summaries (also protected by the send mutex)
+static aggregator_t aggregators[SIM_SENSOR_MAX_CHANNELS] = {0};
+
+static uint32_t send_rate = DEFAULT_SEND_RATE * RATE_MHZ_PER_HZ;   // mHz
+
+static atomic_t adaptive_send = ATOMIC_INIT(0);   // See data_thread_set_adaptive_send
+static atomic_t bursting      = ATOMIC_INIT(0);   // Set from the high-water mark to the low-water mark (adaptive send only)
+
+// Latency mode (see data_thread_set_latency_mode)
+static atomic_t latency_mode     = ATOMIC_INIT(0);
+static atomic_t coalesce_samples = ATOMIC_INIT(0);
+static atomic_t coalesce_us      = ATOMIC_INIT(0);
+static atomic_t n_pending        = ATOMIC_INIT(0);   // Samples queued since the data thread last woke up
+static K_SEM_DEFINE(samples_queued, 0, 1);
+
+static void data_thread_log_timer_stats(void) {
+    rate_timer_stats_t stats = {0};
+    rate_timer_get_stats(&send_timer, &stats);
+    LOG_INF("Send jitter: avg %d us, max %d us (%d overruns in %d periods)", stats.jitter_avg_us, stats.jitter_max_us, stats.n_overruns,
+        stats.n_periods);
+}
+
+int data_thread_set_send_rate(float rate) {
+    if (!(rate > 0 && rate <= RATE_MAX_HZ)) {
+        LOG_ERR("Invalid send rate: %.3f Hz", (double) rate);
+        return -EINVAL;
+    }
+
+    send_rate = RATE_HZ_TO_MHZ(rate);
+
+    // Restart the send timer (aligned with the system clock)
+    data_thread_log_timer_stats();
+    rate_timer_start(&send_timer, send_rate, 0);
+
+    LOG_INF("Send rate set to %.3f Hz", (double) rate);
+
+    return 0;
+}
+
+uint32_t data_thread_get_send_rate(void) { return send_rate; }
+
+void data_thread_set_adaptive_send(bool enabled) {
+    atomic_set(&adaptive_send, enabled);
+    if (!enabled) {
+        atomic_set(&bursting, 0);
+    }
+
+    LOG_INF("Adaptive send %s", enabled ? "enabled" : "disabled");
+}
+
+int data_thread_set_latency_mode(bool enabled, uint32_t n_samples, uint32_t window_us) {
+    if (n_samples > SAMPLE_RING_SIZE || window_us > DATA_THREAD_MAX_COALESCE_US) {
+        LOG_ERR("Invalid coalescing window: %u samples / %u us", n_samples, window_us);
+        return -EINVAL;
+    }
+
+    atomic_set(&coalesce_samples, n_samples);
+    atomic_set(&coalesce_us, window_us);
+    atomic_set(&latency_mode, enabled);
+
+    // Wake the data thread up, so it starts waiting the new way
+    if (enabled) {
+        rate_timer_wake(&send_timer);
+    } else {
+        k_sem_give(&samples_queued);
+#if defined(CONFIG_APP_BLOCK_POOL)
+        block_pool_cancel_wait();
+#endif
+    }
+
+    LOG_INF("Latency mode %s (coalescing up to %u samples / %u us)", enabled ? "enabled" : "disabled", n_samples, window_us);
+
+    return 0;
+}
+
+// Max number of samples to coalesce (UINT32_MAX if there's no limit)
+static uint32_t data_thread_coalesce_limit(void) {
+    uint32_t n_samples = atomic_get(&coalesce_samples);
+    return (n_samples > 0) ? n_samples : UINT32_MAX;
+}
+
+void data_thread_notify(uint32_t n_samples) {
+    if (!atomic_get(&latency_mode) || n_samples == 0) {
+        return;
+    }
+
+    // Wake the data thread up on the first sample queued (which starts the coalescing window),
+    // and once enough samples are queued to end the window early
+    uint32_t n_before = atomic_add(&n_pending, n_samples);
+    uint32_t n_window = data_thread_coalesce_limit();
+    if (n_before == 0 || (n_before < n_window && n_before + n_samples >= n_window)) {
+        k_sem_give(&samples_queued);
+    }
+}
+
+int data_thread_set_aggregation(uint8_t channel, uint32_t window_samples, float window_ms) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        LOG_ERR("Invalid channel: %d", channel);
+        return -EINVAL;
+    }
+
+    if (window_samples > DATA_THREAD_MAX_WINDOW_SAMPLES || !(window_ms >= 0 && window_ms <= DATA_THREAD_MAX_WINDOW_MS)) {
+        LOG_ERR("Invalid aggregation window: %u samples / %.3f ms", window_samples, (double) window_ms);
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&send_mutex, K_FOREVER);
+    aggregator_init(&aggregators[channel], window_samples, (uint32_t) (window_ms * 1000));
+    k_mutex_unlock(&send_mutex);
+
+    LOG_INF("Channel %d aggregation set to %u samples / %.3f ms windows", channel, window_samples, (double) window_ms);
+
+    return 0;
+}
+
+void data_thread_get_timer_stats(rate_timer_stats_t* stats) { rate_timer_get_stats(&send_timer, stats); }
+
+void data_thread_get_stats(data_thread_stats_t* data_stats) {
+    k_mutex_lock(&send_mutex, K_FOREVER);
+    *data_stats = stats;
+    k_mutex_unlock(&send_mutex);
+}
+
+void data_thread_reset_stats(void) {
+    k_mutex_lock(&send_mutex, K_FOREVER);
+    memset(&stats, 0, sizeof(stats));
+    k_mutex_unlock(&send_mutex);
+
+    rate_timer_reset_stats(&send_timer);
+}
+
+int data_thread_send_message(const char* message) {
+    size_t n_bytes = 0;
+
+    k_mutex_lock(&send_mutex, K_FOREVER);
+
+    int ret = stream_encoder_encode_message(message, send_buffer, sizeof(send_buffer), &n_bytes);
+    if (ret == 0) {
+        ret = usb_comm_write(send_buffer, n_bytes);
+    }
+    if (ret == 0) {
+        stats.n_bytes_sent += n_bytes;
+    }
+
+    k_mutex_unlock(&send_mutex);
+
+    return ret;
+}
+
+int data_thread_set_stream_mode(stream_mode_t mode) {
+    char message[STREAM_MESSAGE_MAX_SIZE + 1] = {0};
+
+    // Keep the samples of the previous mode from being sent after the declaration (the
+    // send mutex can be locked again by the same thread)
+    k_mutex_lock(&send_mutex, K_FOREVER);
+
+    int ret = stream_encoder_set_mode(mode);
+    if (ret == 0) {
+        stream_encoder_describe(message, sizeof(message));
+        ret = data_thread_send_message(message);
+    }
 
-static uint16_t send_period      = 1000 / DEFAULT_SEND_RATE;                 // ms
-static uint32_t send_wait_us     = (1000 / DEFAULT_SEND_RATE) * 1000 / 10;   // us
-static uint64_t next_sample_time = 0;
+    k_mutex_unlock(&send_mutex);
 
-void data_thread_set_send_rate(uint16_t send_rate) {
-    send_period      = (send_rate < 1000) ? 1000 / send_rate : 1;
-    send_wait_us     = send_period * 1000 / 10;   // 1/10th of the period
-    next_sample_time = k_uptime_get() + send_period;
-    LOG_INF("Send rate set to %d Hz (new send period: %d ms)", send_rate, send_period);
+    return ret;
 }
 
-static void data_thread_wait_fixed_rate(void) {
-    while (k_uptime_get() < next_sample_time) {
-        k_usleep(send_wait_us);
+#if !defined(CONFIG_APP_BLOCK_POOL)
+// Move the samples queued in the ring buffer (up to the block size) into a block, one
+// field at a time. The samples are read in place and only then removed from the buffer
+// (if the producer overwrote any of them in the meantime, the block is refilled).
+static int data_thread_get_block(sample_ring_t* ring_buffer, sample_block_t* block) {
+    sample_ring_span_t spans[2] = {0};
+    int ret                     = 0;
+
+    do {
+        block->n_samples = 0;
+
+        ret = sample_ring_peek_contiguous(ring_buffer, spans);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (int i = 0; i < ARRAY_SIZE(spans); i++) {
+            for (uint32_t j = 0; j < spans[i].n_items && block->n_samples < DATA_THREAD_BLOCK_SIZE; j++) {
+                const sample_t* sample = &spans[i].items[j];
+
+                uint16_t n             = block->n_samples++;
+                block->channel[n]      = sample->channel;
+                block->index[n]        = sample->index;
+                block->timestamp_us[n] = sample->timestamp_us;
+                block->value[n]        = sample->value;
+            }
+        }
+
+        ret = sample_ring_consume(ring_buffer, block->n_samples);
+    } while (ret == -EAGAIN);
+
+    return ret;
+}
+#endif
+
+// Feed the samples of the channels with aggregation enabled to their aggregators (removing
+// them from the block), and collect the summaries of the windows ended
+static void data_thread_aggregate(sample_block_t* block, summary_block_t* summaries) {
+    uint16_t n_kept = 0;
+
+    summaries->n_summaries = 0;
+
+    for (uint16_t i = 0; i < block->n_samples; i++) {
+        uint8_t channel = block->channel[i];
+        if (channel < SIM_SENSOR_MAX_CHANNELS && aggregator_is_enabled(&aggregators[channel])) {
+            int ret = aggregator_add(&aggregators[channel], channel, block->timestamp_us[i], block->value[i], summaries);
+            if (ret != 0) {
+                LOG_WRN("Window summary dropped (err: %d - %s)", ret, strerror(-ret));
+            }
+            continue;
+        }
+
+        block->channel[n_kept]      = channel;
+        block->index[n_kept]        = block->index[i];
+        block->timestamp_us[n_kept] = block->timestamp_us[i];
+        block->value[n_kept]        = block->value[i];
+        n_kept++;
+    }
+
+    block->n_samples = n_kept;
+}
+
+static int data_thread_send_block(sample_block_t* block) {
+    static summary_block_t summaries = {0};
+    size_t n_bytes                   = 0;
+    int ret                          = 0;
+
+    k_mutex_lock(&send_mutex, K_FOREVER);
+
+    data_thread_aggregate(block, &summaries);
+
+    if (block->n_samples > 0) {
+        // Encode the samples (as text, binary or compressed frames)
+        ret = stream_encoder_encode(block, send_buffer, sizeof(send_buffer), &n_bytes);
+        if (ret != 0) {
+            LOG_ERR("Failed to encode samples (err: %d - %s)", ret, strerror(-ret));
+            k_mutex_unlock(&send_mutex);
+            return ret;
+        }
+
+        // Send all the samples over USB at once
+        ret = usb_comm_write(send_buffer, n_bytes);
+        if (ret != 0) {
+            LOG_ERR("Failed to send data over USB");
+            k_mutex_unlock(&send_mutex);
+            return ret;
+        }
+
+        stats.n_samples_sent += block->n_samples;
+        stats.n_bytes_sent += n_bytes;
+    }
+
+    if (summaries.n_summaries > 0) {
+        // Encode and send the window summaries the same way
+        ret = stream_encoder_encode_summaries(&summaries, send_buffer, sizeof(send_buffer), &n_bytes);
+        if (ret != 0) {
+            LOG_ERR("Failed to encode window summaries (err: %d - %s)", ret, strerror(-ret));
+            k_mutex_unlock(&send_mutex);
+            return ret;
+        }
+
+        ret = usb_comm_write(send_buffer, n_bytes);
+        if (ret != 0) {
+            LOG_ERR("Failed to send data over USB");
+            k_mutex_unlock(&send_mutex);
+            return ret;
+        }
+
+        stats.n_summaries_sent += summaries.n_summaries;
+        stats.n_bytes_sent += n_bytes;
+    }
+
+    k_mutex_unlock(&send_mutex);
+
+    return 0;
+}
+
+#if defined(CONFIG_APP_BLOCK_POOL)
+// The blocks are sent straight from the pool, as they were filled in by the sensor thread.
+// In latency mode, the data thread sleeps until the next block is handed over (the
+// samples are already coalesced into blocks, one per sensor thread wakeup).
+static void data_thread_loop(sample_ring_t* ring_buffer) {
+    while (true) {
+        k_timeout_t timeout = K_NO_WAIT;
+        if (atomic_get(&latency_mode)) {
+            timeout = K_FOREVER;
+        } else {
+            rate_timer_wait(&send_timer);
+        }
+
+        // Send all the blocks queued (returning each one to the pool once sent)
+        sample_block_t* block = NULL;
+        while ((block = block_pool_get(timeout)) != NULL) {
+            if (!K_TIMEOUT_EQ(timeout, K_NO_WAIT)) {
+                k_mutex_lock(&send_mutex, K_FOREVER);
+                stats.n_wakeups++;
+                k_mutex_unlock(&send_mutex);
+                timeout = K_NO_WAIT;
+            }
+
+            int ret = data_thread_send_block(block);
+            if (ret == 0) {
+                LOG_DBG("Sent: %d samples", block->n_samples);
+            }
+            block_pool_free(block);
+        }
     }
-    next_sample_time += send_period;
 }
+#else
+// Called (by the sensor or the data thread) when the ring buffer fills up to its high-water
+// mark, or drains back down to its low-water mark
+static void data_thread_on_watermark(ring_buffer_watermark_t watermark, uint32_t count, void* user_data) {
+    if (atomic_get(&adaptive_send)) {
+        // Burst until the buffer is drained (waking up the data thread if it's waiting for the next send period)
+        atomic_set(&bursting, watermark == RING_BUFFER_HIGH_WATERMARK);
+        if (watermark == RING_BUFFER_HIGH_WATERMARK) {
+            rate_timer_wake(&send_timer);
+        }
+    } else if (watermark == RING_BUFFER_HIGH_WATERMARK) {
+        LOG_WRN("Ring buffer is filling up (%u samples queued)", count);
+    } else {
+        LOG_INF("Ring buffer drained (%u samples queued)", count);
+    }
+}
+
+// Sleep until the sensor thread queues new samples (latency mode), and then for the rest of
+// the coalescing window (if any)
+static void data_thread_wait_for_samples(void) {
+    k_sem_take(&samples_queued, K_FOREVER);
 
-static void data_thread_loop(ring_buffer_t* ring_buffer) {
-    uint8_t buffer[20] = {0};
-    uint8_t n_bytes    = 0;
-    float sample       = 0.0;
+    uint32_t window_us = atomic_get(&coalesce_us);
+    if (window_us > 0 && (uint32_t) atomic_get(&n_pending) < data_thread_coalesce_limit()) {
+        k_sem_take(&samples_queued, K_USEC(window_us));
+    }
+
+    // Samples queued from now on wake the data thread up again
+    atomic_set(&n_pending, 0);
+
+    k_mutex_lock(&send_mutex, K_FOREVER);
+    stats.n_wakeups++;
+    k_mutex_unlock(&send_mutex);
+}
 
-    next_sample_time = k_uptime_get() + send_period;
+static void data_thread_loop(sample_ring_t* ring_buffer) {
+    static sample_block_t block = {0};
+    bool burst                  = false;
+    bool full                   = false;   // Set if the last block sent was full (so more samples may be queued)
 
     while (true) {
-        // Wait for the next sample
-        data_thread_wait_fixed_rate();
+        // If the last block sent was full, keep draining the buffer (so all the samples queued
+        // are sent on each send period or wakeup, however many blocks they take). Otherwise, in
+        // latency mode, sleep until new samples are queued, or wait for the next send period,
+        // unless bursting (in which case the samples are sent back to back, paced by the USB
+        // link, until the buffer is drained)
+        if (full) {
+            // Let the sensor thread run (it may have the same priority)
+            k_yield();
+        } else if (atomic_get(&latency_mode)) {
+            burst = false;
+            data_thread_wait_for_samples();
+        } else if (!atomic_get(&bursting)) {
+            burst = false;
+            rate_timer_wait(&send_timer);
+        } else if (!burst) {
+            burst = true;
+            k_mutex_lock(&send_mutex, K_FOREVER);
+            stats.n_bursts++;
+            k_mutex_unlock(&send_mutex);
+        } else {
+            // Let the sensor thread run (it may have the same priority)
+            k_yield();
+        }
 
-        // Get the next sample from the ring buffer
-        int ret = ring_buffer_get(ring_buffer, &sample, &n_bytes);
+        // Get the samples queued in the ring buffer (up to a block)
+        int ret = data_thread_get_block(ring_buffer, &block);
         if (ret != 0) {
-            LOG_ERR("Failed to get sample from the ring buffer (err: %d - %s)", ret, strerror(-ret));
+            LOG_ERR("Failed to get samples from the ring buffer (err: %d - %s)", ret, strerror(-ret));
+            full = false;
             continue;
         }
 
-        // Check if a sample was retrieved
-        if (n_bytes != sizeof(sample)) {
+        // Check if any sample was retrieved (a burst ends once there are none left)
+        full = (block.n_samples == DATA_THREAD_BLOCK_SIZE);
+        if (block.n_samples == 0) {
+            atomic_set(&bursting, 0);
             continue;
         }
 
-        // Convert the sample to text
-        n_bytes = snprintf((char*) buffer, sizeof(buffer), "%.1f\n", sample);
-
-        // Send the sample over USB
-        ret = usb_comm_write(buffer, n_bytes);
+        // Encode and send the block at once
+        ret = data_thread_send_block(&block);
         if (ret != 0) {
-            LOG_ERR("Failed to send data over USB");
             continue;
         }
 
-        LOG_DBG("Sent: %.1f", sample);
+        LOG_DBG("Sent: %d samples", block.n_samples);
     }
 }
+#endif
+
+void data_thread_start(sample_ring_t* ring_buffer) {
+    rate_timer_init(&send_timer);
+    rate_timer_start(&send_timer, send_rate, 0);
+
+#if !defined(CONFIG_APP_BLOCK_POOL)
+    int ret = sample_ring_set_watermarks(ring_buffer, DATA_THREAD_HIGH_WATERMARK, DATA_THREAD_LOW_WATERMARK, data_thread_on_watermark, NULL);
+    if (ret != 0) {
+        LOG_ERR("Invalid ring buffer water marks: %u / %u samples", DATA_THREAD_HIGH_WATERMARK, DATA_THREAD_LOW_WATERMARK);
+    }
+#endif
+
+    k_tid_t tid = k_thread_create(&data_thread, data_thread_stack, DATA_THREAD_STACK_SIZE, (k_thread_entry_t) data_thread_loop, ring_buffer,
+        NULL, NULL, DATA_THREAD_PRIO, 0, K_FOREVER);
+
+#if defined(CONFIG_SCHED_CPU_MASK) && (CONFIG_MP_MAX_NUM_CPUS > 1)
+    // On SMP builds keep the sensor and data threads on separate cores
+    k_thread_cpu_pin(tid, DATA_THREAD_CPU);
+#endif
 
-void data_thread_start(ring_buffer_t* ring_buffer) {
-    k_thread_create(&data_thread, data_thread_stack, DATA_THREAD_STACK_SIZE, (k_thread_entry_t) data_thread_loop, ring_buffer, NULL, NULL,
-        DATA_THREAD_PRIO, 0, K_NO_WAIT);
+    k_thread_start(tid);
 }
\ No newline at end of file
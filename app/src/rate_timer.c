@@ -0,0 +1,166 @@
+/**
+ * Created on Mon Dec 16 2024
+ *
+ * @brief Provides a periodic timer used to run a thread loop at a fixed rate.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include "rate_timer.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+LOG_MODULE_REGISTER(rate_timer, LOG_LEVEL_INF);
+
+/* Constants */
+#define TICKS_PER_SEC_MHZ ((uint64_t) CONFIG_SYS_CLOCK_TICKS_PER_SEC * RATE_MHZ_PER_HZ)
+#define MIN_WAKEUP_PERIOD MAX(CONFIG_SYS_CLOCK_TICKS_PER_SEC / RATE_MAX_WAKEUP_RATE, 1)   // ticks
+
+/*
+ * Note on the rate clock arithmetic: the products below are split into a quotient
+ * and a remainder part (i.e. 'a * b / c = (a / c) * b + (a % c) * b / c' when 'c'
+ * divides the first term), so that they never overflow 64 bits - even when a clock
+ * based on the system boot is used months later, at tens of kHz.
+ */
+
+void rate_clock_init(rate_clock_t* clock, uint32_t rate, int64_t base) {
+    clock->rate = rate;
+    clock->base = base;
+    clock->rem  = 0;
+}
+
+int64_t rate_clock_period_start(const rate_clock_t* clock, uint32_t index) {
+    return clock->base + (int64_t) ((index * TICKS_PER_SEC_MHZ + clock->rem) / clock->rate);
+}
+
+uint64_t rate_clock_periods_started(const rate_clock_t* clock, int64_t time) {
+    if (time < clock->base) {
+        return 0;
+    }
+
+    // Period 'k' has started if 'k * TICKS_PER_SEC_MHZ + rem < (time - base + 1) * rate'
+    // (every 'rate' periods take exactly 'TICKS_PER_SEC_MHZ' ticks)
+    uint64_t n_ticks  = time - clock->base + 1;
+    uint64_t n_cycles = n_ticks / TICKS_PER_SEC_MHZ;
+    int64_t rem_part  = (int64_t) ((n_ticks % TICKS_PER_SEC_MHZ) * clock->rate) - clock->rem;
+    int64_t n_rem     = (rem_part >= 0) ? DIV_ROUND_UP(rem_part, TICKS_PER_SEC_MHZ) : -(-rem_part / (int64_t) TICKS_PER_SEC_MHZ);
+    return n_cycles * clock->rate + n_rem;
+}
+
+void rate_clock_advance(rate_clock_t* clock, uint64_t n_periods) {
+    // Every 'rate' periods take exactly 'TICKS_PER_SEC_MHZ' ticks
+    uint64_t n_cycles = n_periods / clock->rate;
+    uint64_t rem_part = (n_periods % clock->rate) * TICKS_PER_SEC_MHZ + clock->rem;
+    clock->base += n_cycles * TICKS_PER_SEC_MHZ + rem_part / clock->rate;
+    clock->rem = rem_part % clock->rate;
+}
+
+void rate_timer_init(rate_timer_t* rate_timer) {
+    memset(rate_timer, 0, sizeof(rate_timer_t));
+    k_timer_init(&rate_timer->timer, NULL, NULL);
+}
+
+static inline uint8_t rate_timer_jitter_bucket(uint32_t jitter_us) {
+    uint8_t bucket = (jitter_us > 0) ? 32 - __builtin_clz(jitter_us) : 0;
+    return MIN(bucket, RATE_TIMER_JITTER_BUCKETS - 1);
+}
+
+// Must be called with the timer lock held
+static void rate_timer_clear_stats(rate_timer_t* rate_timer) {
+    rate_timer->jitter_sum_us = 0;
+    memset(&rate_timer->stats, 0, sizeof(rate_timer->stats));
+}
+
+void rate_timer_start(rate_timer_t* rate_timer, uint32_t rate, int64_t base) {
+    k_spinlock_key_t key = k_spin_lock(&rate_timer->lock);
+
+    // Make the latest period already started (if any) the first one to be served
+    rate_clock_init(&rate_timer->clock, rate, base);
+    uint64_t n_periods = rate_clock_periods_started(&rate_timer->clock, k_uptime_ticks());
+    if (n_periods > 0) {
+        rate_clock_advance(&rate_timer->clock, n_periods - 1);
+    }
+
+    rate_timer->served = rate_timer->clock;
+    rate_timer->wakeup = rate_clock_period_start(&rate_timer->clock, 0);
+    rate_timer_clear_stats(rate_timer);
+
+    k_timer_start(&rate_timer->timer, K_TIMEOUT_ABS_TICKS(rate_timer->wakeup), K_NO_WAIT);
+
+    k_spin_unlock(&rate_timer->lock, key);
+}
+
+uint32_t rate_timer_wait(rate_timer_t* rate_timer) {
+    uint64_t n_periods = 0;
+
+    // (the timer may be restarted by another thread in the meantime, in which
+    // case we may be woken up before any period has actually started)
+    while (n_periods == 0) {
+        // Return early if the thread was woken up (the flag is checked with the lock held,
+        // so a wakeup either shows up here or stops the timer started below)
+        k_spinlock_key_t key = k_spin_lock(&rate_timer->lock);
+        if (rate_timer->woken) {
+            rate_timer->woken = false;
+            k_spin_unlock(&rate_timer->lock, key);
+            return 0;
+        }
+
+        // Sleep until the next scheduled wakeup (returns immediately if it's due)
+        k_timer_start(&rate_timer->timer, K_TIMEOUT_ABS_TICKS(rate_timer->wakeup), K_NO_WAIT);
+        k_spin_unlock(&rate_timer->lock, key);
+
+        k_timer_status_sync(&rate_timer->timer);
+        int64_t now = k_uptime_ticks();
+
+        key = k_spin_lock(&rate_timer->lock);
+
+        // Serve all the periods started so far
+        n_periods = MIN(rate_clock_periods_started(&rate_timer->clock, now), UINT32_MAX);
+        if (n_periods > 0) {
+            // Update the stats (periods that only started because we woke up late are overruns)
+            uint64_t n_scheduled = rate_clock_periods_started(&rate_timer->clock, rate_timer->wakeup);
+            uint32_t jitter_us   = (now > rate_timer->wakeup) ? k_ticks_to_us_floor32(now - rate_timer->wakeup) : 0;
+            rate_timer->jitter_sum_us += jitter_us;
+            rate_timer->stats.n_periods += n_periods;
+            rate_timer->stats.n_wakeups++;
+            rate_timer->stats.n_overruns += n_periods - MIN(n_scheduled, n_periods);
+            rate_timer->stats.jitter_max_us = MAX(rate_timer->stats.jitter_max_us, jitter_us);
+            rate_timer->stats.jitter_hist[rate_timer_jitter_bucket(jitter_us)]++;
+
+            // Move on to the next period (without waking up more often than the max wakeup rate)
+            rate_timer->served = rate_timer->clock;
+            rate_clock_advance(&rate_timer->clock, n_periods);
+            rate_timer->wakeup = MAX(rate_clock_period_start(&rate_timer->clock, 0), rate_timer->wakeup + MIN_WAKEUP_PERIOD);
+        }
+
+        k_spin_unlock(&rate_timer->lock, key);
+    }
+
+    return n_periods;
+}
+
+void rate_timer_wake(rate_timer_t* rate_timer) {
+    k_spinlock_key_t key = k_spin_lock(&rate_timer->lock);
+    rate_timer->woken    = true;
+    k_spin_unlock(&rate_timer->lock, key);
+
+    // Stopping the timer releases the thread waiting on it
+    k_timer_stop(&rate_timer->timer);
+}
+
+int64_t rate_timer_get_period_start(rate_timer_t* rate_timer, uint32_t index) { return rate_clock_period_start(&rate_timer->served, index); }
+
+void rate_timer_get_stats(rate_timer_t* rate_timer, rate_timer_stats_t* stats) {
+    k_spinlock_key_t key = k_spin_lock(&rate_timer->lock);
+
+    *stats               = rate_timer->stats;
+    stats->jitter_avg_us = (stats->n_wakeups > 0) ? rate_timer->jitter_sum_us / stats->n_wakeups : 0;
+
+    k_spin_unlock(&rate_timer->lock, key);
+}
+
+void rate_timer_reset_stats(rate_timer_t* rate_timer) {
+    k_spinlock_key_t key = k_spin_lock(&rate_timer->lock);
+    rate_timer_clear_stats(rate_timer);
+    k_spin_unlock(&rate_timer->lock, key);
+}
@@ -0,0 +1,161 @@
+/**
+ * Created on Sat Dec 21 2024
+ *
+ * @brief Polyphase FIR resampler, used to convert a stream of samples from one rate
+ *        to any other rate.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include "resampler.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(resampler, LOG_LEVEL_INF);
+
+/*
+ * Inputs are numbered from 0 (the first input received), and output 'k' sits at position
+ * 'k * in_rate / out_rate' of the input stream. An output at position 'pos + phase / PHASES'
+ * is computed from the inputs 'pos - n_taps / 2 + 1' to 'pos + n_taps / 2', so it is only
+ * available once input 'pos + n_taps / 2' has been received. Inputs before the first one
+ * are taken to be equal to it (so the stream doesn't start with a transient), and so are
+ * the inputs after the last one once the stream ends.
+ *
+ * The filter for each phase is a Blackman-windowed sinc, normalized to a unity DC gain. The
+ * filter always runs in float (fixed-point samples are converted on the way in and out).
+ */
+
+int resampler_init(resampler_t* resampler, uint32_t in_rate, uint32_t out_rate, uint8_t n_taps) {
+    if (in_rate == 0 || out_rate == 0 || n_taps < 2 || n_taps > RESAMPLER_MAX_TAPS || n_taps % 2 != 0) {
+        LOG_ERR("Invalid resampler settings: %u mHz -> %u mHz (%d taps)", in_rate, out_rate, n_taps);
+        return -EINVAL;
+    }
+
+    memset(resampler, 0, sizeof(resampler_t));
+    resampler->in_rate  = in_rate;
+    resampler->out_rate = out_rate;
+    resampler->n_taps   = n_taps;
+    resampler->end_pos  = -1;
+
+    // Compute the filter bank (the cutoff is relative to the Nyquist frequency of the inputs)
+    int half     = n_taps / 2;
+    float cutoff = RESAMPLER_CUTOFF * MIN(1.0f, (float) out_rate / in_rate);
+    for (int phase = 0; phase <= RESAMPLER_PHASES; phase++) {
+        float* coeffs = resampler->coeffs[phase];
+        float sum     = 0;
+        for (int j = 0; j < n_taps; j++) {
+            float d      = (j - half + 1) - (float) phase / RESAMPLER_PHASES;   // Distance to the output (in inputs)
+            float x      = (float) M_PI * d / half;
+            float y      = (float) M_PI * cutoff * d;
+            float window = 0.42f + 0.5f * cosf(x) + 0.08f * cosf(2 * x);
+            coeffs[j]    = window * ((y != 0) ? sinf(y) / y : 1.0f);
+            sum += coeffs[j];
+        }
+        for (int j = 0; j < n_taps; j++) {
+            coeffs[j] /= sum;
+        }
+    }
+
+    LOG_INF("Resampler set to %u mHz -> %u mHz (%d taps)", in_rate, out_rate, n_taps);
+
+    return 0;
+}
+
+void resampler_reset(resampler_t* resampler) {
+    memset(resampler->history, 0, sizeof(resampler->history));
+    resampler->last_value         = 0;
+    resampler->first_timestamp_us = 0;
+    resampler->n_inputs           = 0;
+    resampler->next_pos           = 0;
+    resampler->next_frac          = 0;
+    resampler->n_outputs          = 0;
+    resampler->end_pos            = -1;
+}
+
+static void resampler_store(resampler_t* resampler, float value) {
+    uint8_t i                                 = resampler->n_inputs % resampler->n_taps;
+    resampler->history[i]                     = value;
+    resampler->history[i + resampler->n_taps] = value;
+    resampler->n_inputs++;
+}
+
+static bool resampler_output_ready(resampler_t* resampler) { return resampler->next_pos + resampler->n_taps / 2 < resampler->n_inputs; }
+
+int resampler_push(resampler_t* resampler, uint32_t timestamp_us, sample_value_t value) {
+    if (resampler->n_taps == 0 || resampler->end_pos >= 0) {
+        return -EINVAL;
+    }
+
+    if (resampler_output_ready(resampler)) {
+        return -EBUSY;
+    }
+
+    // Start the stream as if the first input had always been there
+    float input = sample_value_to_float(value);
+    if (resampler->n_inputs == 0) {
+        for (int i = 0; i < ARRAY_SIZE(resampler->history); i++) {
+            resampler->history[i] = input;
+        }
+        resampler->first_timestamp_us = timestamp_us;
+    }
+
+    resampler_store(resampler, input);
+    resampler->last_value = input;
+
+    return 0;
+}
+
+void resampler_end(resampler_t* resampler) {
+    if (resampler->n_inputs > 0) {
+        resampler->end_pos = resampler->n_inputs - 1;
+    }
+}
+
+uint16_t resampler_pull(resampler_t* resampler, uint8_t channel, sample_block_t* block) {
+    uint16_t n_outputs = 0;
+
+    while (resampler->n_inputs > 0 && block->n_samples < SAMPLE_BLOCK_MAX_SAMPLES) {
+        bool ended = (resampler->end_pos >= 0);
+        if (ended && (int64_t) resampler->next_pos > resampler->end_pos) {
+            break;
+        }
+
+        // Wait for the inputs the next output needs (holding the last input once the stream ended)
+        if (!resampler_output_ready(resampler)) {
+            if (!ended) {
+                break;
+            }
+            resampler_store(resampler, resampler->last_value);
+            continue;
+        }
+
+        // Filter the last inputs with the filter of the nearest phase
+        uint32_t phase      = ((uint64_t) resampler->next_frac * RESAMPLER_PHASES + resampler->out_rate / 2) / resampler->out_rate;
+        const float* coeffs = resampler->coeffs[phase];
+        const float* inputs = &resampler->history[resampler->n_inputs % resampler->n_taps];
+        float value         = 0;
+        for (int j = 0; j < resampler->n_taps; j++) {
+            value += coeffs[j] * inputs[j];
+        }
+
+        uint16_t i             = block->n_samples++;
+        uint64_t offset_us     = (uint64_t) resampler->n_outputs * 1000000000 / resampler->out_rate;
+        block->channel[i]      = channel;
+        block->index[i]        = resampler->n_outputs;
+        block->timestamp_us[i] = resampler->first_timestamp_us + (uint32_t) offset_us;
+        block->value[i]        = sample_value_from_float(value);
+        n_outputs++;
+
+        // Move on to the position of the next output
+        resampler->n_outputs++;
+        resampler->next_frac += resampler->in_rate;
+        resampler->next_pos += resampler->next_frac / resampler->out_rate;
+        resampler->next_frac %= resampler->out_rate;
+    }
+
+    return n_outputs;
+}
@@ -0,0 +1,201 @@
+/**
+ * Created on Mon Dec 23 2024
+ *
+ * @brief Lossless compression of blocks of samples, used by the compressed stream mode (and by
+ *        the binary stream mode, to pack the channels, indexes and timestamps).
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include "sample_codec.h"
+
+#include "sim_sensor.h"
+
+#include <errno.h>
+#include <string.h>
+
+// The bitstream of the float values (fixed-point values are sent as varints instead)
+#if !defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+/* Constants */
+#define VALUE_BITS      32
+#define NO_LEADING_ZERO 0xFF   // No meaningful bits stored yet (forces a new leading/trailing zeros block)
+
+/* Type definitions */
+typedef struct {
+    uint8_t* data;
+    size_t n_bytes;   // Number of whole bytes written
+    uint64_t acc;     // Bits not written yet (less than 8 between calls)
+    uint8_t n_acc;
+} bit_writer_t;
+
+// Append the lower 'n_bits' (up to 32) of 'bits' to the bitstream, MSB first
+static void sample_codec_put_bits(bit_writer_t* writer, uint32_t bits, uint8_t n_bits) {
+    writer->acc = (writer->acc << n_bits) | (bits & (uint32_t) ((1ULL << n_bits) - 1));
+    writer->n_acc += n_bits;
+    while (writer->n_acc >= 8) {
+        writer->n_acc -= 8;
+        writer->data[writer->n_bytes++] = (uint8_t) (writer->acc >> writer->n_acc);
+    }
+}
+
+// Write the remaining bits (padded with zeros to a whole byte)
+static void sample_codec_flush_bits(bit_writer_t* writer) {
+    if (writer->n_acc > 0) {
+        writer->data[writer->n_bytes++] = (uint8_t) (writer->acc << (8 - writer->n_acc));
+        writer->n_acc                   = 0;
+    }
+}
+#endif
+
+static uint32_t sample_codec_zigzag(int32_t value) { return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31); }
+
+// Write a LEB128 varint (7 bits per byte, LSB first) and return its size
+static size_t sample_codec_put_varint(uint8_t* dst, uint32_t value) {
+    size_t n_bytes = 0;
+    while (value >= 0x80) {
+        dst[n_bytes++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    dst[n_bytes++] = (uint8_t) value;
+    return n_bytes;
+}
+
+static size_t sample_codec_put_indexes(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* dst) {
+    uint32_t last_index[SIM_SENSOR_MAX_CHANNELS] = {0};
+    size_t n_bytes                               = 0;
+
+    for (size_t i = first; i < first + n_samples; i++) {
+        uint8_t channel = block->channel[i];
+        n_bytes += sample_codec_put_varint(&dst[n_bytes], sample_codec_zigzag((int32_t) (block->index[i] - last_index[channel])));
+        last_index[channel] = block->index[i];
+    }
+
+    return n_bytes;
+}
+
+static size_t sample_codec_put_timestamps(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* dst) {
+    uint32_t last_timestamp[SIM_SENSOR_MAX_CHANNELS] = {0};
+    uint32_t last_delta[SIM_SENSOR_MAX_CHANNELS]     = {0};
+    size_t n_bytes                                   = 0;
+
+    for (size_t i = first; i < first + n_samples; i++) {
+        uint8_t channel = block->channel[i];
+        uint32_t delta  = block->timestamp_us[i] - last_timestamp[channel];
+        n_bytes += sample_codec_put_varint(&dst[n_bytes], sample_codec_zigzag((int32_t) (delta - last_delta[channel])));
+        last_timestamp[channel] = block->timestamp_us[i];
+        last_delta[channel]     = delta;
+    }
+
+    return n_bytes;
+}
+
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+static size_t sample_codec_put_values(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* dst) {
+    uint32_t last_value[SIM_SENSOR_MAX_CHANNELS] = {0};
+    size_t n_bytes                               = 0;
+
+    for (size_t i = first; i < first + n_samples; i++) {
+        uint8_t channel = block->channel[i];
+        uint32_t value  = (uint32_t) (int32_t) block->value[i];
+        n_bytes += sample_codec_put_varint(&dst[n_bytes], sample_codec_zigzag((int32_t) (value - last_value[channel])));
+        last_value[channel] = value;
+    }
+
+    return n_bytes;
+}
+#else
+static size_t sample_codec_put_values(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* dst) {
+    uint32_t last_value[SIM_SENSOR_MAX_CHANNELS] = {0};
+    uint8_t leading[SIM_SENSOR_MAX_CHANNELS]     = {0};
+    uint8_t trailing[SIM_SENSOR_MAX_CHANNELS]    = {0};
+    bit_writer_t writer                          = {.data = dst};
+
+    memset(leading, NO_LEADING_ZERO, sizeof(leading));
+
+    for (size_t i = first; i < first + n_samples; i++) {
+        uint8_t channel = block->channel[i];
+        uint32_t value  = 0;
+        memcpy(&value, &block->value[i], sizeof(value));
+
+        uint32_t diff       = value ^ last_value[channel];
+        last_value[channel] = value;
+
+        if (diff == 0) {
+            sample_codec_put_bits(&writer, 0, 1);
+            continue;
+        }
+
+        // Reuse the previous leading/trailing zeros if the meaningful bits fit in them
+        uint8_t n_leading  = __builtin_clz(diff);
+        uint8_t n_trailing = __builtin_ctz(diff);
+        if (leading[channel] != NO_LEADING_ZERO && n_leading >= leading[channel] && n_trailing >= trailing[channel]) {
+            sample_codec_put_bits(&writer, 0x2, 2);
+            sample_codec_put_bits(&writer, diff >> trailing[channel], VALUE_BITS - leading[channel] - trailing[channel]);
+            continue;
+        }
+
+        uint8_t n_meaningful = VALUE_BITS - n_leading - n_trailing;
+        sample_codec_put_bits(&writer, 0x3, 2);
+        sample_codec_put_bits(&writer, n_leading, 5);
+        sample_codec_put_bits(&writer, n_meaningful - 1, 5);
+        sample_codec_put_bits(&writer, diff >> n_trailing, n_meaningful);
+        leading[channel]  = n_leading;
+        trailing[channel] = n_trailing;
+    }
+
+    sample_codec_flush_bits(&writer);
+
+    return writer.n_bytes;
+}
+#endif
+
+// Check a range of samples of a block (and the size of the buffer it's encoded into)
+static int sample_codec_check(const sample_block_t* block, size_t first, size_t n_samples, const uint8_t* buffer, size_t buffer_len,
+    size_t max_size) {
+    if (block == NULL || buffer == NULL || first + n_samples > block->n_samples) {
+        return -EINVAL;
+    }
+
+    if (buffer_len < max_size) {
+        return -ENOBUFS;
+    }
+
+    for (size_t i = first; i < first + n_samples; i++) {
+        if (block->channel[i] >= SIM_SENSOR_MAX_CHANNELS) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+// Encode the channels, indexes and timestamps, one field (column) at a time
+static size_t sample_codec_put_header(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* dst) {
+    size_t n_bytes = 0;
+    memcpy(dst, &block->channel[first], n_samples);
+    n_bytes += n_samples;
+    n_bytes += sample_codec_put_indexes(block, first, n_samples, &dst[n_bytes]);
+    n_bytes += sample_codec_put_timestamps(block, first, n_samples, &dst[n_bytes]);
+    return n_bytes;
+}
+
+int sample_codec_compress(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* buffer, size_t buffer_len) {
+    int ret = sample_codec_check(block, first, n_samples, buffer, buffer_len, SAMPLE_CODEC_MAX_SIZE(n_samples));
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Encode the block one field (column) at a time
+    size_t n_bytes = sample_codec_put_header(block, first, n_samples, buffer);
+    n_bytes += sample_codec_put_values(block, first, n_samples, &buffer[n_bytes]);
+
+    return n_bytes;
+}
+
+int sample_codec_pack_header(const sample_block_t* block, size_t first, size_t n_samples, uint8_t* buffer, size_t buffer_len) {
+    int ret = sample_codec_check(block, first, n_samples, buffer, buffer_len, SAMPLE_CODEC_HEADER_MAX_SIZE(n_samples));
+    if (ret < 0) {
+        return ret;
+    }
+
+    return sample_codec_put_header(block, first, n_samples, buffer);
+}
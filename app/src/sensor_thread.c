@@ -7,100 +7,426 @@
  */
 #include "sensor_thread.h"
 
+#include "block_pool.h"
+#include "data_thread.h"
+#include "rate_timer.h"
+#include "resampler.h"
 #include "sim_sensor.h"
 
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
 #include <errno.h>
-#include <math.h>
 
 LOG_MODULE_REGISTER(sensor_thread, LOG_LEVEL_INF);
 
 /* Constants */
 #define SENSOR_THREAD_STACK_SIZE 1000
 #define SENSOR_THREAD_PRIO       5
+#define SENSOR_THREAD_CPU        0   // Only used on SMP builds
 #define DEFAULT_READ_RATE        1   // Hz
 
+/* Type definitions */
+typedef struct {
+    uint32_t read_rate;        // mHz (the output rate, when the channel is resampled)
+    int64_t time_base;         // ticks
+    rate_clock_t clock;        // Period 0 is the next read to be served
+    int64_t next_read;         // Start of period 0 (ticks)
+    uint8_t n_taps;            // Number of resampler taps (0 if the channel is not resampled)
+    resampler_t* resampler;    // Taken from the pool while the channel is resampled (NULL otherwise)
+} channel_reader_t;
+
 /* Static variables */
 K_THREAD_STACK_DEFINE(sensor_thread_stack, SENSOR_THREAD_STACK_SIZE);
 static struct k_thread sensor_thread = {0};
+static rate_timer_t read_timer       = {0};
+static K_MUTEX_DEFINE(read_timer_mutex);
+
+static channel_reader_t readers[SIM_SENSOR_MAX_CHANNELS] = {
+    [0 ... SIM_SENSOR_MAX_CHANNELS - 1] = {.read_rate = DEFAULT_READ_RATE * RATE_MHZ_PER_HZ},
+};
+
+// Pool of resamplers (only taken by the channels being resampled)
+static resampler_t resamplers[CONFIG_APP_RESAMPLER_MAX_CHANNELS] = {0};
+
+static uint32_t timer_rate              = 0;      // mHz
+static int64_t timer_time_base          = 0;      // ticks
+static sample_block_t raw_block         = {0};    // Samples read from a resampled channel (before resampling)
+static uint16_t raw_next                = 0;      // Next sample of the raw block to be resampled
+static sample_ring_t* store_ring_buffer = NULL;   // Ring buffer the samples are stored in
 
-static uint16_t read_period      = 1000 / DEFAULT_READ_RATE;                 // ms
-static uint32_t read_wait_us     = (1000 / DEFAULT_READ_RATE) * 1000 / 10;   // us
-static uint64_t next_sample_time = 0;
+// Samples read on the current wakeup (read straight into a block of the pool, with CONFIG_APP_BLOCK_POOL)
+#if defined(CONFIG_APP_BLOCK_POOL)
+static sample_block_t* read_block = NULL;
+#else
+static sample_block_t read_buffer = {0};
+static sample_block_t* read_block = &read_buffer;
+#endif
 
-void sensor_thread_set_read_rate(uint16_t read_rate) {
-    read_period      = (read_rate < 1000) ? 1000 / read_rate : 1;
-    read_wait_us     = read_period * 1000 / 10;   // 1/10th of the period
-    next_sample_time = k_uptime_get() + read_period;
-    LOG_INF("Read rate set to %d Hz (new read period: %d ms)", read_rate, read_period);
+static void sensor_thread_log_timer_stats(void) {
+    rate_timer_stats_t stats = {0};
+    rate_timer_get_stats(&read_timer, &stats);
+    LOG_INF("Read jitter: avg %d us, max %d us (%d overruns in %d periods)", stats.jitter_avg_us, stats.jitter_max_us, stats.n_overruns,
+        stats.n_periods);
 }
 
-// Actively check if a new sample is available - this is what is
-// usually done (either through interrupts or by reading the sensor
-// status) if we're trying to keep up with the sensor data rate.
-static void sensor_thread_wait_for_new_data(void) {
-    while (!sim_sensor_new_sample_ready()) {
-        k_usleep(read_wait_us);
+// Drop the samples of a channel still to be resampled (if any)
+static void sensor_thread_drop_raw(uint8_t channel) {
+    if (raw_next < raw_block.n_samples && raw_block.channel[raw_next] == channel) {
+        raw_block.n_samples = 0;
+        raw_next            = 0;
     }
 }
 
-// Alternatively, we can try to force a fixed data rate - just to
-// demonstrate that reading the sensor at a different read rate than
-// what data is produced will lead to duplicates or missed samples)
-// (just like a normal sensor would)
-static void sensor_thread_wait_fixed_rate(void) {
-    while (k_uptime_get() < next_sample_time) {
-        k_usleep(read_wait_us);
+// Restart the reads of a channel from the latest read period already started (if any)
+static void sensor_thread_restart_reader(channel_reader_t* reader, uint32_t read_rate, int64_t time_base, int64_t now) {
+    rate_clock_init(&reader->clock, read_rate, time_base);
+    uint64_t n_periods = rate_clock_periods_started(&reader->clock, now);
+    if (n_periods > 0) {
+        rate_clock_advance(&reader->clock, n_periods - 1);
+    }
+    reader->time_base = time_base;
+    reader->next_read = rate_clock_period_start(&reader->clock, 0);
+    if (reader->resampler != NULL) {
+        resampler_reset(reader->resampler);
     }
-    next_sample_time += read_period;
 }
 
-static bool sensor_thread_force_fixed_rate(void) {
-    static bool force_fixed_rate = true;
-    bool new_state               = (read_period != sim_sensor_get_sample_period());
-
-    // When changing to fixed rate adjust the next sample time
-    if (new_state != force_fixed_rate && new_state == true) {
-        next_sample_time = k_uptime_get() + read_period;
+// Take a resampler from the pool, for a channel (NULL if they're all taken by other channels)
+static resampler_t* sensor_thread_take_resampler(uint8_t channel) {
+    if (readers[channel].resampler != NULL) {
+        return readers[channel].resampler;
     }
 
-    // Update the current state
-    force_fixed_rate = new_state;
+    for (int i = 0; i < ARRAY_SIZE(resamplers); i++) {
+        bool taken = false;
+        for (uint8_t j = 0; j < SIM_SENSOR_MAX_CHANNELS && !taken; j++) {
+            taken = (readers[j].resampler == &resamplers[i]);
+        }
+        if (!taken) {
+            return &resamplers[i];
+        }
+    }
 
-    return force_fixed_rate;
+    return NULL;
 }
 
-static void sensor_thread_loop(ring_buffer_t* ring_buffer) {
-    while (true) {
-        // Wait for the next sample
-        if (sensor_thread_force_fixed_rate()) {
-            sensor_thread_wait_fixed_rate();
-        } else {
-            sensor_thread_wait_for_new_data();
+// All the channels are served from a single timer, which runs at the fastest read rate.
+// On each wakeup, every channel is read at the start of each of its own read periods
+// that have started in the meantime - so slower channels are read on the exact same
+// samples as if they had a timer of their own (only their delivery may be delayed).
+//
+// When reading a channel at the same rate data is produced, we align the reads with the
+// sensor samples - this is what is usually done (either through interrupts or by reading
+// the sensor status) if we're trying to keep up with the sensor data rate.
+//
+// Alternatively, we force a fixed data rate (aligned with the system clock) - just to
+// demonstrate that reading the sensor at a different read rate than what data is
+// produced will lead to duplicates or missed samples (just like a normal sensor would).
+//
+// Resampled channels are always read along with the sensor samples (so each sample is
+// read exactly once), and are then resampled to the read rate set.
+static void sensor_thread_update_read_timer(void) {
+    int64_t now     = k_uptime_ticks();
+    uint8_t fastest = 0;
+
+    k_mutex_lock(&read_timer_mutex, K_FOREVER);
+
+    for (uint8_t channel = 0; channel < SIM_SENSOR_MAX_CHANNELS; channel++) {
+        channel_reader_t* reader = &readers[channel];
+        uint32_t data_rate       = sim_sensor_get_data_rate(channel);
+        uint32_t read_rate       = (reader->n_taps > 0) ? data_rate : reader->read_rate;
+        bool follow_sensor       = (read_rate == data_rate);
+        int64_t time_base        = follow_sensor ? sim_sensor_get_time_base(channel) : 0;
+
+        // Set up the resampler again if the rates or the taps changed
+        resampler_t* resampler = reader->resampler;
+        bool resampler_changed = (resampler != NULL) &&
+            (resampler->in_rate != data_rate || resampler->out_rate != reader->read_rate || resampler->n_taps != reader->n_taps);
+        if (reader->n_taps > 0 && resampler_changed) {
+            resampler_init(resampler, data_rate, reader->read_rate, reader->n_taps);
+            sensor_thread_drop_raw(channel);
         }
 
-        // Read the next sample
-        float sample = sim_sensor_read_sample();
+        // Restart the channel reads if their rate or phase needs to change
+        if (read_rate != reader->clock.rate || time_base != reader->time_base) {
+            sensor_thread_restart_reader(reader, read_rate, time_base, now);
+            sensor_thread_drop_raw(channel);
+        }
 
-        // Check if the sample is valid
-        if (isnan(sample)) {
-            continue;
+        if (reader->clock.rate > readers[fastest].clock.rate) {
+            fastest = channel;
         }
+    }
+
+    // Restart the timer if its rate or phase needs to change
+    uint32_t read_rate = readers[fastest].clock.rate;
+    int64_t time_base  = readers[fastest].time_base;
+    if (read_rate != timer_rate || time_base != timer_time_base) {
+        if (timer_rate != 0) {
+            sensor_thread_log_timer_stats();
+        }
+        rate_timer_start(&read_timer, read_rate, time_base);
+        timer_rate      = read_rate;
+        timer_time_base = time_base;
+    }
+
+    k_mutex_unlock(&read_timer_mutex);
+}
+
+int sensor_thread_set_read_rate(uint8_t channel, float rate) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        LOG_ERR("Invalid channel: %d", channel);
+        return -EINVAL;
+    }
+
+    if (!(rate > 0 && rate <= RATE_MAX_HZ)) {
+        LOG_ERR("Invalid read rate: %.3f Hz", (double) rate);
+        return -EINVAL;
+    }
 
-        // Store the sample in the ring buffer
-        int ret = ring_buffer_add(ring_buffer, &sample, sizeof(sample));
-        if (ret != 0) {
+    k_mutex_lock(&read_timer_mutex, K_FOREVER);
+    readers[channel].read_rate = RATE_HZ_TO_MHZ(rate);
+    k_mutex_unlock(&read_timer_mutex);
+
+    sensor_thread_update_read_timer();
+
+    LOG_INF("Channel %d read rate set to %.3f Hz", channel, (double) rate);
+
+    return 0;
+}
+
+uint32_t sensor_thread_get_read_rate(uint8_t channel) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        return 0;
+    }
+
+    k_mutex_lock(&read_timer_mutex, K_FOREVER);
+    uint32_t read_rate = readers[channel].read_rate;
+    k_mutex_unlock(&read_timer_mutex);
+
+    return read_rate;
+}
+
+int sensor_thread_set_resampling(uint8_t channel, uint8_t n_taps) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        LOG_ERR("Invalid channel: %d", channel);
+        return -EINVAL;
+    }
+
+    if (n_taps > RESAMPLER_MAX_TAPS || n_taps % 2 != 0) {
+        LOG_ERR("Invalid number of resampler taps: %d", n_taps);
+        return -EINVAL;
+    }
+
+    // The resampler is set up (from scratch) by the update, before the channel is read
+    // again (the mutex can be locked again by the same thread)
+    k_mutex_lock(&read_timer_mutex, K_FOREVER);
+
+    resampler_t* resampler = (n_taps > 0) ? sensor_thread_take_resampler(channel) : NULL;
+    if (n_taps > 0 && resampler == NULL) {
+        k_mutex_unlock(&read_timer_mutex);
+        LOG_ERR("No resampler left for channel %d (%d channels resampled)", channel, CONFIG_APP_RESAMPLER_MAX_CHANNELS);
+        return -ENOMEM;
+    }
+
+    if (resampler != NULL) {
+        resampler->n_taps = 0;
+    }
+    readers[channel].n_taps    = n_taps;
+    readers[channel].resampler = resampler;
+    sensor_thread_update_read_timer();
+
+    k_mutex_unlock(&read_timer_mutex);
+
+    LOG_INF("Channel %d resampling %s (%d taps)", channel, (n_taps > 0) ? "enabled" : "disabled", n_taps);
+
+    return 0;
+}
+
+int sensor_thread_set_overflow_policy(ring_buffer_policy_t policy, uint32_t timeout_ms) {
+    if (timeout_ms > SENSOR_THREAD_MAX_OVERFLOW_TIMEOUT_MS) {
+        LOG_ERR("Invalid ring buffer overflow timeout: %u ms", timeout_ms);
+        return -EINVAL;
+    }
+
+#if defined(CONFIG_APP_BLOCK_POOL)
+    int ret = block_pool_set_policy(policy, timeout_ms);
+#else
+    if (store_ring_buffer == NULL) {
+        return -ENODEV;
+    }
+
+    int ret = sample_ring_set_policy(store_ring_buffer, policy, timeout_ms);
+#endif
+    if (ret != 0) {
+        LOG_ERR("Invalid ring buffer overflow policy: %d", policy);
+        return ret;
+    }
+
+    LOG_INF("Ring buffer overflow policy set to %d (timeout: %u ms)", policy, timeout_ms);
+
+    return 0;
+}
+
+void sensor_thread_get_timer_stats(rate_timer_stats_t* stats) { rate_timer_get_stats(&read_timer, stats); }
+
+void sensor_thread_reset_timer_stats(void) { rate_timer_reset_stats(&read_timer); }
+
+#if defined(CONFIG_APP_BLOCK_POOL)
+// Hand the samples read so far over to the data thread (as a whole block), and start
+// filling in the next block
+static void sensor_thread_store_block(sample_ring_t* ring_buffer) { read_block = block_pool_submit(read_block); }
+#else
+// Store all the samples read so far in the ring buffer (and empty the read block)
+static void sensor_thread_store_block(sample_ring_t* ring_buffer) {
+    for (uint16_t i = 0; i < read_block->n_samples; i++) {
+        sample_t sample = {
+            .index        = read_block->index[i],
+            .timestamp_us = read_block->timestamp_us[i],
+            .value        = read_block->value[i],
+            .channel      = read_block->channel[i],
+        };
+
+        // Samples discarded by the ring buffer overflow policy are only counted (by the buffer)
+        int ret = sample_ring_add(ring_buffer, &sample);
+        if (ret == -ENOBUFS) {
+            continue;
+        } else if (ret != 0) {
             LOG_ERR("Failed to store sample in the ring buffer (err: %d - %s)", ret, strerror(-ret));
             continue;
         }
 
-        LOG_DBG("Stored: %.1f", sample);
+        LOG_DBG("Stored: [%u][%u] %.1f", sample.channel, sample.index, (double) sample_value_to_float(sample.value));
+
+        // Let the data thread know (latency mode). Done per sample, so it can free up slots
+        // while the sensor thread is blocked on a full buffer (block overflow policy).
+        data_thread_notify(1);
+    }
+    read_block->n_samples = 0;
+}
+#endif
+
+// Resample the samples read from a channel (into the read block). Returns false if the
+// read block filled up first (the samples left are resampled on the next call).
+static bool sensor_thread_resample(resampler_t* resampler, uint8_t channel) {
+    // Push the samples one at a time, collecting all the outputs ready after each one
+    while (true) {
+        resampler_pull(resampler, channel, read_block);
+        if (read_block->n_samples == SAMPLE_BLOCK_MAX_SAMPLES) {
+            return false;
+        }
+
+        if (raw_next == raw_block.n_samples || raw_block.channel[raw_next] != channel) {
+            break;
+        }
+        resampler_push(resampler, raw_block.timestamp_us[raw_next], raw_block.value[raw_next]);
+        raw_next++;
     }
+
+    // Once the simulation ends, collect the samples up to the last one read
+    if (!sim_sensor_is_running(channel) && resampler->n_inputs > 0) {
+        if (resampler->end_pos < 0) {
+            resampler_end(resampler);
+        }
+        resampler_pull(resampler, channel, read_block);
+        if (read_block->n_samples == SAMPLE_BLOCK_MAX_SAMPLES) {
+            return false;
+        }
+        resampler_reset(resampler);
+    }
+
+    return true;
 }
 
-void sensor_thread_start(ring_buffer_t* ring_buffer) {
-    k_thread_create(&sensor_thread, sensor_thread_stack, SENSOR_THREAD_STACK_SIZE, (k_thread_entry_t) sensor_thread_loop, ring_buffer, NULL, NULL,
-        SENSOR_THREAD_PRIO, 0, K_NO_WAIT);
+// Read all the samples of a channel due up to a given time (into the read block). Returns
+// false if the read block filled up first (the rest is read on the next call).
+static bool sensor_thread_read_channel(uint8_t channel, int64_t time) {
+    channel_reader_t* reader = &readers[channel];
+
+    // Resample the samples left from the last call first
+    if (reader->n_taps > 0 && !sensor_thread_resample(reader->resampler, channel)) {
+        return false;
+    }
+
+    // Check if any read period has started (most wakeups only serve the fastest channels)
+    if (time < reader->next_read) {
+        return true;
+    }
+
+    uint64_t n_reads = rate_clock_periods_started(&reader->clock, time);
+
+    // Read the samples due at the start of each period in as few blocks as possible
+    // (idle channels are simply moved forward, as there's nothing to read)
+    while (n_reads > 0 && sim_sensor_is_running(channel)) {
+        if (read_block->n_samples == SAMPLE_BLOCK_MAX_SAMPLES) {
+            return false;
+        }
+
+        uint16_t n_block_reads = 0;
+        if (reader->n_taps > 0) {
+            n_block_reads       = MIN(n_reads, SAMPLE_BLOCK_MAX_SAMPLES);
+            raw_block.n_samples = 0;
+            raw_next            = 0;
+            sim_sensor_read_block_at(channel, &reader->clock, n_block_reads, &raw_block);
+        } else {
+            n_block_reads = MIN(n_reads, SAMPLE_BLOCK_MAX_SAMPLES - read_block->n_samples);
+            sim_sensor_read_block_at(channel, &reader->clock, n_block_reads, read_block);
+        }
+        rate_clock_advance(&reader->clock, n_block_reads);
+        n_reads -= n_block_reads;
+
+        if (reader->n_taps > 0 && !sensor_thread_resample(reader->resampler, channel)) {
+            return false;
+        }
+    }
+
+    rate_clock_advance(&reader->clock, n_reads);
+    reader->next_read = rate_clock_period_start(&reader->clock, 0);
+
+    return true;
+}
+
+static void sensor_thread_loop(sample_ring_t* ring_buffer) {
+    while (true) {
+        // Wait for the next read period (at high read rates, several periods
+        // are served on each wakeup)
+        sensor_thread_update_read_timer();
+        uint32_t n_periods = rate_timer_wait(&read_timer);
+        int64_t now        = rate_timer_get_period_start(&read_timer, n_periods - 1);
+
+        // Serve all the channels, one read block at a time. The blocks are stored with the
+        // mutex released, as storing them may block (block overflow policy), and the read
+        // settings can then be changed in between (the reads pick up where they were left).
+        bool done = false;
+        while (!done) {
+            k_mutex_lock(&read_timer_mutex, K_FOREVER);
+            done = true;
+            for (uint8_t channel = 0; channel < SIM_SENSOR_MAX_CHANNELS && done; channel++) {
+                done = sensor_thread_read_channel(channel, now);
+            }
+            k_mutex_unlock(&read_timer_mutex);
+
+            sensor_thread_store_block(ring_buffer);
+        }
+    }
+}
+
+void sensor_thread_start(sample_ring_t* ring_buffer) {
+    rate_timer_init(&read_timer);
+    store_ring_buffer = ring_buffer;
+
+#if defined(CONFIG_APP_BLOCK_POOL)
+    read_block = block_pool_alloc();
+#endif
+
+    k_tid_t tid = k_thread_create(&sensor_thread, sensor_thread_stack, SENSOR_THREAD_STACK_SIZE, (k_thread_entry_t) sensor_thread_loop, ring_buffer,
+        NULL, NULL, SENSOR_THREAD_PRIO, 0, K_FOREVER);
+
+#if defined(CONFIG_SCHED_CPU_MASK) && (CONFIG_MP_MAX_NUM_CPUS > 1)
+    // On SMP builds keep the sensor and data threads on separate cores
+    k_thread_cpu_pin(tid, SENSOR_THREAD_CPU);
+#endif
+
+    k_thread_start(tid);
 }
\ No newline at end of file
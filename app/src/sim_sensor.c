@@ -7,10 +7,13 @@
  */
 #include "sim_sensor.h"
 
+#include "rate_timer.h"
+
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/random/random.h>
 
+#include <errno.h>
 #include <math.h>
 #include <memory.h>
 
@@ -19,119 +22,883 @@ LOG_MODULE_REGISTER(sim_sensor, LOG_LEVEL_INF);
 /* Constants */
 #define DEFAULT_DATA_RATE 1   // Hz
 
+// Waveforms are generated in Q15 (full scale: +-SIM_WAVE_ONE), then scaled to the amplitude
+#define SIM_WAVE_ONE        (1 << 15)
+#define SIM_SINE_TABLE_BITS 8   // 256 entries per cycle
+
 /* Type definitions */
+
+// Pattern arguments given as sample values (fixed-point values are not saturated, see sim_sensor_arg_value)
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+typedef int64_t sim_arg_value_t;
+#else
+typedef float sim_arg_value_t;
+#endif
+
 typedef struct {
-    int64_t last_sample_start_time;   // ms
+    rate_clock_t clock;      // Period 0 is the current sample (i.e. 'sample_index')
+    int64_t time_base;       // ticks (when the pattern was started, or the data rate last changed)
+    uint32_t base_index;     // Index of the sample produced at 'time_base' (as sent, see 'index_offset')
+    uint32_t index_offset;   // Index the first sample of the pattern is sent with (following the patterns played before it)
     uint32_t sample_index;
     uint32_t samples_read;
     float arg1;
     float arg2;
     float arg3;
+    // The arguments worked out once when the pattern starts (see sim_sensor_prepare), so the pattern
+    // functions do no float math on fixed-point builds
+    sim_arg_value_t value[3];   // As sample values
+    uint32_t count[3];          // As numbers of samples
+    uint64_t wave_step;         // Phase step of a waveform with a period of arg2 samples
+    uint64_t chirp_step;        // Phase step of a chirp reaching a period of arg2 samples at sample arg3
+    sim_arg_value_t noise;      // Amplitude of the noise overlaid on the waveform patterns (0 for none)
 } simulation_ctx_t;
 
-typedef float (*sim_sensor_pattern_fn)(simulation_ctx_t* ctx);
+// Scale of a Q15 waveform (the value it's centered on, and its amplitude)
+typedef struct {
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+    int64_t offset;      // Fixed-point
+    int64_t amplitude;   // Fixed-point
+#else
+    float offset;
+    float amplitude;   // Per Q15 step
+#endif
+} sim_wave_scale_t;
+
+// Pattern functions generate the values of a whole block of samples at once (given the
+// index of each one), so they are written as plain loops the compiler can vectorize. They
+// return the number of valid samples generated (the pattern ends at the first invalid one).
+// With fixed-point samples, they compute in integers only (from the arguments converted when
+// the pattern starts).
+typedef size_t (*sim_sensor_pattern_fn)(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n);
+
+typedef struct {
+    sim_sensor_pattern_fn pattern_fn;
+    float arg1;
+    float arg2;
+    float arg3;
+    uint32_t data_rate;   // mHz (0 keeps the current data rate)
+    uint32_t n_repeats;
+} sim_playlist_entry_t;
+
+typedef struct {
+    sim_sensor_pattern_fn pattern_fn;
+    simulation_ctx_t ctx;
+    uint32_t data_rate;                                       // mHz
+    float noise;                                              // Noise overlaid on the waveform patterns (see sim_sensor_set_noise)
+    uint32_t n_repeats;                                       // Number of times the current pattern is still to be played again
+    sim_playlist_entry_t playlist[SIM_SENSOR_PLAYLIST_SIZE];   // Patterns queued (played once the current one ends)
+    uint8_t playlist_head;
+    uint8_t playlist_len;
+    uint32_t seq;   // Changed whenever the state of the channel changes (see sim_sensor_read_block_at)
+} sim_channel_t;
 
 /* Static variables */
-static uint16_t sample_period           = 1000 / DEFAULT_DATA_RATE;   // ms
-static sim_sensor_pattern_fn pattern_fn = {0};
-static simulation_ctx_t sim_ctx         = {0};
+static sim_channel_t channels[SIM_SENSOR_MAX_CHANNELS] = {
+    [0 ... SIM_SENSOR_MAX_CHANNELS - 1] = {.data_rate = DEFAULT_DATA_RATE * RATE_MHZ_PER_HZ},
+};
+static struct k_spinlock sim_lock   = {0};
+static sim_sensor_stats_t sim_stats = {0};
+
+// One cycle of a sine wave in Q15 (plus the first entry again, to interpolate the last one)
+static const int16_t sine_table[(1 << SIM_SINE_TABLE_BITS) + 1] = {
+    0, 804, 1608, 2410, 3212, 4011, 4808, 5602, 6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530, 18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790, 27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971, 32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767, 32757, 32728, 32678, 32609, 32521, 32412, 32285, 32137, 31971, 31785, 31580, 31356, 31113, 30852, 30571,
+    30273, 29956, 29621, 29268, 28898, 28510, 28105, 27683, 27245, 26790, 26319, 25832, 25329, 24811, 24279, 23731,
+    23170, 22594, 22005, 21403, 20787, 20159, 19519, 18868, 18204, 17530, 16846, 16151, 15446, 14732, 14010, 13279,
+    12539, 11793, 11039, 10278, 9512, 8739, 7962, 7179, 6393, 5602, 4808, 4011, 3212, 2410, 1608, 804,
+    0, -804, -1608, -2410, -3212, -4011, -4808, -5602, -6393, -7179, -7962, -8739, -9512, -10278, -11039, -11793,
+    -12539, -13279, -14010, -14732, -15446, -16151, -16846, -17530, -18204, -18868, -19519, -20159, -20787, -21403, -22005, -22594,
+    -23170, -23731, -24279, -24811, -25329, -25832, -26319, -26790, -27245, -27683, -28105, -28510, -28898, -29268, -29621, -29956,
+    -30273, -30571, -30852, -31113, -31356, -31580, -31785, -31971, -32137, -32285, -32412, -32521, -32609, -32678, -32728, -32757,
+    -32767, -32757, -32728, -32678, -32609, -32521, -32412, -32285, -32137, -31971, -31785, -31580, -31356, -31113, -30852, -30571,
+    -30273, -29956, -29621, -29268, -28898, -28510, -28105, -27683, -27245, -26790, -26319, -25832, -25329, -24811, -24279, -23731,
+    -23170, -22594, -22005, -21403, -20787, -20159, -19519, -18868, -18204, -17530, -16846, -16151, -15446, -14732, -14010, -13279,
+    -12539, -11793, -11039, -10278, -9512, -8739, -7962, -7179, -6393, -5602, -4808, -4011, -3212, -2410, -1608, -804,
+    0,
+};
+
+/* Waveform functions */
+
+// Periodic waveforms are generated from a 32-bit phase (a whole cycle wraps it around). The phase
+// of each sample is worked out from its index with a single 64-bit multiply (keeping the upper 32
+// bits of the product, which wraps around exactly), so any sample can be generated on its own.
+
+// Get the phase step per sample of a waveform with a given period in samples (in 1/2^64 cycles),
+// or 0 if the period is too short to be sampled
+static uint64_t sim_sensor_phase_step(float period) { return (period >= 2) ? (uint64_t) (18446744073709551616.0f / period) : 0; }
+
+static inline uint32_t sim_sensor_phase(uint32_t index, uint64_t step) { return (uint32_t) ((index * step) >> 32); }
+
+// The phase of a linear chirp grows with the square of the index
+static inline uint32_t sim_sensor_chirp_phase(uint32_t index, uint64_t step) { return (uint32_t) (((uint64_t) index * index * step) >> 32); }
+
+// Interpolate the sine table linearly between its entries (with the next 16 bits of the phase)
+static inline int32_t sim_sensor_sine(uint32_t phase) {
+    uint32_t i   = phase >> (32 - SIM_SINE_TABLE_BITS);
+    int32_t frac = (phase >> (16 - SIM_SINE_TABLE_BITS)) & 0xFFFF;
+    return sine_table[i] + (((sine_table[i + 1] - sine_table[i]) * frac) >> 16);
+}
+
+static inline int32_t sim_sensor_square(uint32_t phase) { return (phase < 0x80000000u) ? SIM_WAVE_ONE : -SIM_WAVE_ONE; }
+
+static inline int32_t sim_sensor_sawtooth(uint32_t phase) { return (int16_t) (phase >> 16); }
+
+static inline int32_t sim_sensor_triangle(uint32_t phase) {
+    // Rising through 0 at the start of each cycle (like the sine)
+    uint32_t x = phase + 0x40000000u;
+    x          = (x < 0x80000000u) ? x : -x;
+    return (int32_t) (x >> 15) - SIM_WAVE_ONE;
+}
+
+// Triangular noise (the sum of two uniform values) from a xorshift generator
+static inline int32_t sim_sensor_noise(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return ((int32_t) (*state & 0xFFFF) + (int32_t) (*state >> 16) - 0xFFFF) / 2;
+}
+
+// Get the number of samples before the first one past a given number of samples
+static size_t sim_sensor_count_valid(const uint32_t* index, size_t n, uint32_t n_samples) {
+    size_t n_valid = 0;
+    while (n_valid < n && index[n_valid] < n_samples) {
+        n_valid++;
+    }
+    return n_valid;
+}
 
 /* Pattern simulation functions */
-static float sim_sensor_pattern_const(simulation_ctx_t* ctx) {
-    int value     = ctx->arg1;
-    int n_samples = ctx->arg2;
-    return (ctx->sample_index < n_samples) ? value : NAN;
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+// Saturate a fixed-point value to the range of the sample values
+static inline sample_value_t sim_sensor_saturate(int64_t value) { return CLAMP(value, SAMPLE_VALUE_MIN, SAMPLE_VALUE_MAX); }
+
+static size_t sim_sensor_pattern_const(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    // Whole values only (as in float builds)
+    sample_value_t value = sim_sensor_saturate(ctx->value[0] / (1 << SAMPLE_VALUE_FRAC_BITS) * (1 << SAMPLE_VALUE_FRAC_BITS));
+    size_t n_valid       = sim_sensor_count_valid(index, n, ctx->count[1]);
+    for (size_t i = 0; i < n_valid; i++) {
+        out[i] = value;
+    }
+    return n_valid;
+}
+
+// The ramps end on their bound even if it's out of the range of the sample values (so they are
+// compared before being saturated, as they would never go past it otherwise)
+static size_t sim_sensor_pattern_increasing(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    int64_t start_value = ctx->value[0];
+    int64_t increment   = ctx->value[1];
+    int64_t max_value   = ctx->value[2];
+    size_t n_valid      = 0;
+    while (n_valid < n && start_value + increment * index[n_valid] <= max_value) {
+        n_valid++;
+    }
+    for (size_t i = 0; i < n_valid; i++) {
+        out[i] = sim_sensor_saturate(start_value + increment * index[i]);
+    }
+    return n_valid;
+}
+
+static size_t sim_sensor_pattern_decreasing(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    int64_t start_value = ctx->value[0];
+    int64_t decrement   = ctx->value[1];
+    int64_t min_value   = ctx->value[2];
+    size_t n_valid      = 0;
+    while (n_valid < n && start_value - decrement * index[n_valid] >= min_value) {
+        n_valid++;
+    }
+    for (size_t i = 0; i < n_valid; i++) {
+        out[i] = sim_sensor_saturate(start_value - decrement * index[i]);
+    }
+    return n_valid;
+}
+
+// Get the scale of a Q15 waveform with a given amplitude, around a given value
+static inline sim_wave_scale_t sim_sensor_wave_scale(sim_arg_value_t value, sim_arg_value_t amplitude) {
+    return (sim_wave_scale_t) {.offset = value, .amplitude = amplitude};
+}
+
+// Scale a Q15 waveform sample
+static inline sample_value_t sim_sensor_scale_wave(const sim_wave_scale_t* scale, int32_t wave) {
+    return sim_sensor_saturate(scale->offset + ((scale->amplitude * wave) >> 15));
 }
 
-static float sim_sensor_pattern_increasing(simulation_ctx_t* ctx) {
+// Add a scaled Q15 waveform sample to a sample value (the scale offset is not used)
+static inline sample_value_t sim_sensor_add_wave(const sim_wave_scale_t* scale, sample_value_t value, int32_t wave) {
+    return sim_sensor_saturate(value + ((scale->amplitude * wave) >> 15));
+}
+
+static size_t sim_sensor_pattern_random(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    int64_t min_value = sim_sensor_saturate(ctx->value[0]);
+    int64_t max_value = sim_sensor_saturate(ctx->value[1]);
+    // Produce random values within the given range with the resolution of the sample values
+    uint64_t rand_interval = (max_value >= min_value) ? max_value - min_value + 1 : 0;
+    size_t n_valid         = (rand_interval > 0) ? sim_sensor_count_valid(index, n, ctx->count[2]) : 0;
+    // Fill the output with random bits in one go (as many as the sample values have, so they
+    // cover the whole range of values), then map them into the range (in place)
+    sys_rand_get(out, n_valid * sizeof(sample_value_t));
+    for (size_t i = 0; i < n_valid; i++) {
+        uint64_t rand_value = (int64_t) out[i] - SAMPLE_VALUE_MIN;
+        out[i]              = min_value + rand_value % rand_interval;
+    }
+    return n_valid;
+}
+
+#else
+static size_t sim_sensor_pattern_const(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    int value      = ctx->arg1;
+    int n_samples  = ctx->arg2;
+    size_t n_valid = 0;
+    while (n_valid < n && index[n_valid] < n_samples) {
+        n_valid++;
+    }
+    for (size_t i = 0; i < n_valid; i++) {
+        out[i] = value;
+    }
+    return n_valid;
+}
+
+static size_t sim_sensor_pattern_increasing(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
     float start_value = ctx->arg1;
     float increment   = ctx->arg2;
     float max_value   = ctx->arg3;
-    float value       = start_value + increment * ctx->sample_index;
-    return (value <= max_value) ? value : NAN;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = start_value + increment * index[i];
+    }
+    size_t n_valid = 0;
+    while (n_valid < n && out[n_valid] <= max_value) {
+        n_valid++;
+    }
+    return n_valid;
 }
 
-static float sim_sensor_pattern_decreasing(simulation_ctx_t* ctx) {
+static size_t sim_sensor_pattern_decreasing(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
     float start_value = ctx->arg1;
     float decrement   = ctx->arg2;
     float min_value   = ctx->arg3;
-    float value       = start_value - decrement * ctx->sample_index;
-    return (value >= min_value) ? value : NAN;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = start_value - decrement * index[i];
+    }
+    size_t n_valid = 0;
+    while (n_valid < n && out[n_valid] >= min_value) {
+        n_valid++;
+    }
+    return n_valid;
 }
 
-static float sim_sensor_pattern_random(simulation_ctx_t* ctx) {
+static size_t sim_sensor_pattern_random(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
     float min_value = ctx->arg1;
     float max_value = ctx->arg2;
     int n_samples   = ctx->arg3;
-    // Produce a random value withing the given range with a resolution of 0.1
+    // Produce random values within the given range with a resolution of 0.1
     int rand_interval = (int) ((max_value - min_value) * 10);
-    int rand_value    = (rand_interval > 0) ? sys_rand32_get() % rand_interval : 0;
-    float value       = min_value + rand_value / 10.0f;
-    return (ctx->sample_index < n_samples && rand_interval >= 0) ? value : NAN;
+    size_t n_valid    = 0;
+    while (rand_interval >= 0 && n_valid < n && index[n_valid] < n_samples) {
+        n_valid++;
+    }
+    if (rand_interval == 0) {
+        for (size_t i = 0; i < n_valid; i++) {
+            out[i] = min_value;
+        }
+        return n_valid;
+    }
+    // Fill the output with random bits in one go, then map them into the range (in place)
+    sys_rand_get(out, n_valid * sizeof(float));
+    for (size_t i = 0; i < n_valid; i++) {
+        uint32_t rand_value = 0;
+        memcpy(&rand_value, &out[i], sizeof(rand_value));
+        out[i] = min_value + (rand_value % rand_interval) / 10.0f;
+    }
+    return n_valid;
+}
+// Get the scale of a Q15 waveform with a given amplitude, around a given value
+static inline sim_wave_scale_t sim_sensor_wave_scale(sim_arg_value_t value, sim_arg_value_t amplitude) {
+    return (sim_wave_scale_t) {.offset = value, .amplitude = amplitude / SIM_WAVE_ONE};
+}
+
+// Scale a Q15 waveform sample
+static inline sample_value_t sim_sensor_scale_wave(const sim_wave_scale_t* scale, int32_t wave) { return scale->offset + scale->amplitude * wave; }
+
+// Add a scaled Q15 waveform sample to a sample value (the scale offset is not used)
+static inline sample_value_t sim_sensor_add_wave(const sim_wave_scale_t* scale, sample_value_t value, int32_t wave) {
+    return value + scale->amplitude * wave;
+}
+#endif
+
+// Generate a waveform pattern (the waveform is picked out of the loops, so each one is a plain loop
+// writing straight into the output), with the noise overlaid in a second pass (if any)
+static inline size_t sim_sensor_pattern_wave(sim_sensor_pattern_t pattern, const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out,
+    size_t n) {
+    sim_wave_scale_t scale = sim_sensor_wave_scale(0, ctx->value[0]);
+    sim_arg_value_t noise  = ctx->noise;
+    uint64_t step          = ctx->wave_step;
+    size_t n_valid         = sim_sensor_count_valid(index, n, ctx->count[2]);
+
+    switch (pattern) {
+        case PATTERN_CHIRP: step = ctx->chirp_step; break;
+        case PATTERN_NOISE:
+            // A constant value, with the noise overlaid
+            scale = sim_sensor_wave_scale(ctx->value[0], 0);
+            noise = ctx->value[1];
+            break;
+        default: break;
+    }
+    if (step == 0 && pattern != PATTERN_NOISE) {
+        return 0;
+    }
+
+    switch (pattern) {
+        case PATTERN_SINE:
+            for (size_t i = 0; i < n_valid; i++) {
+                out[i] = sim_sensor_scale_wave(&scale, sim_sensor_sine(sim_sensor_phase(index[i], step)));
+            }
+            break;
+        case PATTERN_SQUARE:
+            for (size_t i = 0; i < n_valid; i++) {
+                out[i] = sim_sensor_scale_wave(&scale, sim_sensor_square(sim_sensor_phase(index[i], step)));
+            }
+            break;
+        case PATTERN_TRIANGLE:
+            for (size_t i = 0; i < n_valid; i++) {
+                out[i] = sim_sensor_scale_wave(&scale, sim_sensor_triangle(sim_sensor_phase(index[i], step)));
+            }
+            break;
+        case PATTERN_SAWTOOTH:
+            for (size_t i = 0; i < n_valid; i++) {
+                out[i] = sim_sensor_scale_wave(&scale, sim_sensor_sawtooth(sim_sensor_phase(index[i], step)));
+            }
+            break;
+        case PATTERN_CHIRP:
+            for (size_t i = 0; i < n_valid; i++) {
+                out[i] = sim_sensor_scale_wave(&scale, sim_sensor_sine(sim_sensor_chirp_phase(index[i], step)));
+            }
+            break;
+        case PATTERN_NOISE:
+            for (size_t i = 0; i < n_valid; i++) {
+                out[i] = sim_sensor_scale_wave(&scale, 0);
+            }
+            break;
+        default: break;
+    }
+
+    if (noise != 0 && n_valid > 0) {
+        sim_wave_scale_t noise_scale = sim_sensor_wave_scale(0, noise);
+        uint32_t state               = 0;
+        sys_rand_get(&state, sizeof(state));
+        state |= 1;   // (the generator gets stuck on 0)
+        for (size_t i = 0; i < n_valid; i++) {
+            out[i] = sim_sensor_add_wave(&noise_scale, out[i], sim_sensor_noise(&state));
+        }
+    }
+    return n_valid;
+}
+
+static size_t sim_sensor_pattern_sine(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    return sim_sensor_pattern_wave(PATTERN_SINE, ctx, index, out, n);
+}
+
+static size_t sim_sensor_pattern_square(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    return sim_sensor_pattern_wave(PATTERN_SQUARE, ctx, index, out, n);
+}
+
+static size_t sim_sensor_pattern_triangle(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    return sim_sensor_pattern_wave(PATTERN_TRIANGLE, ctx, index, out, n);
+}
+
+static size_t sim_sensor_pattern_sawtooth(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    return sim_sensor_pattern_wave(PATTERN_SAWTOOTH, ctx, index, out, n);
+}
+
+static size_t sim_sensor_pattern_chirp(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    return sim_sensor_pattern_wave(PATTERN_CHIRP, ctx, index, out, n);
+}
+
+static size_t sim_sensor_pattern_noise(const simulation_ctx_t* ctx, const uint32_t* index, sample_value_t* out, size_t n) {
+    return sim_sensor_pattern_wave(PATTERN_NOISE, ctx, index, out, n);
+}
+
+static sim_sensor_pattern_fn sim_sensor_get_pattern_fn(sim_sensor_pattern_t pattern) {
+    switch (pattern) {
+        case PATTERN_CONST: return sim_sensor_pattern_const;
+        case PATTERN_INCREASING: return sim_sensor_pattern_increasing;
+        case PATTERN_DECREASING: return sim_sensor_pattern_decreasing;
+        case PATTERN_RANDOM: return sim_sensor_pattern_random;
+        case PATTERN_SINE: return sim_sensor_pattern_sine;
+        case PATTERN_SQUARE: return sim_sensor_pattern_square;
+        case PATTERN_TRIANGLE: return sim_sensor_pattern_triangle;
+        case PATTERN_SAWTOOTH: return sim_sensor_pattern_sawtooth;
+        case PATTERN_CHIRP: return sim_sensor_pattern_chirp;
+        case PATTERN_NOISE: return sim_sensor_pattern_noise;
+        default: return NULL;
+    }
+}
+
+// Convert a pattern argument to a sample value. Fixed-point values are not saturated to the range of the
+// sample values (only to +-INT32_MAX steps, so they can be multiplied by a sample index without overflowing)
+static sim_arg_value_t sim_sensor_arg_value(float value) {
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+    float scaled = value * (float) (1UL << SAMPLE_VALUE_FRAC_BITS);
+    if (!(scaled > (float) -INT32_MAX)) {
+        return -INT32_MAX;
+    }
+    if (scaled >= (float) INT32_MAX) {
+        return INT32_MAX;
+    }
+    return (int64_t) ((scaled >= 0) ? scaled + 0.5f : scaled - 0.5f);
+#else
+    return value;
+#endif
+}
+
+// Convert a pattern argument to a number of samples
+static uint32_t sim_sensor_arg_count(float n_samples) { return (n_samples > 0) ? ((n_samples < UINT32_MAX) ? n_samples : UINT32_MAX) : 0; }
+
+// Work out the arguments of a pattern in the forms the pattern functions use
+static void sim_sensor_prepare(simulation_ctx_t* ctx) {
+    const float args[] = {ctx->arg1, ctx->arg2, ctx->arg3};
+    for (int i = 0; i < ARRAY_SIZE(args); i++) {
+        ctx->value[i] = sim_sensor_arg_value(args[i]);
+        ctx->count[i] = sim_sensor_arg_count(args[i]);
+    }
+    ctx->wave_step = sim_sensor_phase_step(ctx->arg2);
+    // The frequency of a chirp reaches 1/arg2 cycles per sample at sample arg3 (so the phase is index^2 / (2 * arg2 * arg3) cycles)
+    ctx->chirp_step = (ctx->arg2 >= 2 && ctx->arg3 >= 1) ? sim_sensor_phase_step(ctx->arg2 * ctx->arg3) / 2 : 0;
+}
+
+size_t sim_sensor_generate_block(sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3, const uint32_t* index, sample_value_t* out,
+    size_t n) {
+    sim_sensor_pattern_fn pattern_fn = sim_sensor_get_pattern_fn(pattern);
+    simulation_ctx_t ctx             = {.arg1 = arg1, .arg2 = arg2, .arg3 = arg3};
+    sim_sensor_prepare(&ctx);
+    return (pattern_fn != NULL && index != NULL && out != NULL) ? pattern_fn(&ctx, index, out, n) : 0;
+}
+
+/* Playlist functions */
+
+// Start simulating a pattern on a channel (with the lock held). Samples are produced at the data rate
+// from 'time_base' on, where sample 'base_index' is produced, and the pattern starts on sample 'index_offset'.
+static void sim_sensor_play(sim_channel_t* ch, const sim_playlist_entry_t* entry, int64_t time_base, uint32_t base_index, uint32_t index_offset) {
+    memset(&ch->ctx, 0, sizeof(ch->ctx));
+    ch->pattern_fn       = entry->pattern_fn;
+    ch->ctx.time_base    = time_base;
+    ch->ctx.base_index   = base_index;
+    ch->ctx.index_offset = index_offset;
+    ch->ctx.arg1         = entry->arg1;
+    ch->ctx.arg2         = entry->arg2;
+    ch->ctx.arg3         = entry->arg3;
+    ch->ctx.noise        = sim_sensor_arg_value(ch->noise);
+    sim_sensor_prepare(&ch->ctx);
+    rate_clock_init(&ch->ctx.clock, ch->data_rate, time_base);
+    rate_clock_advance(&ch->ctx.clock, index_offset - base_index);
+    ch->seq++;
+}
+
+// Find the first sample a pattern doesn't produce, between the first sample not known to be
+// produced and a sample known not to be (patterns end at their first invalid sample)
+static uint32_t sim_sensor_find_end(sim_sensor_pattern_fn pattern_fn, const simulation_ctx_t* ctx, uint32_t first, uint32_t end) {
+    while (first < end) {
+        uint32_t index       = first + (end - first) / 2;
+        sample_value_t value = 0;
+        if (pattern_fn(ctx, &index, &value, 1) == 1) {
+            first = index + 1;
+        } else {
+            end = index;
+        }
+    }
+    return end;
+}
+
+// Move on once the current pattern of a channel ends at a given sample (the first one it didn't
+// produce): play it again, or play the next pattern queued (if any), from that sample on
+static void sim_sensor_next_pattern(sim_channel_t* ch, uint32_t end_index) {
+    sim_playlist_entry_t entry = {.pattern_fn = ch->pattern_fn, .arg1 = ch->ctx.arg1, .arg2 = ch->ctx.arg2, .arg3 = ch->ctx.arg3};
+
+    // Patterns that didn't produce any samples are not repeated (so they can't loop forever)
+    if (ch->n_repeats > 0 && end_index > 0) {
+        ch->n_repeats--;
+    } else if (ch->playlist_len > 0) {
+        entry             = ch->playlist[ch->playlist_head];
+        ch->playlist_head = (ch->playlist_head + 1) % SIM_SENSOR_PLAYLIST_SIZE;
+        ch->playlist_len--;
+        ch->n_repeats = entry.n_repeats;
+    } else {
+        ch->pattern_fn = NULL;
+        ch->seq++;
+        return;
+    }
+
+    // Keep producing samples on the same clock (so readers aligned with it don't notice the change),
+    // unless the data rate changes - then the new rate applies from the time the end sample is due
+    int64_t time_base     = ch->ctx.time_base;
+    uint32_t base_index   = ch->ctx.base_index;
+    uint32_t index_offset = ch->ctx.index_offset + end_index;
+    if (entry.data_rate != 0 && entry.data_rate != ch->data_rate) {
+        rate_clock_t clock = {0};
+        rate_clock_init(&clock, ch->data_rate, time_base);
+        time_base     = rate_clock_period_start(&clock, index_offset - base_index);
+        base_index    = index_offset;
+        ch->data_rate = entry.data_rate;
+    }
+    sim_sensor_play(ch, &entry, time_base, base_index, index_offset);
 }
 
 /* Other functions */
-void sim_sensor_set_data_rate(uint16_t data_rate) {
-    sample_period = (data_rate < 1000) ? 1000 / data_rate : 1;
-    LOG_INF("Data rate set to %d Hz (new sample period: %d ms)", data_rate, sample_period);
+int sim_sensor_set_data_rate(uint8_t channel, float rate) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        LOG_ERR("Invalid channel: %d", channel);
+        return -EINVAL;
+    }
+
+    if (!(rate > 0 && rate <= RATE_MAX_HZ)) {
+        LOG_ERR("Invalid data rate: %.3f Hz", (double) rate);
+        return -EINVAL;
+    }
+
+    sim_channel_t* ch    = &channels[channel];
+    k_spinlock_key_t key = k_spin_lock(&sim_lock);
+
+    ch->data_rate = RATE_HZ_TO_MHZ(rate);
+
+    // Produce the next samples at the new rate (from the start of the current sample)
+    if (ch->pattern_fn != NULL) {
+        ch->ctx.time_base  = rate_clock_period_start(&ch->ctx.clock, 0);
+        ch->ctx.base_index = ch->ctx.index_offset + ch->ctx.sample_index;
+        rate_clock_init(&ch->ctx.clock, ch->data_rate, ch->ctx.time_base);
+    }
+    ch->seq++;
+
+    k_spin_unlock(&sim_lock, key);
+
+    LOG_INF("Channel %d data rate set to %.3f Hz", channel, (double) rate);
+
+    return 0;
 };
 
-uint16_t sim_sensor_get_sample_period(void) { return sample_period; }
+int sim_sensor_set_noise(uint8_t channel, float amplitude) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        LOG_ERR("Invalid channel: %d", channel);
+        return -EINVAL;
+    }
+
+    if (!(amplitude >= 0 && isfinite(amplitude))) {
+        LOG_ERR("Invalid noise amplitude: %.3f", (double) amplitude);
+        return -EINVAL;
+    }
 
-void sim_sensor_start_pattern(sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3) {
-    // Clear the current simulation context
-    memset(&sim_ctx, 0, sizeof(sim_ctx));
+    sim_channel_t* ch     = &channels[channel];
+    sim_arg_value_t noise = sim_sensor_arg_value(amplitude);
+    k_spinlock_key_t key  = k_spin_lock(&sim_lock);
 
-    // Set the new pattern function to be used
-    switch (pattern) {
-        case PATTERN_CONST: pattern_fn = sim_sensor_pattern_const; break;
-        case PATTERN_INCREASING: pattern_fn = sim_sensor_pattern_increasing; break;
-        case PATTERN_DECREASING: pattern_fn = sim_sensor_pattern_decreasing; break;
-        case PATTERN_RANDOM: pattern_fn = sim_sensor_pattern_random; break;
-        default: pattern_fn = NULL; break;
+    // Applies to the current pattern (from the next samples generated) and to the next ones
+    ch->noise     = amplitude;
+    ch->ctx.noise = noise;
+    ch->seq++;
+
+    k_spin_unlock(&sim_lock, key);
+
+    LOG_INF("Channel %d noise set to %.3f", channel, (double) amplitude);
+
+    return 0;
+}
+
+uint32_t sim_sensor_get_data_rate(uint8_t channel) { return (channel < SIM_SENSOR_MAX_CHANNELS) ? channels[channel].data_rate : 0; }
+
+int64_t sim_sensor_get_time_base(uint8_t channel) { return (channel < SIM_SENSOR_MAX_CHANNELS) ? channels[channel].ctx.time_base : 0; }
+
+int sim_sensor_start_pattern(uint8_t channel, sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        LOG_ERR("Invalid channel: %d", channel);
+        return -EINVAL;
+    }
+
+    if (pattern != PATTERN_NONE && sim_sensor_get_pattern_fn(pattern) == NULL) {
+        LOG_ERR("Invalid pattern: %d", pattern);
+        return -EINVAL;
+    }
+
+    sim_channel_t* ch    = &channels[channel];
+    k_spinlock_key_t key = k_spin_lock(&sim_lock);
+
+    // Replace the current simulation (and the patterns queued) with the new pattern
+    sim_playlist_entry_t entry = {.pattern_fn = sim_sensor_get_pattern_fn(pattern), .arg1 = arg1, .arg2 = arg2, .arg3 = arg3};
+    ch->n_repeats              = 0;
+    ch->playlist_len           = 0;
+    sim_sensor_play(ch, &entry, k_uptime_ticks(), 0, 0);
+
+    k_spin_unlock(&sim_lock, key);
+
+    LOG_INF("Channel %d simulation with pattern %d started (args: %.1f, %.1f, %.1f)", channel, pattern, arg1, arg2, arg3);
+
+    return 0;
+}
+
+int sim_sensor_queue_pattern(uint8_t channel, sim_sensor_pattern_t pattern, float arg1, float arg2, float arg3, float data_rate,
+    uint32_t n_repeats) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        LOG_ERR("Invalid channel: %d", channel);
+        return -EINVAL;
+    }
+
+    if (sim_sensor_get_pattern_fn(pattern) == NULL) {
+        LOG_ERR("Invalid pattern: %d", pattern);
+        return -EINVAL;
+    }
+
+    if (!(data_rate == 0 || (data_rate > 0 && data_rate <= RATE_MAX_HZ))) {
+        LOG_ERR("Invalid data rate: %.3f Hz", (double) data_rate);
+        return -EINVAL;
+    }
+
+    sim_channel_t* ch          = &channels[channel];
+    sim_playlist_entry_t entry = {
+        .pattern_fn = sim_sensor_get_pattern_fn(pattern),
+        .arg1       = arg1,
+        .arg2       = arg2,
+        .arg3       = arg3,
+        .data_rate  = (data_rate > 0) ? RATE_HZ_TO_MHZ(data_rate) : 0,
+        .n_repeats  = n_repeats,
+    };
+    k_spinlock_key_t key = k_spin_lock(&sim_lock);
+
+    // Play the pattern right away if no simulation is ongoing (nothing is queued then), or queue it
+    if (ch->pattern_fn == NULL) {
+        ch->data_rate = (entry.data_rate != 0) ? entry.data_rate : ch->data_rate;
+        ch->n_repeats = n_repeats;
+        sim_sensor_play(ch, &entry, k_uptime_ticks(), 0, 0);
+    } else if (ch->playlist_len < SIM_SENSOR_PLAYLIST_SIZE) {
+        ch->playlist[(ch->playlist_head + ch->playlist_len) % SIM_SENSOR_PLAYLIST_SIZE] = entry;
+        ch->playlist_len++;
+    } else {
+        k_spin_unlock(&sim_lock, key);
+        LOG_ERR("Channel %d playlist full", channel);
+        return -ENOBUFS;
+    }
+
+    k_spin_unlock(&sim_lock, key);
+
+    LOG_INF("Channel %d pattern %d queued (args: %.1f, %.1f, %.1f, rate: %.3f Hz, repeats: %u)", channel, pattern, (double) arg1, (double) arg2,
+        (double) arg3, (double) data_rate, n_repeats);
+
+    return 0;
+}
+
+static uint64_t sim_sensor_compute_samples_elapsed(simulation_ctx_t* ctx, int64_t time) {
+    // The number of samples started since the current one (not counting itself)
+    uint64_t samples_started = rate_clock_periods_started(&ctx->clock, time);
+    LOG_DBG("Time elapsed: %d ticks (%d samples) ", (int) (time - ctx->clock.base), (int) samples_started);
+    return (samples_started > 0) ? samples_started - 1 : 0;
+}
+
+bool sim_sensor_is_running(uint8_t channel) { return channel < SIM_SENSOR_MAX_CHANNELS && channels[channel].pattern_fn != NULL; }
+
+bool sim_sensor_new_sample_ready(uint8_t channel) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS) {
+        return false;
     }
 
-    // Set the new simulation context
-    sim_ctx.last_sample_start_time = k_uptime_get();
-    sim_ctx.arg1                   = arg1;
-    sim_ctx.arg2                   = arg2;
-    sim_ctx.arg3                   = arg3;
+    sim_channel_t* ch = &channels[channel];
+    return ch->pattern_fn != NULL && (ch->ctx.samples_read == 0 || sim_sensor_compute_samples_elapsed(&ch->ctx, k_uptime_ticks()) > 0);
+}
+
+// Move the simulation context forward to the sample the sensor produced at a given time
+// (and return its index)
+static uint32_t sim_sensor_advance(simulation_ctx_t* ctx, int64_t time) {
+    uint64_t samples_elapsed = sim_sensor_compute_samples_elapsed(ctx, time);
+    rate_clock_advance(&ctx->clock, samples_elapsed);
+    ctx->sample_index += samples_elapsed;
+    ctx->samples_read++;
+    return ctx->sample_index;
+}
 
-    LOG_INF("Simulation with pattern %d started (args: %.1f, %.1f, %.1f", pattern, arg1, arg2, arg3);
+// Keep track of the samples duplicated/skipped by the reader
+static void sim_sensor_update_stats(sim_sensor_stats_t* stats, uint32_t samples_elapsed, bool first_read) {
+    if (first_read) {
+        stats->n_produced += samples_elapsed + 1;
+        stats->n_skipped += samples_elapsed;
+    } else if (samples_elapsed == 0) {
+        stats->n_duplicated++;
+    } else {
+        stats->n_produced += samples_elapsed;
+        stats->n_skipped += samples_elapsed - 1;
+    }
+    stats->n_read++;
 }
 
-static uint32_t sim_sensor_compute_samples_elapsed(simulation_ctx_t* ctx) {
-    int64_t delta_ms         = k_uptime_get() - ctx->last_sample_start_time;
-    uint32_t samples_elapsed = (delta_ms > 0) ? delta_ms / sample_period : 0;
-    LOG_DBG("Time elapsed: %d ms (%d samples) ", (int) delta_ms, samples_elapsed);
-    return samples_elapsed;
+// Add the stats of a set of reads to the simulation stats (with the lock held)
+static void sim_sensor_add_stats(const sim_sensor_stats_t* stats) {
+    sim_stats.n_produced += stats->n_produced;
+    sim_stats.n_read += stats->n_read;
+    sim_stats.n_duplicated += stats->n_duplicated;
+    sim_stats.n_skipped += stats->n_skipped;
 }
 
-bool sim_sensor_new_sample_ready(void) {
-    return pattern_fn != NULL && (sim_ctx.samples_read == 0 || k_uptime_get() - sim_ctx.last_sample_start_time >= sample_period);
+int sim_sensor_read_block_at(uint8_t channel, const rate_clock_t* read_clock, uint16_t n_reads, sample_block_t* block) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS || read_clock == NULL || block == NULL || block->n_samples > SAMPLE_BLOCK_MAX_SAMPLES) {
+        return -EINVAL;
+    }
+
+    sim_channel_t* ch  = &channels[channel];
+    uint16_t first     = block->n_samples;
+    uint16_t n_samples = 0;
+    uint16_t read      = 0;
+    bool ended         = false;
+
+    // Work out the index and capture time of each sample read (skipping the reads due before
+    // the pattern was started), and generate their values in one go. If the pattern ends, the
+    // reads left are done again on the next pattern (if any).
+    //
+    // The lock keeps the interrupts off, so it's only held to take a snapshot of the channel
+    // state, and then to commit the new state once the samples are generated. If the channel
+    // changed in the meantime (e.g. the pattern was restarted), the reads are done again.
+    n_reads = MIN(n_reads, SAMPLE_BLOCK_MAX_SAMPLES - first);
+    while (read < n_reads) {
+        k_spinlock_key_t key             = k_spin_lock(&sim_lock);
+        sim_sensor_pattern_fn pattern_fn = ch->pattern_fn;
+        simulation_ctx_t ctx             = ch->ctx;
+        uint32_t seq                     = ch->seq;
+        k_spin_unlock(&sim_lock, key);
+
+        // Check if there is a pattern ongoing
+        if (pattern_fn == NULL) {
+            break;
+        }
+
+        sim_sensor_stats_t stats = {0};
+        uint32_t last_index      = ctx.sample_index;
+        bool first_read          = (ctx.samples_read == 0);
+        uint16_t start           = first + n_samples;
+        uint16_t n_new           = 0;
+        uint16_t next_read       = read;
+        for (; next_read < n_reads; next_read++) {
+            int64_t time = rate_clock_period_start(read_clock, next_read);
+            if (time < ctx.clock.base) {
+                continue;
+            }
+            uint16_t j             = start + n_new++;
+            block->channel[j]      = channel;
+            block->index[j]        = sim_sensor_advance(&ctx, time);
+            block->timestamp_us[j] = (uint32_t) k_ticks_to_us_floor64(time);
+        }
+
+        // Generate the values of all the samples in one go (the pattern ends at the first invalid one)
+        size_t n_valid     = pattern_fn(&ctx, &block->index[start], &block->value[start], n_new);
+        uint32_t end_index = 0;
+        if (n_valid < n_new) {
+            uint32_t first_index = (n_valid > 0) ? block->index[start + n_valid - 1] + 1 : (first_read ? 0 : last_index + 1);
+            end_index            = sim_sensor_find_end(pattern_fn, &ctx, first_index, block->index[start + n_valid]);
+        }
+
+        // Carry the sample indexes on from the patterns played before
+        for (size_t i = 0; i < n_valid; i++) {
+            sim_sensor_update_stats(&stats, block->index[start + i] - last_index, first_read && i == 0);
+            last_index = block->index[start + i];
+            block->index[start + i] += ctx.index_offset;
+        }
+
+        key = k_spin_lock(&sim_lock);
+        if (ch->seq != seq) {
+            k_spin_unlock(&sim_lock, key);
+            continue;
+        }
+
+        ch->ctx = ctx;
+        ch->seq++;
+        sim_sensor_add_stats(&stats);
+        if (n_valid < n_new) {
+            sim_sensor_next_pattern(ch, end_index);
+            ended = (ch->pattern_fn == NULL);
+        }
+
+        k_spin_unlock(&sim_lock, key);
+
+        n_samples += n_valid;
+        read = next_read - (n_new - n_valid);
+    }
+    block->n_samples += n_samples;
+
+    LOG_DBG("[%d]: %d samples read", channel, (int) n_samples);
+    if (ended) {
+        LOG_INF("Channel %d simulation ended.", channel);
+    }
+
+    return n_samples;
 }
 
-float sim_sensor_read_sample(void) {
-    // Check if there is a pattern ongoing
-    if (pattern_fn == NULL) {
-        return NAN;
+int sim_sensor_read_sample_at(uint8_t channel, int64_t time, sample_t* sample) {
+    if (channel >= SIM_SENSOR_MAX_CHANNELS || sample == NULL) {
+        return -EINVAL;
     }
 
-    // Update the simulation context based on the time elapsed
-    uint32_t samples_elapsed = sim_sensor_compute_samples_elapsed(&sim_ctx);
-    sim_ctx.last_sample_start_time += samples_elapsed * sample_period;
-    sim_ctx.sample_index += samples_elapsed;
-    sim_ctx.samples_read++;
+    sim_channel_t* ch = &channels[channel];
+    bool ended        = false;
 
-    // Generate the next sample
-    float sample = pattern_fn(&sim_ctx);
-    LOG_INF("[%d]: %.1f", sim_ctx.sample_index, sample);
+    // Update a snapshot of the simulation context based on the time elapsed, and generate the
+    // sample without the lock (see sim_sensor_read_block_at). Then commit the new context, or
+    // move on to the next pattern if the current one ended (and try again).
+    while (true) {
+        k_spinlock_key_t key             = k_spin_lock(&sim_lock);
+        sim_sensor_pattern_fn pattern_fn = ch->pattern_fn;
+        simulation_ctx_t ctx             = ch->ctx;
+        uint32_t seq                     = ch->seq;
+        k_spin_unlock(&sim_lock, key);
 
-    // Stop the pattern if NaN was returned
-    if (isnan(sample)) {
-        pattern_fn = NULL;
-        LOG_INF("Simulation ended.");
+        // Check if there is a pattern ongoing (and if it had already started at the given time)
+        if (pattern_fn == NULL || time < ctx.clock.base) {
+            if (ended) {
+                LOG_INF("Channel %d simulation ended.", channel);
+            }
+            return -ENODATA;
+        }
+
+        bool first_read      = (ctx.samples_read == 0);
+        uint32_t last_index  = ctx.sample_index;
+        uint32_t index       = sim_sensor_advance(&ctx, time);
+        sample_value_t value = 0;
+        bool valid           = (pattern_fn(&ctx, &index, &value, 1) == 1);
+        uint32_t end_index   = valid ? 0 : sim_sensor_find_end(pattern_fn, &ctx, first_read ? 0 : last_index + 1, index);
+        LOG_DBG("[%d][%d]", channel, index);
+
+        key = k_spin_lock(&sim_lock);
+        if (ch->seq != seq) {
+            k_spin_unlock(&sim_lock, key);
+            continue;
+        }
+
+        if (!valid) {
+            sim_sensor_next_pattern(ch, end_index);
+            ended = (ch->pattern_fn == NULL);
+            k_spin_unlock(&sim_lock, key);
+            continue;
+        }
+
+        ch->ctx = ctx;
+        ch->seq++;
+        sim_sensor_update_stats(&sim_stats, index - last_index, first_read);
+
+        k_spin_unlock(&sim_lock, key);
+
+        sample->channel      = channel;
+        sample->index        = ctx.index_offset + index;
+        sample->timestamp_us = (uint32_t) k_ticks_to_us_floor64(time);
+        sample->value        = value;
+
+        return 0;
     }
+};
+
+int sim_sensor_read_sample(uint8_t channel, sample_t* sample) { return sim_sensor_read_sample_at(channel, k_uptime_ticks(), sample); }
 
-    return sample;
-};
\ No newline at end of file
+void sim_sensor_get_stats(sim_sensor_stats_t* stats) {
+    k_spinlock_key_t key = k_spin_lock(&sim_lock);
+    *stats               = sim_stats;
+    k_spin_unlock(&sim_lock, key);
+}
+
+void sim_sensor_reset_stats(void) {
+    k_spinlock_key_t key = k_spin_lock(&sim_lock);
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    k_spin_unlock(&sim_lock, key);
+}
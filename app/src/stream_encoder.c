@@ -0,0 +1,359 @@
+/**
+ * Created on Mon Dec 09 2024
+ *
+ * @brief Provides methods to encode sensor samples before they are sent over USB.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include "stream_encoder.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(stream_encoder, LOG_LEVEL_INF);
+
+/* Constants */
+#define FRAME_HEADER_SIZE 4   // type + seq + n_samples (or message length)
+#define FRAME_CRC_SIZE    2
+#define FRAME_SIZE(n_samples) (FRAME_HEADER_SIZE + (n_samples) * STREAM_FRAME_SAMPLE_SIZE + FRAME_CRC_SIZE)
+#define FRAME_MAX_SIZE        FRAME_SIZE(STREAM_FRAME_MAX_SAMPLES)
+#define CRC_SEED              0xFFFF
+#define TEXT_VALUE_MAX_SIZE   24   // bytes per value printed
+
+#define COMPRESSED_FRAME_SIZE(n_samples) (FRAME_HEADER_SIZE + SAMPLE_CODEC_MAX_SIZE(n_samples) + FRAME_CRC_SIZE)
+#define COMPRESSED_FRAME_MAX_SIZE        COMPRESSED_FRAME_SIZE(STREAM_FRAME_MAX_SAMPLES)
+
+#define SUMMARY_FRAME_SIZE(n_summaries) (FRAME_HEADER_SIZE + (n_summaries) * STREAM_FRAME_SUMMARY_SIZE + FRAME_CRC_SIZE)
+#define SUMMARY_FRAME_MAX_SIZE          SUMMARY_FRAME_SIZE(STREAM_FRAME_MAX_SUMMARIES)
+
+// COBS adds 1 byte per (up to) 254 bytes, and the frame is followed by a delimiter
+#define COBS_MAX_SIZE(n_bytes)                       ((n_bytes) + (n_bytes) / 254 + 1)
+#define FRAME_ENCODED_MAX_SIZE(n_samples)            (COBS_MAX_SIZE(FRAME_SIZE(n_samples)) + 1)
+#define COMPRESSED_FRAME_ENCODED_MAX_SIZE(n_samples) (COBS_MAX_SIZE(COMPRESSED_FRAME_SIZE(n_samples)) + 1)
+#define SUMMARY_FRAME_ENCODED_MAX_SIZE(n_summaries)  (COBS_MAX_SIZE(SUMMARY_FRAME_SIZE(n_summaries)) + 1)
+
+BUILD_ASSERT(STREAM_FRAME_MAX_SAMPLES <= UINT8_MAX, "The number of samples must fit in the frame header");
+BUILD_ASSERT(FRAME_ENCODED_MAX_SIZE(1) <= STREAM_ENCODER_MAX_SIZE(1), "Binary frames must fit the encoder max size");
+BUILD_ASSERT(FRAME_ENCODED_MAX_SIZE(STREAM_FRAME_MAX_SAMPLES) <= STREAM_ENCODER_MAX_SIZE(STREAM_FRAME_MAX_SAMPLES),
+    "Binary frames must fit the encoder max size");
+BUILD_ASSERT(SAMPLE_CODEC_HEADER_MAX_SIZE(1) + sizeof(sample_value_t) <= STREAM_FRAME_SAMPLE_SIZE, "Binary samples must fit the sample size");
+BUILD_ASSERT(COMPRESSED_FRAME_ENCODED_MAX_SIZE(1) <= STREAM_ENCODER_MAX_SIZE(1), "Compressed frames must fit the encoder max size");
+BUILD_ASSERT(COMPRESSED_FRAME_ENCODED_MAX_SIZE(STREAM_FRAME_MAX_SAMPLES) <= STREAM_ENCODER_MAX_SIZE(STREAM_FRAME_MAX_SAMPLES),
+    "Compressed frames must fit the encoder max size");
+BUILD_ASSERT(STREAM_FRAME_MAX_SUMMARIES <= UINT8_MAX, "The number of summaries must fit in the frame header");
+BUILD_ASSERT(SUMMARY_FRAME_ENCODED_MAX_SIZE(1) <= STREAM_ENCODER_SUMMARIES_MAX_SIZE(1), "Summary frames must fit the encoder max size");
+BUILD_ASSERT(SUMMARY_FRAME_ENCODED_MAX_SIZE(STREAM_FRAME_MAX_SUMMARIES) <= STREAM_ENCODER_SUMMARIES_MAX_SIZE(STREAM_FRAME_MAX_SUMMARIES),
+    "Summary frames must fit the encoder max size");
+BUILD_ASSERT(STREAM_MESSAGE_MAX_SIZE <= UINT8_MAX, "The message length must fit in the frame header");
+BUILD_ASSERT(COBS_MAX_SIZE(FRAME_HEADER_SIZE + STREAM_MESSAGE_MAX_SIZE + FRAME_CRC_SIZE) + 1 <= STREAM_ENCODER_MESSAGE_MAX_SIZE,
+    "Message frames must fit the encoder max message size");
+
+static const char* const stream_mode_names[] = {
+    [STREAM_MODE_TEXT]       = "text",
+    [STREAM_MODE_BINARY]     = "binary",
+    [STREAM_MODE_COMPRESSED] = "compressed",
+};
+
+/* Static variables */
+static stream_mode_t stream_mode = STREAM_MODE_TEXT;
+static uint16_t frame_seq        = 0;
+
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+static const uint32_t decimal_scales[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+BUILD_ASSERT(STREAM_TEXT_MAX_DECIMALS < ARRAY_SIZE(decimal_scales), "Missing decimal scales");
+#endif
+
+int stream_encoder_set_mode(stream_mode_t mode) {
+    if (mode < 0 || mode >= STREAM_MODE_MAX_VALUE) {
+        LOG_ERR("Invalid stream mode: %d", mode);
+        return -EINVAL;
+    }
+
+    stream_mode = mode;
+    frame_seq   = 0;
+
+    LOG_INF("Stream mode set to %s", stream_mode_names[mode]);
+
+    return 0;
+}
+
+void stream_encoder_describe(char* message, size_t message_len) {
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+    snprintf(message, message_len, "stream mode=%d value=i%uq%u", stream_mode, (unsigned) (8 * sizeof(sample_value_t)), SAMPLE_VALUE_FRAC_BITS);
+#else
+    snprintf(message, message_len, "stream mode=%d value=f32", stream_mode);
+#endif
+}
+
+// Print a sample value into 'dst' (TEXT_VALUE_MAX_SIZE bytes) and return it. Floats are printed
+// with 'float_decimals' decimals, and fixed-point values with all their decimals (using integer
+// math only, so no float printf support is needed).
+static const char* stream_encoder_print_value(sample_value_t value, int float_decimals, char* dst) {
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES)
+    const int n_decimals = MIN(SAMPLE_VALUE_FRAC_BITS, STREAM_TEXT_MAX_DECIMALS);
+    uint32_t magnitude   = (value < 0) ? (uint32_t) -(int64_t) value : (uint32_t) value;
+    uint32_t integer     = magnitude >> SAMPLE_VALUE_FRAC_BITS;
+    uint64_t fraction    = magnitude & ((1ULL << SAMPLE_VALUE_FRAC_BITS) - 1);
+    uint32_t decimals    = (fraction * decimal_scales[n_decimals]) >> SAMPLE_VALUE_FRAC_BITS;
+
+    if (n_decimals == 0) {
+        snprintf(dst, TEXT_VALUE_MAX_SIZE, "%s%u", (value < 0) ? "-" : "", integer);
+    } else {
+        snprintf(dst, TEXT_VALUE_MAX_SIZE, "%s%u.%0*u", (value < 0) ? "-" : "", integer, n_decimals, decimals);
+    }
+#else
+    snprintf(dst, TEXT_VALUE_MAX_SIZE, "%.*f", float_decimals, (double) value);
+#endif
+    return dst;
+}
+
+// COBS encode 'n_bytes' from 'src' into 'dst' (which must fit COBS_MAX_SIZE bytes).
+// Returns the number of bytes written to 'dst'.
+static size_t stream_encoder_cobs(const uint8_t* src, size_t n_bytes, uint8_t* dst) {
+    size_t code_idx = 0;   // Where the length code of the current block goes
+    size_t dst_idx  = 1;
+    uint8_t code    = 1;
+
+    for (size_t i = 0; i < n_bytes; i++) {
+        if (src[i] != 0) {
+            dst[dst_idx++] = src[i];
+            code++;
+        }
+
+        // Close the block on a zero byte, or once it reaches the max block length
+        if (src[i] == 0 || code == 0xFF) {
+            dst[code_idx] = code;
+            code_idx      = dst_idx++;
+            code          = 1;
+        }
+    }
+
+    dst[code_idx] = code;
+
+    return dst_idx;
+}
+
+static int stream_encoder_encode_text(const sample_block_t* block, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    char value[TEXT_VALUE_MAX_SIZE] = {0};
+
+    for (size_t i = 0; i < block->n_samples; i++) {
+        if (buffer_len - *n_bytes < STREAM_TEXT_SAMPLE_MAX_SIZE) {
+            return -ENOBUFS;
+        }
+
+        int len = snprintf((char*) &buffer[*n_bytes], STREAM_TEXT_SAMPLE_MAX_SIZE, "%u %u %u %s\n", block->channel[i], block->index[i],
+            block->timestamp_us[i], stream_encoder_print_value(block->value[i], 1, value));
+        *n_bytes += MIN(len, STREAM_TEXT_SAMPLE_MAX_SIZE - 1);
+    }
+
+    return 0;
+}
+
+// Write the frame header (type, seq and count) and return its size
+static size_t stream_encoder_put_header(uint8_t* frame, stream_frame_type_t type, uint8_t count) {
+    frame[0] = type;
+    sys_put_le16(frame_seq++, &frame[1]);
+    frame[3] = count;
+    return FRAME_HEADER_SIZE;
+}
+
+// Append the CRC to a frame, COBS encode it into 'dst' and add the delimiter.
+// Returns the number of bytes written to 'dst'.
+static size_t stream_encoder_put_frame(uint8_t* frame, size_t frame_len, uint8_t* dst) {
+    sys_put_le16(crc16_itu_t(CRC_SEED, frame, frame_len), &frame[frame_len]);
+    frame_len += FRAME_CRC_SIZE;
+
+    size_t n_bytes = stream_encoder_cobs(frame, frame_len, dst);
+    dst[n_bytes++] = 0x00;
+
+    return n_bytes;
+}
+
+// Copy a column of 32-bit fields (integers or floats) into a frame, in little-endian.
+// Returns the number of bytes written.
+static size_t stream_encoder_put_column(uint8_t* dst, const void* src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t raw = 0;
+        memcpy(&raw, (const uint8_t*) src + i * sizeof(raw), sizeof(raw));
+        sys_put_le32(raw, &dst[i * sizeof(raw)]);
+    }
+    return n * sizeof(uint32_t);
+}
+
+// Copy a column of sample values into a frame, in little-endian. Returns the number of bytes written.
+static size_t stream_encoder_put_values(uint8_t* dst, const sample_value_t* src, size_t n) {
+#if defined(CONFIG_APP_FIXED_POINT_SAMPLES) && !defined(CONFIG_APP_SAMPLE_VALUE_INT32)
+    for (size_t i = 0; i < n; i++) {
+        sys_put_le16(src[i], &dst[i * sizeof(sample_value_t)]);
+    }
+    return n * sizeof(sample_value_t);
+#else
+    return stream_encoder_put_column(dst, src, n);
+#endif
+}
+
+static int stream_encoder_encode_binary(const sample_block_t* block, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    static uint8_t frame[FRAME_MAX_SIZE] = {0};
+
+    for (size_t i = 0; i < block->n_samples; i += STREAM_FRAME_MAX_SAMPLES) {
+        uint8_t n_frame_samples = MIN(block->n_samples - i, STREAM_FRAME_MAX_SAMPLES);
+
+        if (buffer_len - *n_bytes < FRAME_ENCODED_MAX_SIZE(n_frame_samples)) {
+            return -ENOBUFS;
+        }
+
+        // Build the frame header
+        size_t frame_len = stream_encoder_put_header(frame, STREAM_FRAME_SAMPLES, n_frame_samples);
+
+        // Pack the channels, indexes and timestamps, and copy the values right after them
+        int ret = sample_codec_pack_header(block, i, n_frame_samples, &frame[frame_len], sizeof(frame) - frame_len - FRAME_CRC_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+        frame_len += ret;
+        frame_len += stream_encoder_put_values(&frame[frame_len], &block->value[i], n_frame_samples);
+
+        // Append the CRC, encode the frame and add the delimiter
+        *n_bytes += stream_encoder_put_frame(frame, frame_len, &buffer[*n_bytes]);
+    }
+
+    return 0;
+}
+
+static int stream_encoder_encode_compressed(const sample_block_t* block, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    static uint8_t frame[COMPRESSED_FRAME_MAX_SIZE] = {0};
+
+    for (size_t i = 0; i < block->n_samples; i += STREAM_FRAME_MAX_SAMPLES) {
+        uint8_t n_frame_samples = MIN(block->n_samples - i, STREAM_FRAME_MAX_SAMPLES);
+
+        if (buffer_len - *n_bytes < COMPRESSED_FRAME_ENCODED_MAX_SIZE(n_frame_samples)) {
+            return -ENOBUFS;
+        }
+
+        // Build the frame header, and compress the samples right after it
+        size_t frame_len = stream_encoder_put_header(frame, STREAM_FRAME_COMPRESSED_SAMPLES, n_frame_samples);
+        int ret          = sample_codec_compress(block, i, n_frame_samples, &frame[frame_len], sizeof(frame) - frame_len - FRAME_CRC_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+        frame_len += ret;
+
+        // Append the CRC, encode the frame and add the delimiter
+        *n_bytes += stream_encoder_put_frame(frame, frame_len, &buffer[*n_bytes]);
+    }
+
+    return 0;
+}
+
+int stream_encoder_encode(const sample_block_t* block, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    if (block == NULL || buffer == NULL || n_bytes == NULL) {
+        return -EINVAL;
+    }
+
+    *n_bytes = 0;
+
+    switch (stream_mode) {
+        case STREAM_MODE_TEXT: return stream_encoder_encode_text(block, buffer, buffer_len, n_bytes);
+        case STREAM_MODE_BINARY: return stream_encoder_encode_binary(block, buffer, buffer_len, n_bytes);
+        case STREAM_MODE_COMPRESSED: return stream_encoder_encode_compressed(block, buffer, buffer_len, n_bytes);
+        default: return -EINVAL;
+    }
+}
+
+int stream_encoder_encode_message(const char* message, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    static uint8_t frame[FRAME_HEADER_SIZE + STREAM_MESSAGE_MAX_SIZE + FRAME_CRC_SIZE] = {0};
+
+    if (message == NULL || buffer == NULL || n_bytes == NULL) {
+        return -EINVAL;
+    }
+
+    if (buffer_len < STREAM_ENCODER_MESSAGE_MAX_SIZE) {
+        return -ENOBUFS;
+    }
+
+    size_t len = strnlen(message, STREAM_MESSAGE_MAX_SIZE);
+
+    switch (stream_mode) {
+        case STREAM_MODE_TEXT:
+            *n_bytes = snprintf((char*) buffer, buffer_len, "# %.*s\n", (int) len, message);
+            return 0;
+        case STREAM_MODE_BINARY:
+        case STREAM_MODE_COMPRESSED: {
+            size_t frame_len = stream_encoder_put_header(frame, STREAM_FRAME_MESSAGE, len);
+            memcpy(&frame[frame_len], message, len);
+            *n_bytes = stream_encoder_put_frame(frame, frame_len + len, buffer);
+            return 0;
+        }
+        default: return -EINVAL;
+    }
+}
+
+static int stream_encoder_encode_summaries_text(const summary_block_t* summaries, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    char values[4][TEXT_VALUE_MAX_SIZE] = {0};
+
+    for (size_t i = 0; i < summaries->n_summaries; i++) {
+        if (buffer_len - *n_bytes < STREAM_TEXT_SUMMARY_MAX_SIZE) {
+            return -ENOBUFS;
+        }
+
+        int len = snprintf((char*) &buffer[*n_bytes], STREAM_TEXT_SUMMARY_MAX_SIZE, "S %u %u %u %u %s %s %s %s\n", summaries->channel[i],
+            summaries->index[i], summaries->timestamp_us[i], summaries->n_samples[i], stream_encoder_print_value(summaries->min[i], 3, values[0]),
+            stream_encoder_print_value(summaries->max[i], 3, values[1]), stream_encoder_print_value(summaries->mean[i], 3, values[2]),
+            stream_encoder_print_value(summaries->rms[i], 3, values[3]));
+        *n_bytes += MIN(len, STREAM_TEXT_SUMMARY_MAX_SIZE - 1);
+    }
+
+    return 0;
+}
+
+static int stream_encoder_encode_summaries_binary(const summary_block_t* summaries, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    static uint8_t frame[SUMMARY_FRAME_MAX_SIZE] = {0};
+
+    for (size_t i = 0; i < summaries->n_summaries; i += STREAM_FRAME_MAX_SUMMARIES) {
+        uint8_t n = MIN(summaries->n_summaries - i, STREAM_FRAME_MAX_SUMMARIES);
+
+        if (buffer_len - *n_bytes < SUMMARY_FRAME_ENCODED_MAX_SIZE(n)) {
+            return -ENOBUFS;
+        }
+
+        // Build the frame header, and copy the summaries one field (column) at a time
+        size_t frame_len = stream_encoder_put_header(frame, STREAM_FRAME_SUMMARIES, n);
+        memcpy(&frame[frame_len], &summaries->channel[i], n);
+        frame_len += n;
+        frame_len += stream_encoder_put_column(&frame[frame_len], &summaries->index[i], n);
+        frame_len += stream_encoder_put_column(&frame[frame_len], &summaries->timestamp_us[i], n);
+        frame_len += stream_encoder_put_column(&frame[frame_len], &summaries->n_samples[i], n);
+        frame_len += stream_encoder_put_values(&frame[frame_len], &summaries->min[i], n);
+        frame_len += stream_encoder_put_values(&frame[frame_len], &summaries->max[i], n);
+        frame_len += stream_encoder_put_values(&frame[frame_len], &summaries->mean[i], n);
+        frame_len += stream_encoder_put_values(&frame[frame_len], &summaries->rms[i], n);
+
+        // Append the CRC, encode the frame and add the delimiter
+        *n_bytes += stream_encoder_put_frame(frame, frame_len, &buffer[*n_bytes]);
+    }
+
+    return 0;
+}
+
+int stream_encoder_encode_summaries(const summary_block_t* summaries, uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
+    if (summaries == NULL || buffer == NULL || n_bytes == NULL) {
+        return -EINVAL;
+    }
+
+    *n_bytes = 0;
+
+    switch (stream_mode) {
+        case STREAM_MODE_TEXT: return stream_encoder_encode_summaries_text(summaries, buffer, buffer_len, n_bytes);
+        case STREAM_MODE_BINARY:
+        case STREAM_MODE_COMPRESSED: return stream_encoder_encode_summaries_binary(summaries, buffer, buffer_len, n_bytes);
+        default: return -EINVAL;
+    }
+}
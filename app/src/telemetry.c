@@ -0,0 +1,401 @@
+/**
+ * Created on Wed Dec 18 2024
+ *
+ * @brief Provides methods to collect and report the pipeline telemetry.
+ *
+ * @author Daniel Figueira <daniel.castro.figueira@gmail.com>
+ */
+#include "telemetry.h"
+
+#include "block_pool.h"
+#include "sample_codec.h"
+#include "sensor_thread.h"
+#include "stream_encoder.h"
+
+#if defined(CONFIG_ARCH_POSIX)
+#include "host_clock.h"
+#endif
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include <errno.h>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(telemetry, LOG_LEVEL_INF);
+
+/* Constants */
+#define BENCHMARK_DEFAULT_SAMPLES 100000
+#define BENCHMARK_DEFAULT_ITEMS   100000
+#define BENCHMARK_PERIOD_US       10000   // Sample period used to timestamp the compressed samples (100Hz)
+#define BENCHMARK_RING_SIZE       64      // Items (kept small, as its RAM is taken for good, about 2KB with the batch)
+#define STRESS_STACK_SIZE         1000
+#define STRESS_PRIO               5       // Same as the sensor and data threads
+#define STRESS_PRODUCER_CPU       0       // Only used on SMP builds (same cores as the sensor and data threads)
+#define STRESS_CONSUMER_CPU       1
+#define STRESS_YIELD_ITEMS        100     // Items added between yields (more than the ring holds, so it overflows on a single core too)
+
+// Max number of samples queued between the sensor and data threads
+#if defined(CONFIG_APP_BLOCK_POOL)
+#define TELEMETRY_QUEUE_SIZE BLOCK_POOL_CAPACITY
+#else
+#define TELEMETRY_QUEUE_SIZE SAMPLE_RING_SIZE
+#endif
+
+/* Type definitions */
+typedef enum {
+    BENCHMARK_RING_ADD,
+    BENCHMARK_RING_GET,
+    BENCHMARK_RING_GET_BATCH,
+    BENCHMARK_RING_OPERATIONS,
+} benchmark_ring_operation_t;
+
+// A ring buffer only used by the benchmark (generated from the same code as the sample ring)
+RING_BUFFER_DECLARE(benchmark_ring, sample_t, BENCHMARK_RING_SIZE);
+RING_BUFFER_DEFINE(benchmark_ring, sample_t)
+
+// Shared by the producer and consumer threads of the ring buffer stress test
+typedef struct {
+    benchmark_ring_t ring;
+    uint32_t n_items;
+    atomic_t producer_done;
+    uint32_t n_received;
+    uint32_t n_torn;        // Items whose fields don't all come from the same item
+    uint32_t n_reordered;   // Items received out of order (or twice)
+} stress_ctx_t;
+
+/* Static variables */
+static sample_ring_t* telemetry_ring_buffer = NULL;
+
+K_THREAD_STACK_DEFINE(stress_producer_stack, STRESS_STACK_SIZE);
+K_THREAD_STACK_DEFINE(stress_consumer_stack, STRESS_STACK_SIZE);
+static struct k_thread stress_producer;
+static struct k_thread stress_consumer;
+
+void telemetry_init(sample_ring_t* ring_buffer) { telemetry_ring_buffer = ring_buffer; }
+
+void telemetry_get(telemetry_t* telemetry) {
+    memset(telemetry, 0, sizeof(telemetry_t));
+
+    sim_sensor_get_stats(&telemetry->sensor);
+#if defined(CONFIG_APP_BLOCK_POOL)
+    block_pool_get_stats(&telemetry->ring_buffer);
+#else
+    if (telemetry_ring_buffer != NULL) {
+        sample_ring_get_stats(telemetry_ring_buffer, &telemetry->ring_buffer);
+    }
+#endif
+    data_thread_get_stats(&telemetry->data);
+    usb_comm_get_stats(&telemetry->usb);
+    sensor_thread_get_timer_stats(&telemetry->read_timer);
+    data_thread_get_timer_stats(&telemetry->send_timer);
+}
+
+void telemetry_reset(void) {
+    sim_sensor_reset_stats();
+#if defined(CONFIG_APP_BLOCK_POOL)
+    block_pool_reset_stats();
+#else
+    if (telemetry_ring_buffer != NULL) {
+        sample_ring_reset_stats(telemetry_ring_buffer);
+    }
+#endif
+    data_thread_reset_stats();
+    usb_comm_reset_stats();
+    sensor_thread_reset_timer_stats();
+
+    LOG_INF("Telemetry reset.");
+}
+
+static int telemetry_send_timer_stats(const char* name, rate_timer_stats_t* stats) {
+    char message[STREAM_MESSAGE_MAX_SIZE + 1] = {0};
+
+    int len = snprintf(message, sizeof(message), "telemetry %s periods=%u wakeups=%u overruns=%u jitter_avg_us=%u jitter_max_us=%u jitter_hist=",
+        name, stats->n_periods, stats->n_wakeups, stats->n_overruns, stats->jitter_avg_us, stats->jitter_max_us);
+
+    // Append the jitter histogram as a comma-separated list of counts (one per log2 bucket)
+    for (int i = 0; i < RATE_TIMER_JITTER_BUCKETS && len < sizeof(message); i++) {
+        len += snprintf(&message[len], sizeof(message) - len, (i == 0) ? "%u" : ",%u", stats->jitter_hist[i]);
+    }
+
+    return data_thread_send_message(message);
+}
+
+int telemetry_send(void) {
+    char message[STREAM_MESSAGE_MAX_SIZE + 1] = {0};
+    telemetry_t telemetry                     = {0};
+
+    telemetry_get(&telemetry);
+
+    snprintf(message, sizeof(message), "telemetry sensor produced=%u read=%u duplicated=%u skipped=%u", telemetry.sensor.n_produced,
+        telemetry.sensor.n_read, telemetry.sensor.n_duplicated, telemetry.sensor.n_skipped);
+    int ret = data_thread_send_message(message);
+    if (ret != 0) {
+        return ret;
+    }
+
+    snprintf(message, sizeof(message), "telemetry ring_buffer overwrites=%u dropped=%u waits=%u high_watermarks=%u peak=%u size=%u",
+        telemetry.ring_buffer.n_overwrites, telemetry.ring_buffer.n_dropped, telemetry.ring_buffer.n_waits, telemetry.ring_buffer.n_high_watermarks,
+        telemetry.ring_buffer.peak_count, TELEMETRY_QUEUE_SIZE);
+    ret = data_thread_send_message(message);
+    if (ret != 0) {
+        return ret;
+    }
+
+    snprintf(message, sizeof(message), "telemetry data samples=%u summaries=%u bytes=%u bursts=%u wakeups=%u usb_bytes=%u stall_us=%u timeouts=%u",
+        telemetry.data.n_samples_sent, telemetry.data.n_summaries_sent, telemetry.data.n_bytes_sent, telemetry.data.n_bursts,
+        telemetry.data.n_wakeups, telemetry.usb.n_bytes_written, telemetry.usb.stall_time_us, telemetry.usb.n_timeouts);
+    ret = data_thread_send_message(message);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = telemetry_send_timer_stats("read_timer", &telemetry.read_timer);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return telemetry_send_timer_stats("send_timer", &telemetry.send_timer);
+}
+
+static uint64_t telemetry_time_ns(void) {
+#if defined(CONFIG_ARCH_POSIX)
+    // On native_sim code runs in zero simulated time, so use the host clock instead
+    return host_clock_get_ns();
+#else
+    return k_ticks_to_ns_floor64(k_uptime_ticks());
+#endif
+}
+
+// Compress the samples of a pattern in full blocks (as the compressed stream mode would),
+// and return the average number of bits per sample (x100)
+static uint32_t telemetry_benchmark_compression(int pattern, const float* args, uint32_t n_samples) {
+    static sample_block_t block                                                = {0};
+    static uint8_t compressed[SAMPLE_CODEC_MAX_SIZE(SAMPLE_BLOCK_MAX_SAMPLES)] = {0};
+    uint64_t n_bits                                                            = 0;
+    uint32_t n_compressed                                                      = 0;
+
+    for (uint32_t first = 0; first < n_samples; first += SAMPLE_BLOCK_MAX_SAMPLES) {
+        uint32_t n = MIN(SAMPLE_BLOCK_MAX_SAMPLES, n_samples - first);
+        for (uint32_t i = 0; i < n; i++) {
+            block.channel[i]      = 0;
+            block.index[i]        = first + i;
+            block.timestamp_us[i] = (first + i) * BENCHMARK_PERIOD_US;
+        }
+        block.n_samples = sim_sensor_generate_block(pattern, args[0], args[1], args[2], block.index, block.value, n);
+
+        int ret = sample_codec_compress(&block, 0, block.n_samples, compressed, sizeof(compressed));
+        if (ret < 0) {
+            LOG_ERR("Failed to compress samples (err: %d - %s)", ret, strerror(-ret));
+            return 0;
+        }
+        n_bits += ret * 8;
+        n_compressed += block.n_samples;
+    }
+
+    return (n_compressed > 0) ? (uint32_t) (n_bits * 100 / n_compressed) : 0;
+}
+
+int telemetry_benchmark_patterns(uint32_t n_samples) {
+    static uint32_t index[SAMPLE_BLOCK_MAX_SAMPLES]        = {0};
+    static sample_value_t values[SAMPLE_BLOCK_MAX_SAMPLES] = {0};
+    char message[STREAM_MESSAGE_MAX_SIZE + 1]              = {0};
+
+    // Pattern arguments that keep each pattern going for the whole benchmark
+    static const float pattern_args[][3] = {
+        [PATTERN_CONST]      = {10, 1e9f, 0},
+        [PATTERN_INCREASING] = {0, 0.5f, FLT_MAX},
+        [PATTERN_DECREASING] = {0, 0.5f, -FLT_MAX},
+        [PATTERN_RANDOM]     = {10, 20, 1e9f},
+        [PATTERN_SINE]       = {100, 37.5f, 1e9f},
+        [PATTERN_SQUARE]     = {100, 37.5f, 1e9f},
+        [PATTERN_TRIANGLE]   = {100, 37.5f, 1e9f},
+        [PATTERN_SAWTOOTH]   = {100, 37.5f, 1e9f},
+        [PATTERN_CHIRP]      = {100, 4, 1e9f},
+        [PATTERN_NOISE]      = {10, 5, 1e9f},
+    };
+
+    n_samples = (n_samples > 0) ? n_samples : BENCHMARK_DEFAULT_SAMPLES;
+
+    for (int pattern = 0; pattern < ARRAY_SIZE(pattern_args); pattern++) {
+        const float* args    = pattern_args[pattern];
+        uint32_t n_generated = 0;
+        uint64_t start       = telemetry_time_ns();
+
+        // Generate consecutive samples, one block at a time
+        for (uint32_t first = 0; first < n_samples; first += SAMPLE_BLOCK_MAX_SAMPLES) {
+            uint32_t n = MIN(SAMPLE_BLOCK_MAX_SAMPLES, n_samples - first);
+            for (uint32_t i = 0; i < n; i++) {
+                index[i] = first + i;
+            }
+            n_generated += sim_sensor_generate_block(pattern, args[0], args[1], args[2], index, values, n);
+        }
+
+        uint64_t elapsed_ns    = MAX(telemetry_time_ns() - start, 1);
+        uint32_t ns_per_sample = (n_generated > 0) ? (uint32_t) (elapsed_ns * 100 / n_generated) : 0;   // (in 1/100 ns)
+
+        // Then measure how well they compress (out of the timed loop)
+        uint32_t bits_per_sample = telemetry_benchmark_compression(pattern, args, n_samples);
+
+        snprintf(message, sizeof(message),
+            "benchmark pattern=%d samples=%u time_us=%u samples_per_sec=%u ns_per_sample=%u.%02u bits_per_sample=%u.%02u", pattern, n_generated,
+            (uint32_t) (elapsed_ns / 1000), (uint32_t) ((uint64_t) n_generated * 1000000000 / elapsed_ns), ns_per_sample / 100, ns_per_sample % 100,
+            bits_per_sample / 100, bits_per_sample % 100);
+        int ret = data_thread_send_message(message);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int telemetry_benchmark_ring_buffer(uint32_t n_items) {
+    static benchmark_ring_t ring                   = {0};
+    static sample_t batch[BENCHMARK_RING_SIZE]     = {0};
+    char message[STREAM_MESSAGE_MAX_SIZE + 1]      = {0};
+    uint64_t elapsed_ns[BENCHMARK_RING_OPERATIONS] = {0};
+    uint32_t n_errors                              = 0;
+
+    n_items = (n_items > 0) ? n_items : BENCHMARK_DEFAULT_ITEMS;
+    benchmark_ring_init(&ring);
+
+    // Fill the ring and empty it one item at a time, then fill it again and empty it in
+    // a single batch (checking that every item comes out in order)
+    for (uint32_t first = 0; first < n_items; first += BENCHMARK_RING_SIZE) {
+        uint32_t n      = MIN(BENCHMARK_RING_SIZE, n_items - first);
+        uint32_t n_read = 0;
+        sample_t item   = {0};
+
+        uint64_t start = telemetry_time_ns();
+        for (uint32_t i = 0; i < n; i++) {
+            item.index = first + i;
+            benchmark_ring_add(&ring, &item);
+        }
+        elapsed_ns[BENCHMARK_RING_ADD] += telemetry_time_ns() - start;
+
+        start = telemetry_time_ns();
+        for (uint32_t i = 0; i < n; i++) {
+            n_errors += (benchmark_ring_get(&ring, &item) != 0 || item.index != first + i);
+        }
+        elapsed_ns[BENCHMARK_RING_GET] += telemetry_time_ns() - start;
+
+        for (uint32_t i = 0; i < n; i++) {
+            item.index = first + i;
+            benchmark_ring_add(&ring, &item);
+        }
+
+        start = telemetry_time_ns();
+        int ret = benchmark_ring_get_batch(&ring, batch, n, &n_read);
+        elapsed_ns[BENCHMARK_RING_GET_BATCH] += telemetry_time_ns() - start;
+        n_errors += (ret != 0 || n_read != n || batch[0].index != first || batch[n - 1].index != first + n - 1);
+    }
+
+    if (n_errors > 0) {
+        LOG_ERR("Ring buffer benchmark failed (%u items lost or out of order)", n_errors);
+        return -EIO;
+    }
+
+    // Report the average time per item, in ns (x100)
+    uint32_t ns_per_item[BENCHMARK_RING_OPERATIONS] = {0};
+    for (int i = 0; i < BENCHMARK_RING_OPERATIONS; i++) {
+        ns_per_item[i] = (uint32_t) (elapsed_ns[i] * 100 / n_items);
+    }
+
+    snprintf(message, sizeof(message), "benchmark ring_buffer items=%u size=%u add_ns=%u.%02u get_ns=%u.%02u get_batch_ns=%u.%02u", n_items,
+        BENCHMARK_RING_SIZE, ns_per_item[BENCHMARK_RING_ADD] / 100, ns_per_item[BENCHMARK_RING_ADD] % 100, ns_per_item[BENCHMARK_RING_GET] / 100,
+        ns_per_item[BENCHMARK_RING_GET] % 100, ns_per_item[BENCHMARK_RING_GET_BATCH] / 100, ns_per_item[BENCHMARK_RING_GET_BATCH] % 100);
+
+    return data_thread_send_message(message);
+}
+
+// Stamp every field of a stress test item with its counter, so a torn copy (mixing the fields
+// of two items) shows up
+static void telemetry_stress_item(uint32_t counter, sample_t* item) {
+    item->index        = counter;
+    item->timestamp_us = ~counter;
+    item->value        = (sample_value_t) (counter & INT16_MAX);
+    item->channel      = (uint8_t) counter;
+}
+
+static void telemetry_stress_produce(stress_ctx_t* ctx) {
+    sample_t item = {0};
+
+    for (uint32_t i = 0; i < ctx->n_items; i++) {
+        telemetry_stress_item(i, &item);
+        benchmark_ring_add(&ctx->ring, &item);
+        if (i % STRESS_YIELD_ITEMS == 0) {
+            k_yield();
+        }
+    }
+
+    atomic_set(&ctx->producer_done, 1);
+}
+
+static void telemetry_stress_consume(stress_ctx_t* ctx) {
+    sample_t item     = {0};
+    sample_t expected = {0};
+    uint32_t last     = 0;
+
+    while (true) {
+        // Check if the producer is done before trying to get an item, so no item is left behind
+        bool done = atomic_get(&ctx->producer_done);
+        if (benchmark_ring_get(&ctx->ring, &item) != 0) {
+            if (done) {
+                break;
+            }
+            k_yield();
+            continue;
+        }
+
+        telemetry_stress_item(item.index, &expected);
+        ctx->n_torn += (item.timestamp_us != expected.timestamp_us || item.value != expected.value || item.channel != expected.channel);
+        ctx->n_reordered += (ctx->n_received > 0 && item.index <= last);
+        ctx->n_received++;
+        last = item.index;
+    }
+}
+
+int telemetry_stress_ring_buffer(uint32_t n_items) {
+    static stress_ctx_t ctx                   = {0};
+    char message[STREAM_MESSAGE_MAX_SIZE + 1] = {0};
+    ring_buffer_stats_t stats                 = {0};
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.n_items = (n_items > 0) ? n_items : BENCHMARK_DEFAULT_ITEMS;
+    benchmark_ring_init(&ctx.ring);   // Drops the oldest items, so the producer also overwrites items being read
+
+    k_tid_t producer = k_thread_create(&stress_producer, stress_producer_stack, STRESS_STACK_SIZE, (k_thread_entry_t) telemetry_stress_produce,
+        &ctx, NULL, NULL, STRESS_PRIO, 0, K_FOREVER);
+    k_tid_t consumer = k_thread_create(&stress_consumer, stress_consumer_stack, STRESS_STACK_SIZE, (k_thread_entry_t) telemetry_stress_consume,
+        &ctx, NULL, NULL, STRESS_PRIO, 0, K_FOREVER);
+
+#if defined(CONFIG_SCHED_CPU_MASK) && (CONFIG_MP_MAX_NUM_CPUS > 1)
+    // On SMP builds run the producer and the consumer in parallel, on separate cores
+    k_thread_cpu_pin(producer, STRESS_PRODUCER_CPU);
+    k_thread_cpu_pin(consumer, STRESS_CONSUMER_CPU);
+#endif
+
+    k_thread_start(consumer);
+    k_thread_start(producer);
+    k_thread_join(producer, K_FOREVER);
+    k_thread_join(consumer, K_FOREVER);
+
+    benchmark_ring_get_stats(&ctx.ring, &stats);
+    snprintf(message, sizeof(message), "stress ring_buffer items=%u size=%u cpus=%u received=%u overwrites=%u torn=%u reordered=%u", ctx.n_items,
+        BENCHMARK_RING_SIZE, arch_num_cpus(), ctx.n_received, stats.n_overwrites, ctx.n_torn, ctx.n_reordered);
+
+    int ret = data_thread_send_message(message);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (ctx.n_torn > 0 || ctx.n_reordered > 0) {
+        LOG_ERR("Ring buffer stress test failed (%u items torn, %u out of order)", ctx.n_torn, ctx.n_reordered);
+        return -EIO;
+    }
+
+    return 0;
+}
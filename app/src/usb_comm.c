@@ -12,23 +12,121 @@
 #include <zephyr/drivers/uart.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/ring_buffer.h>
 #include <zephyr/usb/usb_device.h>
 
 #include <errno.h>
 
 LOG_MODULE_REGISTER(usb_comm, LOG_LEVEL_INF);
 
+/* Constants */
+#define USB_TX_BUFFER_SIZE 1024   // bytes
+#define USB_TX_TIMEOUT     K_MSEC(100)
+#define USB_RX_BUFFER_SIZE 1024   // bytes
+
+/* Static variables */
+
+// Boards without USB support (e.g. native_sim) can use a regular UART instead, by
+// selecting it with the 'app,data-uart' chosen node (see boards/native_sim.overlay)
+#if DT_HAS_CHOSEN(app_data_uart)
+static const struct device* const uart_dev = DEVICE_DT_GET(DT_CHOSEN(app_data_uart));
+#else
 static const struct device* const uart_dev = DEVICE_DT_GET_ONE(zephyr_cdc_acm_uart);
+#endif
 
-int usb_comm_init(void) {
-    uint32_t baudrate = 0;
-    uint32_t dtr      = 0;
+// Data to be sent is queued in the TX ring buffer and fed to the UART from its
+// interrupt handler, so that writers never have to busy-wait on the UART.
+RING_BUF_DECLARE(tx_ring_buf, USB_TX_BUFFER_SIZE);
+static struct k_spinlock tx_lock = {0};
+static K_SEM_DEFINE(tx_space_sem, 0, 1);   // Given when space frees up on the TX ring buffer
+static K_SEM_DEFINE(tx_done_sem, 0, 1);    // Given when the TX ring buffer is fully drained
 
-    // Check if the UART device is ready
-    if (!device_is_ready(uart_dev)) {
-        LOG_ERR("UART device not ready");
-        return -1;
+// TX stats (see usb_comm_stats_t)
+static atomic_t tx_bytes_written = ATOMIC_INIT(0);
+static atomic_t tx_timeouts      = ATOMIC_INIT(0);
+static atomic_t tx_stall_time_us = ATOMIC_INIT(0);
+
+// Data received is read by the UART interrupt handler straight into the RX ring buffer,
+// and parsed in place by the reader thread (see usb_comm_rx_claim).
+RING_BUF_DECLARE(rx_ring_buf, USB_RX_BUFFER_SIZE);
+static struct k_spinlock rx_lock = {0};
+static K_SEM_DEFINE(rx_data_sem, 0, 1);   // Given when data is received
+
+static void usb_comm_irq_rx(const struct device* dev) {
+    uint8_t discard[16] = {0};
+    int n_received      = 0;
+    int n_read          = 0;
+
+    // Read everything available from the UART FIFO (data that doesn't fit is dropped)
+    do {
+        uint8_t* data = NULL;
+
+        k_spinlock_key_t key = k_spin_lock(&rx_lock);
+        uint32_t size        = ring_buf_put_claim(&rx_ring_buf, &data, USB_RX_BUFFER_SIZE);
+        if (size > 0) {
+            n_read = uart_fifo_read(dev, data, size);
+            ring_buf_put_finish(&rx_ring_buf, MAX(n_read, 0));
+        }
+        k_spin_unlock(&rx_lock, key);
+
+        if (size == 0) {
+            n_read = uart_fifo_read(dev, discard, sizeof(discard));
+            if (n_read > 0) {
+                LOG_ERR("Failed to read USB data: buffer full (%d bytes dropped)", n_read);
+            }
+            continue;
+        }
+
+        n_received += MAX(n_read, 0);
+    } while (n_read > 0);
+
+    if (n_received > 0) {
+        k_sem_give(&rx_data_sem);
     }
+}
+
+static void usb_comm_irq_tx(const struct device* dev) {
+    k_spinlock_key_t key = k_spin_lock(&tx_lock);
+
+    // Feed as many queued bytes as the UART FIFO accepts
+    uint8_t* data = NULL;
+    uint32_t size = ring_buf_get_claim(&tx_ring_buf, &data, USB_TX_BUFFER_SIZE);
+    int n_sent    = (size > 0) ? uart_fifo_fill(dev, data, size) : 0;
+    ring_buf_get_finish(&tx_ring_buf, MAX(n_sent, 0));
+
+    // Stop the TX interrupts once everything has been sent
+    bool done = ring_buf_is_empty(&tx_ring_buf);
+    if (done) {
+        uart_irq_tx_disable(dev);
+    }
+
+    k_spin_unlock(&tx_lock, key);
+
+    if (n_sent > 0) {
+        k_sem_give(&tx_space_sem);
+    }
+    if (done) {
+        k_sem_give(&tx_done_sem);
+    }
+}
+
+static void usb_comm_irq_handler(const struct device* dev, void* user_data) {
+    ARG_UNUSED(user_data);
+
+    while (uart_irq_update(dev) && uart_irq_is_pending(dev)) {
+        if (uart_irq_rx_ready(dev)) {
+            usb_comm_irq_rx(dev);
+        }
+        if (uart_irq_tx_ready(dev)) {
+            usb_comm_irq_tx(dev);
+        }
+    }
+}
+
+#if defined(CONFIG_USB_DEVICE_STACK)
+static int usb_comm_connect(void) {
+    uint32_t baudrate = 0;
+    uint32_t dtr      = 0;
 
     // Enable the USB susbystem
     int ret = usb_enable(NULL);
@@ -74,44 +172,129 @@ int usb_comm_init(void) {
         LOG_DBG("USB baudrate: %d", baudrate);
     }
 
+    return 0;
+}
+#endif
+
+int usb_comm_init(void) {
+    // Check if the UART device is ready
+    if (!device_is_ready(uart_dev)) {
+        LOG_ERR("UART device not ready");
+        return -1;
+    }
+
+    // Setup the UART interrupt handler (used to send and receive data)
+    uart_irq_callback_user_data_set(uart_dev, usb_comm_irq_handler, NULL);
+
+#if defined(CONFIG_USB_DEVICE_STACK)
+    // Enable USB and wait for the host to connect (blocking)
+    int ret = usb_comm_connect();
+    if (ret != 0) {
+        return ret;
+    }
+#endif
+
+    // Start receiving data
+    uart_irq_rx_enable(uart_dev);
+
     LOG_INF("USB communications initialized.");
 
     return 0;
 }
 
-int usb_comm_read(uint8_t* buffer, size_t buffer_len, size_t* n_bytes) {
-    int ret = 0;
+int usb_comm_rx_claim(uint8_t** data, k_timeout_t timeout) {
+    if (data == NULL) {
+        return -EINVAL;
+    }
 
-    memset(buffer, 0, buffer_len);
-    *n_bytes = 0;
+    while (true) {
+        // Hand out the data received in place
+        k_spinlock_key_t key = k_spin_lock(&rx_lock);
+        uint32_t size        = ring_buf_get_claim(&rx_ring_buf, data, USB_RX_BUFFER_SIZE);
+        k_spin_unlock(&rx_lock, key);
 
-    // While there is data present
-    for (int i = 0; ret == 0; i++) {
-        // Check if the buffer is full
-        if (i >= buffer_len) {
-            LOG_ERR("Failed to read USB data: buffer full");
-            return -ENOBUFS;
+        if (size > 0) {
+            return size;
         }
 
-        // Read the next byte from the UART
-        ret = uart_poll_in(uart_dev, &buffer[i]);
-        if (ret == -1) {
-            return 0;   // No data
-        } else if (ret < 0) {
-            LOG_ERR("Failed to read USB data (err: %d - %s)", ret, strerror(-ret));
-            return ret;
+        // Or sleep until some data is received
+        if (k_sem_take(&rx_data_sem, timeout) != 0) {
+            return -EAGAIN;
         }
+    }
+}
+
+void usb_comm_rx_finish(size_t n_bytes) {
+    k_spinlock_key_t key = k_spin_lock(&rx_lock);
+    ring_buf_get_finish(&rx_ring_buf, n_bytes);
+    k_spin_unlock(&rx_lock, key);
+}
 
-        (*n_bytes)++;
+int usb_comm_write_async(uint8_t* buffer, size_t n_bytes) {
+    if (buffer == NULL) {
+        return -EINVAL;
     }
 
+    // Queue as many bytes as there is space for
+    k_spinlock_key_t key = k_spin_lock(&tx_lock);
+    uint32_t n_queued    = ring_buf_put(&tx_ring_buf, buffer, n_bytes);
+    k_spin_unlock(&tx_lock, key);
+
+    // And let the interrupt handler send them
+    if (n_queued > 0) {
+        atomic_add(&tx_bytes_written, n_queued);
+        uart_irq_tx_enable(uart_dev);
+    }
+
+    return n_queued;
+}
+
+size_t usb_comm_tx_pending(void) { return ring_buf_size_get(&tx_ring_buf); }
+
+int usb_comm_flush(k_timeout_t timeout) {
+    // Wait until all the bytes queued have been handed to the UART
+    while (!ring_buf_is_empty(&tx_ring_buf)) {
+        if (k_sem_take(&tx_done_sem, timeout) != 0) {
+            return -ETIMEDOUT;
+        }
+    }
     return 0;
 }
 
 int usb_comm_write(uint8_t* buffer, size_t n_bytes) {
-    // Send bytes one by one
-    for (int i = 0; i < n_bytes; i++) {
-        uart_poll_out(uart_dev, buffer[i]);
+    while (n_bytes > 0) {
+        // Queue the bytes to be sent
+        int ret = usb_comm_write_async(buffer, n_bytes);
+        if (ret < 0) {
+            return ret;
+        }
+        buffer += ret;
+        n_bytes -= ret;
+
+        // If the TX ring buffer is full, sleep until the UART drains some of it
+        if (n_bytes > 0) {
+            int64_t stall_start = k_uptime_ticks();
+            ret                 = k_sem_take(&tx_space_sem, USB_TX_TIMEOUT);
+            atomic_add(&tx_stall_time_us, k_ticks_to_us_floor32(k_uptime_ticks() - stall_start));
+
+            if (ret != 0) {
+                atomic_inc(&tx_timeouts);
+                LOG_WRN("USB write timed out (%zu bytes dropped)", n_bytes);
+                return -ETIMEDOUT;
+            }
+        }
     }
     return 0;
-}
\ No newline at end of file
+}
+
+void usb_comm_get_stats(usb_comm_stats_t* stats) {
+    stats->n_bytes_written = atomic_get(&tx_bytes_written);
+    stats->n_timeouts      = atomic_get(&tx_timeouts);
+    stats->stall_time_us   = atomic_get(&tx_stall_time_us);
+}
+
+void usb_comm_reset_stats(void) {
+    atomic_set(&tx_bytes_written, 0);
+    atomic_set(&tx_timeouts, 0);
+    atomic_set(&tx_stall_time_us, 0);
+}
@@ -0,0 +1,182 @@
+# ********************************************************************************
+# 
+# End-to-end benchmark of the data pipeline. Sweeps a set of data/read/send rates
+# and records, for each one:
+#
+#   - the sustained throughput (unique samples received per second)
+#   - the drop rate (samples produced that never reached the host)
+#   - the p50/p99 sample-to-host latency (on top of the lowest latency seen)
+#   - the device telemetry (see test_telemetry.py)
+#
+# With --patterns, the speed at which the device generates the samples of each
+# simulation pattern (samples/s and ns/sample per pattern block function) is also
+# recorded, along with the bits per sample they take in the compressed stream mode.
+# With --ring-buffer, the time the device takes to add/get an item to/from a ring
+# buffer (ns per item) is also recorded.
+#
+# Results are written as JSON, and can be compared against a previous run to
+# catch performance regressions. The benchmark can either run against a real
+# board (--port) or against a native_sim build of the app (--exe), which needs
+# no hardware:
+#
+#   west build -b native_sim app
+#   python3 tests/benchmark.py --exe build/zephyr/zephyr.exe --output baseline.json
+#   python3 tests/benchmark.py --exe build/zephyr/zephyr.exe --baseline baseline.json
+#
+# Created on Thu Dec 19 2024
+#
+# Daniel Figueira <daniel.castro.figueira@gmail.com>
+# 
+# ********************************************************************************
+import argparse
+import json
+import sys
+import time
+
+import test_utils.usb_comm as usb
+import test_utils.usb_utils as usb_utils
+from test_utils.native_sim import NativeSim
+
+######################## SETTINGS #########################
+
+# (data rate, read rate, send rate) in Hz
+DEFAULT_SWEEP = [
+    (100, 100, 10),
+    (1000, 1000, 10),
+    (1000, 1000, 100),
+    (1000, 1000, 1000),
+    (2000, 2000, 100),
+    (4000, 4000, 200),
+    (10000, 10000, 500),
+    (20000, 20000, 1000),
+]
+
+DEFAULT_DURATION = 2.0 # seconds (per sweep point)
+DEFAULT_TOLERANCE = 0.10 # max relative regression allowed against a baseline
+DEFAULT_OUTPUT = 'benchmark_results.json'
+
+###################### PUBLIC FUNCTIONS ####################
+
+def run_point(data_rate, read_rate, send_rate, duration):
+    ''' Run a single sweep point and return its results '''
+    n_samples = max(1, int(data_rate * duration))
+
+    usb.clear_buffers()
+    usb.reset_telemetry()
+    usb.set_data_rate(data_rate)
+    usb.set_read_rate(read_rate)
+    usb.set_send_rate(send_rate)
+
+    # Stream 'n_samples' samples (indexes 0 to n_samples - 1) and read them all
+    usb.simulate_increasing_pattern(0, 1, n_samples - 1)
+    stats = usb.get_sample_stats()
+    telemetry = usb.get_telemetry()
+
+    n_unique = stats['n_samples'] - stats['n_duplicates']
+    return {
+        'data_rate': data_rate,
+        'read_rate': read_rate,
+        'send_rate': send_rate,
+        'stream_mode': usb.DEFAULT_STREAM_MODE,
+        'expected_samples': n_samples,
+        'received_samples': stats['n_samples'],
+        'duplicates': stats['n_duplicates'],
+        'missed': stats['n_missed'],
+        'drop_rate': max(0, n_samples - n_unique) / n_samples,
+        'throughput_sps': stats['throughput_sps'],
+        'latency_p50_us': stats['latency_p50_us'],
+        'latency_p99_us': stats['latency_p99_us'],
+        'latency_max_us': stats['latency_max_us'],
+        'telemetry': telemetry,
+    }
+
+def compare(results, baseline, tolerance):
+    ''' Compare the results against a baseline, returning the list of regressions found '''
+    regressions = []
+    baseline_points = {(x['data_rate'], x['read_rate'], x['send_rate']): x for x in baseline['results']}
+    for result in results['results']:
+        key = (result['data_rate'], result['read_rate'], result['send_rate'])
+        if key not in baseline_points:
+            continue
+        base = baseline_points[key]
+        if result['throughput_sps'] < base['throughput_sps'] * (1 - tolerance):
+            regressions.append(f"{key}: throughput {result['throughput_sps']:.1f} < {base['throughput_sps']:.1f} samples/s")
+        if result['drop_rate'] > base['drop_rate'] + tolerance:
+            regressions.append(f"{key}: drop rate {result['drop_rate']:.3f} > {base['drop_rate']:.3f}")
+        if result['latency_p99_us'] > base['latency_p99_us'] * (1 + tolerance) + 1000:
+            regressions.append(f"{key}: p99 latency {result['latency_p99_us']:.0f} > {base['latency_p99_us']:.0f} us")
+    for pattern, result in results.get('patterns', {}).items():
+        base = baseline.get('patterns', {}).get(pattern)
+        if base and result['samples_per_sec'] < base['samples_per_sec'] * (1 - tolerance):
+            regressions.append(f"{pattern} pattern: {result['samples_per_sec']} < {base['samples_per_sec']} samples/s")
+        if base and result.get('bits_per_sample', 0) > base.get('bits_per_sample', float('inf')) * (1 + tolerance):
+            regressions.append(f"{pattern} pattern: {result['bits_per_sample']} > {base['bits_per_sample']} bits/sample")
+    for key, value in results.get('ring_buffer', {}).items():
+        base = baseline.get('ring_buffer', {}).get(key)
+        if key.endswith('_ns') and base and value > base * (1 + tolerance):
+            regressions.append(f"ring buffer: {key} {value} > {base} ns")
+    return regressions
+
+def parse_rates(text):
+    ''' Parse a "data:read:send" sweep point '''
+    return tuple(float(x) for x in text.split(':'))
+
+def main():
+    parser = argparse.ArgumentParser(description="End-to-end pipeline benchmark")
+    target = parser.add_mutually_exclusive_group()
+    target.add_argument('--port', default=usb_utils.DEFAULT_PORT, help="serial port of a real board")
+    target.add_argument('--exe', help="native_sim build of the app (zephyr.exe)")
+    parser.add_argument('--rates', nargs='+', type=parse_rates, help="sweep points as data:read:send (Hz)")
+    parser.add_argument('--duration', type=float, default=DEFAULT_DURATION, help="seconds of data per sweep point")
+    parser.add_argument('--output', default=DEFAULT_OUTPUT, help="file to write the JSON results to")
+    parser.add_argument('--baseline', help="JSON results of a previous run to compare against")
+    parser.add_argument('--tolerance', type=float, default=DEFAULT_TOLERANCE, help="max relative regression allowed")
+    parser.add_argument('--patterns', action='store_true', help="also benchmark the pattern block functions")
+    parser.add_argument('--ring-buffer', action='store_true', help="also benchmark the ring buffer add/get functions")
+    args = parser.parse_args()
+
+    sim = NativeSim(args.exe) if args.exe else None
+    port = sim.start() if sim else args.port
+
+    try:
+        usb.init(port)
+        results = {
+            'target': args.exe if sim else port,
+            'timestamp': time.strftime('%Y-%m-%dT%H:%M:%S'),
+            'duration_s': args.duration,
+            'results': [run_point(*rates, args.duration) for rates in (args.rates or DEFAULT_SWEEP)],
+        }
+        if args.patterns:
+            results['patterns'] = usb.benchmark_patterns()
+        if args.ring_buffer:
+            results['ring_buffer'] = usb.benchmark_ring_buffer()
+    finally:
+        if sim:
+            sim.stop()
+
+    with open(args.output, 'w') as f:
+        json.dump(results, f, indent=2)
+
+    # Print a summary of the results
+    for result in results['results']:
+        print(f"{result['data_rate']:>8g} / {result['read_rate']:>8g} / {result['send_rate']:>6g} Hz: "
+              f"{result['throughput_sps']:>9.1f} samples/s, drop rate {result['drop_rate']:.3f}, "
+              f"latency p50 {result['latency_p50_us']:.0f} us, p99 {result['latency_p99_us']:.0f} us")
+    for pattern, result in results.get('patterns', {}).items():
+        print(f"{pattern:>10} pattern: {result['samples_per_sec']:>11} samples/s ({result['ns_per_sample']} ns/sample)")
+    if 'ring_buffer' in results:
+        ring_buffer = results['ring_buffer']
+        print(f"ring buffer: add {ring_buffer['add_ns']} ns, get {ring_buffer['get_ns']} ns, get batch {ring_buffer['get_batch_ns']} ns (per item)")
+
+    # Check for regressions against the baseline (if any)
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.tolerance)
+        for regression in regressions:
+            print(f"REGRESSION {regression}", file=sys.stderr)
+        return 1 if regressions else 0
+
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
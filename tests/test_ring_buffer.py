@@ -7,11 +7,16 @@
 # Daniel Figueira <daniel.castro.figueira@gmail.com>
 # 
 # ********************************************************************************
+import time
+
+import pytest
+
 import test_utils.usb_comm as usb
 
 ##################### Constants ######################
 
-RING_BUFFER_SIZE = 10
+RING_BUFFER_SIZE = 16 # CONFIG_APP_RING_BUFFER_SIZE
+SAMPLE_BLOCK_SIZE = 64 # SAMPLE_BLOCK_MAX_SAMPLES (max samples sent at once)
 
 ##################### Test Cases #####################
 
@@ -49,6 +54,117 @@ class TestRingBuffer:
         data = usb.simulate_increasing_pattern(0, 1, 2 * RING_BUFFER_SIZE - 1)
         assert RING_BUFFER_SIZE <= len(data) <= RING_BUFFER_SIZE + 1
         assert data[-RING_BUFFER_SIZE:] == [RING_BUFFER_SIZE + i for i in range(RING_BUFFER_SIZE)]
+        assert usb.get_sample_stats()['n_missed'] == 2 * RING_BUFFER_SIZE - len(data)
+
+    def test_1_3_ReducedRate_NoDroppedSamples_WhenBatchFitsTheBuffer(self):
+        ''' No samples are dropped when data is sent at a reduced rate as long as
+            the samples queued on each send period fit in the buffer (all the samples
+            queued are sent at once) '''
+        usb.set_data_rate(1000)
+        usb.set_read_rate(1000)
+        usb.set_send_rate(200) # 5 samples queued per send period
+        data = usb.simulate_increasing_pattern(0, 1, 1000)
+        assert data == [i for i in range(1000 + 1)]
+
+    def test_1_4_ReducedRate_GapFreePrefix_WhenDroppingTheNewestSamples(self):
+        ''' With the drop newest policy, the samples kept once the buffer is full are the
+            oldest ones (so the samples received start with no gaps) '''
+        usb.set_overflow_policy(usb.OVERFLOW_DROP_NEWEST)
+        usb.reset_telemetry()
+        usb.set_data_rate(1000)
+        usb.set_read_rate(1000)
+        usb.set_send_rate(10) # slow send rate
+        data = usb.simulate_increasing_pattern(0, 1, 2 * RING_BUFFER_SIZE - 1)
+        assert RING_BUFFER_SIZE <= len(data) <= RING_BUFFER_SIZE + 1
+        assert data[:RING_BUFFER_SIZE] == [i for i in range(RING_BUFFER_SIZE)]
+        telemetry = usb.get_telemetry()
+        assert telemetry['ring_buffer']['overwrites'] == 0
+        assert telemetry['ring_buffer']['dropped'] == 2 * RING_BUFFER_SIZE - len(data)
+
+    def test_1_5_ReducedRate_NoOverwrites_WhenBlockingTheSensorThread(self):
+        ''' With the block policy, the sensor thread waits for the data thread to free up
+            a slot instead of overwriting or dropping samples '''
+        usb.set_overflow_policy(usb.OVERFLOW_BLOCK, 1000)
+        usb.reset_telemetry()
+        usb.set_data_rate(1000)
+        usb.set_read_rate(1000)
+        usb.set_send_rate(10) # slow send rate
+        data = usb.simulate_increasing_pattern(0, 1, 2 * RING_BUFFER_SIZE - 1)
+        assert data[:RING_BUFFER_SIZE] == [i for i in range(RING_BUFFER_SIZE)]
+        assert all([data[i] < data[i + 1] for i in range(len(data) - 1)])
+        telemetry = usb.get_telemetry()
+        assert telemetry['ring_buffer']['overwrites'] == 0
+        assert telemetry['ring_buffer']['dropped'] == 0
+        assert telemetry['ring_buffer']['waits'] > 0
+
+    def test_1_6_ReducedRate_NoDroppedSamples_WhenBurstingAtTheHighWaterMark(self):
+        ''' With the adaptive send mode, the samples queued are sent right away once the buffer
+            fills up, so no samples are dropped even if the send rate is too slow for them '''
+        usb.set_adaptive_send(True)
+        usb.reset_telemetry()
+        usb.set_data_rate(1000)
+        usb.set_read_rate(1000)
+        usb.set_send_rate(10) # slow send rate
+        data = usb.simulate_increasing_pattern(0, 1, 4 * RING_BUFFER_SIZE - 1)
+        time.sleep(0.2) # the samples left are sent on the next send period
+        data += usb.read_data(0)
+        assert data == [i for i in range(4 * RING_BUFFER_SIZE)]
+        telemetry = usb.get_telemetry()
+        assert telemetry['ring_buffer']['overwrites'] == 0
+        assert telemetry['data']['bursts'] > 0
+
+    def test_1_7_ReducedRate_NoDroppedSamples_InLatencyMode(self):
+        ''' In latency mode, the data thread is woken up by the new samples and sends them right
+            away, so no samples are dropped (or held back) even if the send rate is too slow '''
+        usb.set_latency_mode(True)
+        usb.reset_telemetry()
+        usb.set_data_rate(100)
+        usb.set_read_rate(100)
+        usb.set_send_rate(1) # slow send rate (not used in latency mode)
+        assert usb.simulate_increasing_pattern(0, 1, 50) == [i for i in range(50 + 1)]
+        assert usb.get_sample_stats()['latency_p99_us'] < 20000
+        telemetry = usb.get_telemetry()
+        assert telemetry['ring_buffer']['overwrites'] == 0
+        assert telemetry['data']['wakeups'] > 0
+
+    def test_1_8_ReducedRate_NoDroppedSamples_WhenASendPeriodSpansSeveralBlocks(self):
+        ''' All the samples queued are sent on each send period, even if they take more than
+            one block (needs a ring buffer built with room for a few send periods) '''
+        ring_buffer_size = usb.get_telemetry()['ring_buffer']['size']
+        if ring_buffer_size < 4 * SAMPLE_BLOCK_SIZE:
+            pytest.skip(f"needs CONFIG_APP_RING_BUFFER_SIZE >= {4 * SAMPLE_BLOCK_SIZE}")
+        usb.reset_telemetry()
+        usb.set_data_rate(1000)
+        usb.set_read_rate(1000)
+        usb.set_send_rate(10) # 100 samples queued per send period
+        assert usb.simulate_increasing_pattern(0, 1, 1000) == [i for i in range(1000 + 1)]
+        telemetry = usb.get_telemetry()
+        assert telemetry['ring_buffer']['overwrites'] == 0
+        assert telemetry['ring_buffer']['peak'] < ring_buffer_size
+
+    def test_1_9_LatencyMode_FewerBiggerFrames_WhenCoalescingUpToNSamples(self):
+        ''' In latency mode, samples can be coalesced: the data thread waits for up to N samples
+            (or the end of the coalescing window) on each wakeup, so it sends fewer, bigger frames '''
+        usb.set_latency_mode(True, 10, 80000) # up to 10 samples (50 ms at 200 Hz) / 80 ms
+        usb.reset_telemetry()
+        usb.set_data_rate(200)
+        usb.set_read_rate(200)
+        assert usb.simulate_increasing_pattern(0, 1, 200) == [i for i in range(200 + 1)]
+        telemetry = usb.get_telemetry()
+        assert 0 < telemetry['data']['wakeups'] <= 201 // 10 + 5
+        assert telemetry['data']['samples'] / telemetry['data']['wakeups'] >= 5
+
+    def test_1_10_LatencyMode_FewerBiggerFrames_WhenCoalescingWithNoSampleLimit(self):
+        ''' With no limit on the number of samples coalesced (0), the data thread waits for the
+            whole coalescing window on each wakeup '''
+        usb.set_latency_mode(True, 0, 50000) # 50 ms (10 samples at 200 Hz)
+        usb.reset_telemetry()
+        usb.set_data_rate(200)
+        usb.set_read_rate(200)
+        assert usb.simulate_increasing_pattern(0, 1, 200) == [i for i in range(200 + 1)]
+        telemetry = usb.get_telemetry()
+        assert 0 < telemetry['data']['wakeups'] <= 201 // 10 + 5
+        assert telemetry['data']['samples'] / telemetry['data']['wakeups'] >= 5
 
     def test_2_1_IncreasedRate_NoDuplicates(self):
         ''' Missed samples happen when the data rate is bigger than the read rate '''
@@ -56,4 +172,26 @@ class TestRingBuffer:
         usb.set_read_rate(10)
         usb.set_send_rate(1000)
         assert usb.simulate_increasing_pattern(0, 1, 10) == [i for i in range(10 + 1)]
-    
+
+    def test_3_1_Stress_NoTornOrDuplicatedSamples_WhenProducerAndConsumerRunConcurrently(self):
+        ''' Samples are never torn or duplicated when the producer and the consumer
+            hammer the ring buffer at full rate (with the producer overwriting items) '''
+        n_samples = 5000
+        usb.set_data_rate(1000)
+        usb.set_read_rate(1000)
+        usb.set_send_rate(50) # each send period spans more samples than the buffer size
+        data = usb.simulate_increasing_pattern(0, 1, n_samples)
+        assert len(data) > 0
+        assert all([x.is_integer() and 0 <= x <= n_samples for x in data])
+        assert all([data[i] < data[i + 1] for i in range(len(data) - 1)])
+
+    def test_3_2_Stress_NoTornOrDuplicatedItems_WhenTwoThreadsDriveTheRingBufferDirectly(self):
+        ''' Items are never torn, duplicated or reordered when a producer and a consumer thread
+            add/get them at once, straight through the ring buffer functions (on SMP builds, such
+            as qemu_x86_64, the threads are pinned to separate cores and run in parallel) '''
+        results = usb.stress_ring_buffer(200000)
+        assert results['items'] == 200000
+        assert results['torn'] == 0
+        assert results['reordered'] == 0
+        assert results['received'] > 0
+        assert results['received'] + results['overwrites'] == results['items'] # every item is either received or overwritten
@@ -7,6 +7,8 @@
 # Daniel Figueira <daniel.castro.figueira@gmail.com>
 # 
 # ********************************************************************************
+import math
+
 import test_utils.usb_comm as usb
 
 ##################### Test Cases #####################
@@ -26,6 +28,7 @@ class TestSensorSimulation:
 
     def teardown_method(self):
         usb.set_default_data_rates()
+        usb.set_stream_mode(usb.DEFAULT_STREAM_MODE)
 
     def test_1_1_Simulation_NoData_WhenIdle(self):
         ''' No data is received when the sensor is idle '''
@@ -36,6 +39,45 @@ class TestSensorSimulation:
         assert usb.simulate_const_pattern(10, 5)
         assert not usb.read_data()
 
+    def test_1_3_Commands_AreAcknowledged_WhenPipelined(self):
+        ''' Commands sent back to back are each acknowledged, with their error code and the value
+            actually applied (rates in mHz) '''
+        ids = [usb.send_command(usb.COMMAND_SET_DATA_RATE, usb.DEFAULT_DATA_RATE, 0),
+               usb.send_command(usb.COMMAND_SET_DATA_RATE, -1, 0),
+               usb.send_command(usb.COMMAND_SET_SEND_RATE, usb.DEFAULT_DATA_RATE),
+               usb.send_command(99)] # unknown command
+        acks = usb.wait_for_acks(ids)
+        assert acks[ids[0]] == (0, usb.DEFAULT_DATA_RATE * 1000)
+        assert acks[ids[1]][0] == -22 # EINVAL
+        assert acks[ids[2]] == (0, usb.DEFAULT_DATA_RATE * 1000)
+        assert acks[ids[3]][0] == -5 # EIO
+
+    def test_1_4_Commands_AreParsed_WhenSentInOneWrite(self):
+        ''' Many commands sent in a single write (of any length) are each parsed and acknowledged, in order '''
+        commands = [(usb.COMMAND_SET_SEND_RATE, 10 * (i + 1)) for i in range(40)]
+        commands.append((usb.COMMAND_SET_DATA_RATE, f"{usb.DEFAULT_DATA_RATE:080.3f}", 0)) # longer than the old 64 byte line limit
+        commands.append((usb.COMMAND_SET_DATA_RATE, usb.DEFAULT_DATA_RATE, 0, 1, 2, 3, 4)) # too many arguments
+        commands.append((usb.COMMAND_SET_SEND_RATE, usb.DEFAULT_DATA_RATE))
+        ids = usb.send_commands(commands)
+        acks = usb.wait_for_acks(ids)
+        assert [acks[x] for x in ids[:40]] == [(0, 10 * (i + 1) * 1000) for i in range(40)]
+        assert acks[ids[40]] == (0, usb.DEFAULT_DATA_RATE * 1000)
+        assert acks[ids[41]][0] == -7 # E2BIG
+        assert acks[ids[42]] == (0, usb.DEFAULT_DATA_RATE * 1000)
+
+    def test_1_5_Commands_AreRejected_WhenThePatternIsInvalid(self):
+        ''' Unknown (or non-integer) patterns are rejected, and stopping the simulation is only
+            valid when starting a pattern '''
+        ids = [usb.send_command(usb.COMMAND_START_PATTERN, 42, 10, 5, 0, 0),
+               usb.send_command(usb.COMMAND_START_PATTERN, -3, 10, 5, 0, 0),
+               usb.send_command(usb.COMMAND_START_PATTERN, 0.5, 10, 5, 0, 0),
+               usb.send_command(usb.COMMAND_QUEUE_PATTERN, usb.PATTERN_NONE, 10, 5, 0, 0, 0, 0),
+               usb.send_command(usb.COMMAND_START_PATTERN, usb.PATTERN_NONE, 0, 0, 0, 0)]
+        acks = usb.wait_for_acks(ids)
+        assert [acks[x][0] for x in ids[:4]] == [-22, -22, -22, -22] # EINVAL
+        assert acks[ids[4]][0] == 0
+        assert not usb.read_data()
+
     def test_2_1_ConstPattern_DataIsOk(self): 
         ''' Data is correctly simulated for a constant pattern '''
         assert usb.simulate_const_pattern(10, 5) == [10.0, 10.0, 10.0, 10.0, 10.0]
@@ -100,7 +142,9 @@ class TestSensorSimulation:
         usb.set_read_rate(20)
         usb.set_send_rate(20)
         assert usb.simulate_increasing_pattern(10, 2, 20) == [10.0, 10.0, 12.0, 12.0, 14.0, 14.0, 16.0, 16.0, 18.0, 18.0, 20.0, 20.0]
-        pass
+        stats = usb.get_sample_stats()
+        assert stats['n_duplicates'] == 6
+        assert stats['n_missed'] == 0
 
     def test_6_5_DataRate_MissedSamples_WhenDataRateIsBiggerThanReadRate(self):
         ''' Missed samples happen when the data rate is bigger than the read rate '''
@@ -108,6 +152,147 @@ class TestSensorSimulation:
         usb.set_read_rate(10)
         usb.set_send_rate(10)
         assert usb.simulate_increasing_pattern(10, 2, 20) == [10.0, 14.0, 18.0]
-        pass
+        stats = usb.get_sample_stats()
+        assert stats['n_duplicates'] == 0
+        assert stats['n_missed'] == 2
+
+    def test_6_6_DataRate_DataIsOk_AtFractionalRate(self):
+        ''' Data is correctly simulated at a fractional rate (2.5Hz) '''
+        usb.set_data_rate(2.5)
+        usb.set_read_rate(2.5)
+        usb.set_send_rate(2.5)
+        data = usb.simulate_increasing_pattern(0, 1, 5)
+        assert data == [i for i in range(5 + 1)]
+
+    def test_6_7_DataRate_DataIsOk_At2000Hz(self):
+        ''' Data is correctly simulated above 1kHz (2000Hz) '''
+        usb.set_data_rate(2000)
+        usb.set_read_rate(2000)
+        usb.set_send_rate(2000)
+        data = usb.simulate_increasing_pattern(0, 1, 2000)
+        assert data == [i for i in range(2000 + 1)]
     
     
+
+    def test_7_1_Channels_DataIsOk_AtIndependentRates(self):
+        ''' Data is correctly simulated on several channels at once, each at its own rate '''
+        usb.set_data_rate(200, channel=1)
+        usb.set_read_rate(200, channel=1)
+        usb.start_pattern(usb.PATTERN_INCREASING, 0, 1, 40, channel=1)
+        usb.start_pattern(usb.PATTERN_DECREASING, 20, 1, 0, channel=0)
+        samples = usb.read_samples()
+        assert [x.value for x in samples if x.channel == 0] == [20 - i for i in range(20 + 1)]
+        assert [x.value for x in samples if x.channel == 1] == [i for i in range(40 + 1)]
+        stats = usb.get_sample_stats()
+        assert stats['n_duplicates'] == 0
+        assert stats['n_missed'] == 0
+
+    def test_8_1_Resampling_DataIsOk_WhenDecimating(self):
+        ''' Data is resampled to a lower read rate, without duplicates or missed samples '''
+        usb.set_resampling(16)
+        usb.set_data_rate(200)
+        usb.set_read_rate(100)
+        data = usb.simulate_const_pattern(10, 200)
+        assert len(data) == 100
+        assert all([abs(x - 10) < 1e-3 for x in data])
+        stats = usb.get_sample_stats()
+        assert stats['n_duplicates'] == 0
+        assert stats['n_missed'] == 0
+
+    def test_8_2_Resampling_DataIsOk_WhenInterpolating(self):
+        ''' Data is resampled to a higher read rate, without duplicates or missed samples '''
+        usb.set_resampling(16)
+        usb.set_data_rate(100)
+        usb.set_read_rate(200)
+        usb.set_send_rate(200)
+        data = usb.simulate_const_pattern(10, 100)
+        assert len(data) == 199 # up to the last sample produced
+        assert all([abs(x - 10) < 1e-3 for x in data])
+        stats = usb.get_sample_stats()
+        assert stats['n_duplicates'] == 0
+        assert stats['n_missed'] == 0
+
+    def test_8_3_Resampling_FilterKeepsRamps(self):
+        ''' A ramp keeps its shape when decimated (away from the start and end of the data) '''
+        usb.set_resampling(16)
+        usb.set_data_rate(200)
+        usb.set_read_rate(100)
+        data = usb.simulate_increasing_pattern(0, 1, 200)
+        assert len(data) == 101
+        assert all([abs(x - 2 * i) < 1e-2 for i, x in enumerate(data) if 8 <= i <= 92])
+
+    def test_9_1_Aggregation_SummariesAreOk(self):
+        ''' Data is sent as one summary per window on aggregated channels (channel 0 keeps the stream going) '''
+        usb.set_aggregation(10, channel=1)
+        usb.start_pattern(usb.PATTERN_INCREASING, 0, 1, 99, channel=1)
+        data = usb.simulate_increasing_pattern(0, 1, 110, channel=0)
+        assert data == [i for i in range(110 + 1)]
+        summaries = usb.read_summaries(channel=1)
+        assert [x.index for x in summaries] == [i for i in range(10)]
+        assert all([x.n_samples == 10 for x in summaries])
+        assert [x.min for x in summaries] == [10 * i for i in range(10)]
+        assert [x.max for x in summaries] == [10 * i + 9 for i in range(10)]
+        assert all([abs(x.mean - (10 * i + 4.5)) < 1e-3 for i, x in enumerate(summaries)])
+        assert all([abs(x.rms - (sum((10 * i + j) ** 2 for j in range(10)) / 10) ** 0.5) < 1e-2 for i, x in enumerate(summaries)])
+
+    def test_10_1_StreamMode_DataIsOk_WhenCompressed(self):
+        ''' Data is correctly received in the compressed stream mode, on several channels at once '''
+        usb.set_stream_mode('compressed')
+        usb.set_data_rate(200, channel=1)
+        usb.set_read_rate(200, channel=1)
+        usb.start_pattern(usb.PATTERN_RANDOM, -100, 100, 200, channel=1)
+        usb.start_pattern(usb.PATTERN_INCREASING, 0, 0.5, 50, channel=0)
+        samples = usb.read_samples()
+        assert [x.value for x in samples if x.channel == 0] == [0.5 * i for i in range(100 + 1)]
+        assert len([x for x in samples if x.channel == 1 and -100 <= x.value <= 100]) == 200
+        assert usb.stream_decoder.n_bad_frames == 0
+        stats = usb.get_sample_stats()
+        assert stats['n_duplicates'] == 0
+        assert stats['n_missed'] == 0
+
+    def test_11_1_Playlist_PatternsArePlayedBackToBack(self):
+        ''' Patterns queued on the device are played back to back, with no gap (or duplicate) in between '''
+        usb.set_data_rate(100)
+        usb.set_read_rate(100)
+        usb.set_send_rate(100)
+        usb.start_playlist([(usb.PATTERN_CONST, 5, 10, 0),
+                            (usb.PATTERN_INCREASING, 0, 1, 9, 0, 1), # played twice
+                            (usb.PATTERN_DECREASING, 9, 1, 0)])
+        samples = usb.read_samples()
+        assert [x.value for x in samples] == [5] * 10 + [i for i in range(10)] * 2 + [9 - i for i in range(10)]
+        assert [x.index for x in samples] == [i for i in range(40)]
+        assert all([abs(y.timestamp_us - x.timestamp_us - 10000) < 100 for x, y in zip(samples, samples[1:])])
+
+    def test_12_1_Waveforms_DataIsOk(self):
+        ''' Periodic waveforms are correctly simulated (from their lookup table / phase accumulator) '''
+        sine = [100 * math.sin(2 * math.pi * i / 8) for i in range(16)]
+        assert all([abs(x - y) < 0.1 for x, y in zip(usb.simulate_waveform(usb.PATTERN_SINE, 100, 8, 16), sine)])
+        assert usb.simulate_waveform(usb.PATTERN_SQUARE, 100, 8, 16) == [100, 100, 100, 100, -100, -100, -100, -100] * 2
+        assert usb.simulate_waveform(usb.PATTERN_TRIANGLE, 100, 8, 16) == [0, 50, 100, 50, 0, -50, -100, -50] * 2
+        assert usb.simulate_waveform(usb.PATTERN_SAWTOOTH, 100, 8, 16) == [0, 25, 50, 75, -100, -75, -50, -25] * 2
+
+    def test_12_2_Waveforms_NoData_WhenPeriodIsTooShort(self):
+        ''' No data is received when the period can't be sampled (under 2 samples) '''
+        assert not usb.simulate_waveform(usb.PATTERN_SINE, 100, 1.5, 16)
+
+    def test_12_3_Chirp_DataIsOk(self):
+        ''' A chirp sweeps a sine wave from 0 up to the final frequency '''
+        chirp = [100 * math.sin(math.pi * i * i / (4 * 64)) for i in range(64)]
+        assert all([abs(x - y) < 0.5 for x, y in zip(usb.simulate_waveform(usb.PATTERN_CHIRP, 100, 4, 64), chirp)])
+
+    def test_12_4_Noise_DataIsOk(self):
+        ''' Noise stays within its amplitude, around the value given '''
+        data = usb.simulate_noise_pattern(10, 5, 100)
+        assert len(data) == 100
+        assert all([5 <= x <= 15 for x in data])
+        assert abs(sum(data) / len(data) - 10) < 1
+
+    def test_12_5_Waveforms_NoiseIsOverlaid(self):
+        ''' Noise set on a channel is overlaid on its waveforms, within its amplitude '''
+        usb.set_noise(5)
+        sine = [100 * math.sin(2 * math.pi * i / 8) for i in range(200)]
+        data = usb.simulate_waveform(usb.PATTERN_SINE, 100, 8, 200)
+        assert len(data) == 200
+        assert all([abs(x - y) <= 5.1 for x, y in zip(data, sine)])
+        assert any([abs(x - y) > 0.1 for x, y in zip(data, sine)])
+        assert abs(sum(data) / len(data)) < 1
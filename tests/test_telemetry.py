@@ -0,0 +1,103 @@
+# ********************************************************************************
+# 
+# Set of tests used to validate the pipeline telemetry.
+#
+# Created on Wed Dec 18 2024
+#
+# Daniel Figueira <daniel.castro.figueira@gmail.com>
+# 
+# ********************************************************************************
+import test_utils.usb_comm as usb
+
+##################### Constants ######################
+
+RING_BUFFER_SIZE = 16 # CONFIG_APP_RING_BUFFER_SIZE
+JITTER_BUCKETS = 16
+
+##################### Test Cases #####################
+
+class TestTelemetry:
+    @classmethod
+    def setup_class(cls):
+        usb.init()
+
+    @classmethod
+    def teardown_class(cls):
+        pass
+
+    def setup_method(self):
+        usb.clear_buffers()
+        usb.reset_telemetry()
+
+    def teardown_method(self):
+        usb.set_default_data_rates()
+
+    def test_1_1_Telemetry_AllStagesReported(self):
+        ''' All the pipeline stages are reported '''
+        telemetry = usb.get_telemetry()
+        assert set(telemetry.keys()) == {'sensor', 'ring_buffer', 'data', 'read_timer', 'send_timer'}
+        assert len(telemetry['read_timer']['jitter_hist']) == JITTER_BUCKETS
+        assert len(telemetry['send_timer']['jitter_hist']) == JITTER_BUCKETS
+
+    def test_1_2_Telemetry_CountersAreZero_AfterReset(self):
+        ''' The sample counters are cleared when the telemetry is reset '''
+        usb.simulate_increasing_pattern(0, 1, 10)
+        usb.reset_telemetry()
+        telemetry = usb.get_telemetry()
+        assert telemetry['sensor'] == {'produced': 0, 'read': 0, 'duplicated': 0, 'skipped': 0}
+        assert telemetry['ring_buffer']['overwrites'] == 0
+        assert telemetry['data']['samples'] == 0
+
+    def test_2_1_Telemetry_SamplesAreCounted(self):
+        ''' All the samples are counted through the pipeline when none is lost '''
+        data = usb.simulate_increasing_pattern(0, 1, 10)
+        telemetry = usb.get_telemetry()
+        assert telemetry['sensor']['read'] == len(data)
+        assert telemetry['sensor']['duplicated'] == 0
+        assert telemetry['sensor']['skipped'] == 0
+        assert telemetry['data']['samples'] == len(data)
+
+    def test_2_2_Telemetry_DuplicatesAndSkipsAreCounted(self):
+        ''' Duplicated and skipped reads are counted by the sensor '''
+        usb.set_data_rate(10)
+        usb.set_read_rate(20)
+        usb.set_send_rate(20)
+        usb.simulate_increasing_pattern(10, 2, 20)
+        assert usb.get_telemetry()['sensor']['duplicated'] == usb.get_sample_stats()['n_duplicates']
+
+        usb.clear_buffers()
+        usb.reset_telemetry()
+        usb.set_data_rate(20)
+        usb.set_read_rate(10)
+        usb.set_send_rate(10)
+        usb.simulate_increasing_pattern(10, 2, 20)
+        assert usb.get_telemetry()['sensor']['skipped'] == usb.get_sample_stats()['n_missed']
+
+    def test_3_1_Telemetry_OverwritesAreCounted(self):
+        ''' The samples overwritten in the ring buffer are counted '''
+        usb.set_data_rate(1000)
+        usb.set_read_rate(1000)
+        usb.set_send_rate(10) # slow send rate
+        data = usb.simulate_increasing_pattern(0, 1, 2 * RING_BUFFER_SIZE - 1)
+        telemetry = usb.get_telemetry()
+        assert telemetry['ring_buffer']['overwrites'] == 2 * RING_BUFFER_SIZE - len(data)
+        assert telemetry['ring_buffer']['peak'] == RING_BUFFER_SIZE
+
+    def test_4_1_Benchmark_AllPatternsAreMeasured(self):
+        ''' The generation speed of every simulation pattern is measured '''
+        results = usb.benchmark_patterns(10000)
+        assert set(results) == set(usb.PATTERNS.values())
+        assert all([x['samples'] == 10000 and x['samples_per_sec'] > 0 and x['ns_per_sample'] > 0 for x in results.values()])
+
+    def test_4_2_Benchmark_CorrelatedPatternsCompressWell(self):
+        ''' Correlated patterns take much less than their raw 104 bits per sample once compressed '''
+        results = usb.benchmark_patterns(10000)
+        assert results['const']['bits_per_sample'] < 32
+        assert results['increasing']['bits_per_sample'] < 64
+        assert results['decreasing']['bits_per_sample'] < 64
+
+    def test_4_3_Benchmark_RingBufferIsMeasured(self):
+        ''' The time taken to add and get an item to/from a ring buffer is measured '''
+        results = usb.benchmark_ring_buffer(10000)
+        assert results['items'] == 10000
+        assert all([results[key] > 0 for key in ['add_ns', 'get_ns', 'get_batch_ns']])
@@ -0,0 +1,65 @@
+# ********************************************************************************
+# 
+# Provides functions to run the app on Zephyr's native_sim board, with the data
+# UART backed by a host pseudo-terminal (so it can be used just like the USB
+# port of a real board).
+#
+# Created on Thu Dec 19 2024
+#
+# Daniel Figueira <daniel.castro.figueira@gmail.com>
+# 
+# ********************************************************************************
+import re
+import subprocess
+import threading
+import time
+
+######################## CONSTANTS ########################
+
+# Printed by the native PTY UART driver when the app starts
+PTY_PATTERN = re.compile(r'uart_1 connected to pseudotty: (\S+)')
+START_TIMEOUT = 10.0 # seconds
+
+###################### PUBLIC FUNCTIONS ####################
+
+class NativeSim:
+    ''' Runs a native_sim build of the app (build/zephyr/zephyr.exe) in the background '''
+
+    def __init__(self, exe):
+        self.exe = exe
+        self.process = None
+        self.port = None
+
+    def start(self):
+        ''' Start the app and return the pseudo-terminal used for data and commands '''
+        self.process = subprocess.Popen([self.exe], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+
+        # Wait for the app to report its data pseudo-terminal
+        deadline = time.monotonic() + START_TIMEOUT
+        while self.port is None and time.monotonic() < deadline:
+            line = self.process.stdout.readline()
+            if not line:
+                break
+            match = PTY_PATTERN.search(line)
+            if match:
+                self.port = match.group(1)
+
+        if self.port is None:
+            self.stop()
+            raise RuntimeError(f"Failed to start {self.exe}")
+
+        # Keep draining the app output (so it never blocks on a full pipe)
+        threading.Thread(target=self._drain, daemon=True).start()
+
+        return self.port
+
+    def stop(self):
+        ''' Stop the app '''
+        if self.process:
+            self.process.terminate()
+            self.process.wait()
+            self.process = None
+
+    def _drain(self):
+        for _ in self.process.stdout:
+            pass
@@ -0,0 +1,138 @@
+# ********************************************************************************
+#
+# Provides a decoder for the blocks of samples compressed by the embedded device
+# (the payload of the compressed frames, whose channels, indexes and timestamps are
+# packed the same way in the binary frames). Each field is encoded against the previous
+# sample of the same channel (in the same block), one field after the other:
+#
+#   | channel (u8 * n) | index (varint * n) | timestamp_us (varint * n) | value (bits) |
+#
+#   - index: zigzag varint of the difference to the previous index
+#   - timestamp_us: zigzag varint of the difference between the last two time deltas
+#   - value: Gorilla style XOR with the previous value ('0' if unchanged, '10' + the
+#            meaningful bits if they fit the previous leading/trailing zeros, or '11' +
+#            leading zeros (5 bits) + meaningful length - 1 (5 bits) + the meaningful bits)
+#            or, for fixed-point values, the zigzag varint of the difference to the previous
+#            value
+#
+# Created on Mon Dec 23 2024
+#
+# Daniel Figueira <daniel.castro.figueira@gmail.com>
+#
+# ********************************************************************************
+import struct
+
+from test_utils.sample_tracker import Sample
+
+######################## CONSTANTS ########################
+
+VALUE_BITS = 32
+MASK_32 = 0xFFFFFFFF
+
+###################### PUBLIC FUNCTIONS ####################
+
+class BitReader:
+    ''' Reads a bitstream MSB first '''
+
+    def __init__(self, data):
+        self.value = int.from_bytes(data, 'big')
+        self.n_bits = 8 * len(data)
+        self.pos = 0
+
+    def read(self, n_bits):
+        if self.pos + n_bits > self.n_bits:
+            raise ValueError("Bitstream too short")
+        self.pos += n_bits
+        return (self.value >> (self.n_bits - self.pos)) & ((1 << n_bits) - 1)
+
+def read_varint(data, pos):
+    ''' Read a LEB128 varint, returning its value and the position after it '''
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(data) or shift > 28:
+            raise ValueError("Invalid varint")
+        byte = data[pos]
+        value |= (byte & 0x7F) << shift
+        pos += 1
+        shift += 7
+        if byte < 0x80:
+            return value, pos
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+def unpack_header(data, n_samples):
+    ''' Decode the channels, indexes and timestamps of a block of 'n_samples' samples (raises
+        ValueError if they are malformed), returning them and the position right after them.
+        Binary frames pack these fields the same way, followed by the raw values '''
+    if len(data) < n_samples:
+        raise ValueError("Block too short")
+    channels = data[:n_samples]
+    pos = n_samples
+
+    # Indexes (delta) and timestamps (delta of delta)
+    indexes = []
+    last_index = {}
+    for channel in channels:
+        delta, pos = read_varint(data, pos)
+        last_index[channel] = (last_index.get(channel, 0) + unzigzag(delta)) & MASK_32
+        indexes.append(last_index[channel])
+
+    timestamps = []
+    last_timestamp = {}
+    last_delta = {}
+    for channel in channels:
+        delta_of_delta, pos = read_varint(data, pos)
+        last_delta[channel] = (last_delta.get(channel, 0) + unzigzag(delta_of_delta)) & MASK_32
+        last_timestamp[channel] = (last_timestamp.get(channel, 0) + last_delta[channel]) & MASK_32
+        timestamps.append(last_timestamp[channel])
+
+    return channels, indexes, timestamps, pos
+
+def decompress(data, n_samples, frac_bits=None):
+    ''' Decode a block of 'n_samples' compressed samples (raises ValueError if it is malformed).
+        The values are floats, or fixed-point values with 'frac_bits' fractional bits '''
+    channels, indexes, timestamps, pos = unpack_header(data, n_samples)
+
+    if frac_bits is not None:
+        values = decompress_fixed_point_values(data, pos, channels, frac_bits)
+    else:
+        values = decompress_float_values(data[pos:], channels)
+
+    return [Sample(*fields) for fields in zip(channels, indexes, timestamps, values)]
+
+def decompress_fixed_point_values(data, pos, channels, frac_bits):
+    ''' Decode the values of a block of fixed-point samples (delta from the previous value) '''
+    values = []
+    last_value = {}
+    for channel in channels:
+        delta, pos = read_varint(data, pos)
+        last_value[channel] = (last_value.get(channel, 0) + unzigzag(delta)) & MASK_32
+        value = last_value[channel] - (1 << 32) if last_value[channel] & 0x80000000 else last_value[channel]
+        values.append(value / (1 << frac_bits))
+    return values
+
+def decompress_float_values(data, channels):
+    ''' Decode the values of a block of float samples (XOR with the previous value) '''
+    values = []
+    bits = BitReader(data)
+    last_value = {}
+    block = {} # (leading, trailing) zeros per channel
+    for channel in channels:
+        diff = 0
+        if bits.read(1):
+            if bits.read(1):
+                leading = bits.read(5)
+                n_meaningful = bits.read(5) + 1
+                trailing = VALUE_BITS - leading - n_meaningful
+                if trailing < 0:
+                    raise ValueError("Invalid value block")
+                block[channel] = (leading, trailing)
+            elif channel not in block:
+                raise ValueError("Missing value block")
+            leading, trailing = block[channel]
+            diff = bits.read(VALUE_BITS - leading - trailing) << trailing
+        last_value[channel] = last_value.get(channel, 0) ^ diff
+        values.append(struct.unpack('<f', struct.pack('<I', last_value[channel]))[0])
+    return values
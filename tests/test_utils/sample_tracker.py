@@ -0,0 +1,106 @@
+# ********************************************************************************
+#
+# Keeps track of the samples received from the embedded device, based on the
+# channel, index and capture timestamp each sample carries, and reports (for all
+# the channels combined):
+#
+#   - gaps:       samples missed between two samples received (e.g. read too
+#                 slowly, or overwritten in the ring buffer before being sent)
+#   - duplicates: samples received more than once (e.g. read too fast)
+#   - latency:    time from capture to reception, on top of the lowest latency
+#                 seen (the device and host clocks are not synchronized, so only
+#                 the latency variation can be measured)
+#
+# Created on Tue Dec 17 2024
+#
+# Daniel Figueira <daniel.castro.figueira@gmail.com>
+#
+# ********************************************************************************
+from collections import namedtuple
+
+######################## CONSTANTS ########################
+
+TIMESTAMP_WRAP = 1 << 32 # us (the device timestamps are 32-bit)
+
+Sample = namedtuple('Sample', ['channel', 'index', 'timestamp_us', 'value'])
+
+###################### PUBLIC FUNCTIONS ####################
+
+def percentile(values, p):
+    ''' The p-th percentile of a sorted list of values (nearest-rank) '''
+    if not values:
+        return 0
+    return values[min(len(values) - 1, max(0, -(-len(values) * p // 100) - 1))]
+
+class SampleTracker:
+    ''' Tracks the gaps, duplicates and latency of a stream of samples '''
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        ''' Reset the statistics (e.g. when a new pattern is started) '''
+        # Samples are indexed from 0 when a pattern starts, so the samples
+        # missed before the first one received are also counted. Each channel
+        # has its own indexes and is read at its own rate, so they are tracked
+        # separately (per channel: [last index, last timestamp, timestamp offset])
+        self.channels = {}
+        self.n_samples = 0
+        self.n_gaps = 0
+        self.n_missed = 0
+        self.n_duplicates = 0
+        self.clock_offsets_us = []
+        self.first_arrival = None
+        self.last_arrival = None
+
+    def track(self, samples, arrival_time):
+        ''' Track a batch of samples received at a given time (in seconds, from a monotonic clock) '''
+        if samples:
+            self.first_arrival = arrival_time if self.first_arrival is None else self.first_arrival
+            self.last_arrival = arrival_time
+        for sample in samples:
+            channel = self.channels.setdefault(sample.channel, [-1, None, 0])
+            last_index, last_timestamp_us, timestamp_offset_us = channel
+
+            # Keep track of the missed and duplicated samples
+            if sample.index == last_index:
+                self.n_duplicates += 1
+            elif sample.index > last_index + 1:
+                self.n_gaps += 1
+                self.n_missed += sample.index - last_index - 1
+            self.n_samples += 1
+
+            # Unwrap the device timestamp and compare it with the arrival time
+            if last_timestamp_us is not None and sample.timestamp_us < last_timestamp_us:
+                timestamp_offset_us += TIMESTAMP_WRAP
+            timestamp_us = sample.timestamp_us + timestamp_offset_us
+            self.clock_offsets_us.append(arrival_time * 1e6 - timestamp_us)
+            channel[:] = [sample.index, sample.timestamp_us, timestamp_offset_us]
+
+    def latencies_us(self):
+        ''' The latency of each sample (on top of the lowest latency seen) '''
+        if not self.clock_offsets_us:
+            return []
+        min_offset = min(self.clock_offsets_us)
+        return [offset - min_offset for offset in self.clock_offsets_us]
+
+    def throughput(self):
+        ''' The rate at which (unique) samples were received, in samples/s '''
+        elapsed = (self.last_arrival - self.first_arrival) if self.first_arrival is not None else 0
+        n_unique = self.n_samples - self.n_duplicates
+        return (n_unique - 1) / elapsed if elapsed > 0 and n_unique > 1 else 0
+
+    def report(self):
+        ''' Summary of the statistics collected '''
+        latencies = sorted(self.latencies_us())
+        return {
+            'n_samples': self.n_samples,
+            'n_gaps': self.n_gaps,
+            'n_missed': self.n_missed,
+            'n_duplicates': self.n_duplicates,
+            'throughput_sps': self.throughput(),
+            'latency_avg_us': sum(latencies) / len(latencies) if latencies else 0,
+            'latency_p50_us': percentile(latencies, 50),
+            'latency_p99_us': percentile(latencies, 99),
+            'latency_max_us': latencies[-1] if latencies else 0,
+        }
@@ -0,0 +1,189 @@
+# ********************************************************************************
+# 
+# Provides a streaming decoder for the binary frames sent by the embedded device.
+#
+# Frames are COBS encoded and delimited by a 0x00 byte. Once decoded, a frame
+# is laid out as (all fields little-endian):
+#
+#   | type (u8) | seq (u16) | n_samples (u8) | samples | crc (u16) |
+#
+# where the samples are laid out column by column (all the channels first, then
+# all the indexes, and so on):
+#
+#   | channel (u8 * n) | index (varint * n) | timestamp_us (varint * n) | value (f32 * n) |
+#
+# with the indexes and timestamps packed as in the compressed frames (see sample_codec.py).
+#
+# Message frames have the same layout, with a text (u8 * n) payload instead. So do
+# summary frames, with n window summaries (29 bytes each) laid out column by column:
+#
+#   | channel (u8 * n) | index (u32 * n) | timestamp_us (u32 * n) | n_samples (u32 * n) |
+#   | min (f32 * n) | max (f32 * n) | mean (f32 * n) | rms (f32 * n) |
+#
+# Compressed frames carry n samples compressed as a block instead (see sample_codec.py).
+#
+# On fixed-point builds, the values (f32 above) are sent as raw i16/i32 integers. The
+# format of the values is declared once per stream (when the stream mode is set), with
+# a "stream mode=<mode> value=<format>" message, where the format is "f32" or e.g.
+# "i16q4" (16-bit integers with 4 fractional bits).
+#
+# Created on Mon Dec 09 2024
+#
+# Daniel Figueira <daniel.castro.figueira@gmail.com>
+# 
+# ********************************************************************************
+import binascii
+import struct
+from collections import namedtuple
+
+from test_utils.sample_codec import decompress, unpack_header
+from test_utils.sample_tracker import Sample
+
+######################## CONSTANTS ########################
+
+FRAME_DELIMITER = b'\x00'
+FRAME_HEADER_FORMAT = '<BHB'
+FRAME_HEADER_SIZE = struct.calcsize(FRAME_HEADER_FORMAT)
+FRAME_CRC_SIZE = 2
+FRAME_SUMMARY_HEADER_SIZE = 13 # bytes (channel u8 + index/timestamp_us/n_samples u32, then min/max/mean/rms)
+CRC_SEED = 0xFFFF
+
+# Frame types
+FRAME_SAMPLES = 0
+FRAME_MESSAGE = 1
+FRAME_SUMMARIES = 2
+FRAME_COMPRESSED_SAMPLES = 3
+
+# Summary of a window of samples of an aggregated channel
+Summary = namedtuple('Summary', ['channel', 'index', 'timestamp_us', 'n_samples', 'min', 'max', 'mean', 'rms'])
+
+# Format of the sample values (struct format, size in bytes and fractional bits)
+ValueFormat = namedtuple('ValueFormat', ['struct_format', 'size', 'frac_bits'])
+VALUE_FORMAT_FLOAT = ValueFormat('f', 4, None)
+
+###################### PUBLIC FUNCTIONS ####################
+
+def parse_value_format(text):
+    ''' Parse a value format declared by the device ("f32", or "i<bits>q<fractional bits>") '''
+    if text == 'f32':
+        return VALUE_FORMAT_FLOAT
+    bits, frac_bits = text[1:].split('q')
+    return ValueFormat({'16': 'h', '32': 'i'}[bits], int(bits) // 8, int(frac_bits))
+
+def cobs_decode(data):
+    ''' Decode a COBS encoded block (without the delimiter) '''
+    decoded = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data) + 1:
+            raise ValueError("Invalid COBS block")
+        decoded += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            decoded.append(0)
+    return bytes(decoded)
+
+class StreamDecoder:
+    ''' Incrementally decodes the binary stream into samples (see Sample). Data can be fed
+        in chunks of any size (frames split across reads are reassembled) '''
+
+    def __init__(self):
+        self.value_format = VALUE_FORMAT_FLOAT
+        self.reset()
+
+    def reset(self):
+        ''' Drop any partial frame and reset the stream statistics (the value format declared
+            for the stream is kept) '''
+        self.pending = b''
+        self.messages = []
+        self.summaries = []
+        self.next_seq = None
+        self.n_frames = 0
+        self.n_lost_frames = 0
+        self.n_bad_frames = 0
+
+    def feed(self, data):
+        ''' Decode a chunk of the stream, returning the samples of all the frames completed
+            (the messages and summaries received are appended to 'messages' and 'summaries') '''
+        samples = []
+        frames = (self.pending + data).split(FRAME_DELIMITER)
+        self.pending = frames.pop()
+        for frame in frames:
+            if frame:
+                samples += self._decode_frame(frame)
+        return samples
+
+    def _decode_frame(self, encoded):
+        # Decode the frame and check its integrity
+        try:
+            frame = cobs_decode(encoded)
+        except ValueError:
+            self.n_bad_frames += 1
+            return []
+
+        if len(frame) < FRAME_HEADER_SIZE + FRAME_CRC_SIZE:
+            self.n_bad_frames += 1
+            return []
+
+        payload, crc = frame[:-FRAME_CRC_SIZE], struct.unpack('<H', frame[-FRAME_CRC_SIZE:])[0]
+        if binascii.crc_hqx(payload, CRC_SEED) != crc:
+            self.n_bad_frames += 1
+            return []
+
+        frame_type, seq, count = struct.unpack_from(FRAME_HEADER_FORMAT, payload)
+        value_size = self.value_format.size
+        payload_sizes = {FRAME_MESSAGE: count, FRAME_SUMMARIES: (FRAME_SUMMARY_HEADER_SIZE + 4 * value_size) * count}
+        if frame_type == FRAME_COMPRESSED_SAMPLES:
+            try:
+                samples = decompress(payload[FRAME_HEADER_SIZE:], count, self.value_format.frac_bits)
+            except ValueError:
+                self.n_bad_frames += 1
+                return []
+        elif frame_type == FRAME_SAMPLES:
+            try:
+                samples = self._unpack_samples(payload[FRAME_HEADER_SIZE:], count)
+            except ValueError:
+                self.n_bad_frames += 1
+                return []
+        elif frame_type not in payload_sizes or len(payload) != FRAME_HEADER_SIZE + payload_sizes[frame_type]:
+            self.n_bad_frames += 1
+            return []
+
+        # Keep track of the frames lost (based on the sequence number)
+        if self.next_seq is not None:
+            self.n_lost_frames += (seq - self.next_seq) & 0xFFFF
+        self.next_seq = (seq + 1) & 0xFFFF
+        self.n_frames += 1
+
+        if frame_type == FRAME_MESSAGE:
+            message = payload[FRAME_HEADER_SIZE:].decode(errors='replace')
+            if message.startswith('stream '):
+                fields = dict(x.split('=') for x in message.split()[1:] if '=' in x)
+                self.value_format = parse_value_format(fields.get('value', 'f32'))
+            self.messages.append(message)
+            return []
+
+        if frame_type == FRAME_SUMMARIES:
+            channels = payload[FRAME_HEADER_SIZE:FRAME_HEADER_SIZE + count]
+            columns = [struct.unpack_from(f'<{count}I', payload, FRAME_HEADER_SIZE + (1 + 4 * i) * count) for i in range(3)]
+            columns += [self._unpack_values(payload, FRAME_HEADER_SIZE + (13 + i * value_size) * count, count) for i in range(4)]
+            self.summaries += [Summary(*fields) for fields in zip(channels, *columns)]
+            return []
+
+        return samples
+
+    def _unpack_samples(self, data, count):
+        # Split the samples into their columns (raises ValueError if they are malformed)
+        channels, indexes, timestamps, pos = unpack_header(data, count)
+        if len(data) != pos + count * self.value_format.size:
+            raise ValueError("Invalid sample frame size")
+        values = self._unpack_values(data, pos, count)
+        return [Sample(*fields) for fields in zip(channels, indexes, timestamps, values)]
+
+    def _unpack_values(self, payload, offset, count):
+        # Unpack a column of values (scaling the fixed-point ones)
+        values = struct.unpack_from(f'<{count}{self.value_format.struct_format}', payload, offset)
+        if self.value_format.frac_bits is None:
+            return values
+        return [x / (1 << self.value_format.frac_bits) for x in values]
@@ -9,15 +9,20 @@
 # ********************************************************************************
 import os
 import time
+from contextlib import contextmanager
 
 import test_utils.usb_utils as usb
+from test_utils.sample_tracker import Sample, SampleTracker
+from test_utils.stream_decoder import StreamDecoder, Summary
 
 ######################## SETTINGS #########################
 
 DEFAULT_DATA_RATE = int(os.getenv("DATA_RATE")) if os.getenv("DATA_RATE") else 100
+DEFAULT_STREAM_MODE = os.getenv("STREAM_MODE") if os.getenv("STREAM_MODE") else "text"
 
 USB_CONNECTION_WAIT_PERIOD  = 1.0 # seconds
-USB_COMMAND_INTERVAL        = 1.0 # seconds
+USB_ACK_TIMEOUT             = 2.0 # seconds (commands are acknowledged as soon as they take effect)
+USB_BENCHMARK_TIMEOUT       = 10.0 # seconds
 
 ######################## CONSTANTS ########################
 
@@ -26,94 +31,403 @@ COMMAND_SET_DATA_RATE = 0
 COMMAND_SET_READ_RATE = 1
 COMMAND_SET_SEND_RATE = 2
 COMMAND_START_PATTERN = 3
+COMMAND_SET_STREAM_MODE = 4
+COMMAND_GET_TELEMETRY = 5
+COMMAND_RESET_TELEMETRY = 6
+COMMAND_BENCHMARK_PATTERNS = 7
+COMMAND_SET_RESAMPLING = 8
+COMMAND_SET_AGGREGATION = 9
+COMMAND_BENCHMARK_RING = 10
+COMMAND_SET_OVERFLOW = 11
+COMMAND_SET_ADAPTIVE_SEND = 12
+COMMAND_SET_LATENCY_MODE = 13
+COMMAND_QUEUE_PATTERN = 14
+COMMAND_SET_NOISE = 15
+COMMAND_STRESS_RING = 16
+
+# Stream modes
+STREAM_MODE_TEXT = 0
+STREAM_MODE_BINARY = 1
+STREAM_MODE_COMPRESSED = 2
+STREAM_MODES = {"text": STREAM_MODE_TEXT, "binary": STREAM_MODE_BINARY, "compressed": STREAM_MODE_COMPRESSED}
+
+# Ring buffer overflow policies
+OVERFLOW_DROP_OLDEST = 0
+OVERFLOW_DROP_NEWEST = 1
+OVERFLOW_BLOCK = 2
 
 # Simulation patterns
+PATTERN_NONE = -1 # stops the current simulation
 PATTERN_CONST = 0
 PATTERN_INCREASING = 1
 PATTERN_DECREASING = 2
 PATTERN_RANDOM = 3
+PATTERN_SINE = 4
+PATTERN_SQUARE = 5
+PATTERN_TRIANGLE = 6
+PATTERN_SAWTOOTH = 7
+PATTERN_CHIRP = 8
+PATTERN_NOISE = 9
+PATTERNS = {PATTERN_CONST: "const", PATTERN_INCREASING: "increasing", PATTERN_DECREASING: "decreasing", PATTERN_RANDOM: "random",
+            PATTERN_SINE: "sine", PATTERN_SQUARE: "square", PATTERN_TRIANGLE: "triangle", PATTERN_SAWTOOTH: "sawtooth",
+            PATTERN_CHIRP: "chirp", PATTERN_NOISE: "noise"}
 
 ###################### PUBLIC FUNCTIONS ####################
 
-current_data_rate = 0
-current_read_rate = 0
+current_data_rates = {} # per channel
+current_read_rates = {} # per channel
+current_resampling = {} # per channel (number of taps)
+current_aggregation = {} # per channel (window samples and ms)
+current_noise = {} # per channel (noise amplitude)
 current_send_rate = 0
+current_stream_mode = None
+current_overflow_policy = (OVERFLOW_DROP_OLDEST, 0) # (policy, timeout_ms)
+current_adaptive_send = False
+current_latency_mode = (False, 0, 0) # (enabled, coalesce_samples, coalesce_us)
+stream_decoder = StreamDecoder()
+sample_tracker = SampleTracker()
+messages = []
+summaries = []
+received = [] # samples read while waiting for command acks (returned by the next read_samples call)
+acks = {} # request ID -> (err, value), for the commands acknowledged (and not waited for yet)
+pending_ids = [] # request IDs of the commands sent (and not waited for yet)
+next_request_id = 0
+pipelining = False
 
-def init():
+def init(port=usb.DEFAULT_PORT):
     ''' Initialize the USB connection '''
     # Make the read timeout twice the sample period 
-    usb.init(usb.DEFAULT_PORT, 2 / DEFAULT_DATA_RATE)
+    usb.init(port, 2 / DEFAULT_DATA_RATE)
     time.sleep(USB_CONNECTION_WAIT_PERIOD)
+    set_stream_mode(DEFAULT_STREAM_MODE)
     set_default_data_rates()
 
 def set_default_data_rates():
-    ''' Set the default data/read/send rates '''
-    set_data_rate(DEFAULT_DATA_RATE)
-    set_read_rate(DEFAULT_DATA_RATE)
-    set_send_rate(DEFAULT_DATA_RATE)
+    ''' Set the default data/read/send rates, with no resampling, aggregation or noise (on every channel used so far),
+        and the default ring buffer overflow policy (sending at a fixed rate). The commands are pipelined '''
+    with pipelined():
+        for channel in set([0, *current_data_rates, *current_read_rates, *current_resampling, *current_aggregation, *current_noise]):
+            set_resampling(0, channel=channel)
+            set_aggregation(0, 0, channel=channel)
+            set_noise(0, channel=channel)
+            set_data_rate(DEFAULT_DATA_RATE, channel=channel)
+            set_read_rate(DEFAULT_DATA_RATE, channel=channel)
+        set_send_rate(DEFAULT_DATA_RATE)
+        set_overflow_policy(OVERFLOW_DROP_OLDEST)
+        set_adaptive_send(False)
+        set_latency_mode(False)
 
 def clear_buffers():
     ''' Clear the input and output buffers '''
     usb.clear_input()
     usb.clear_output()
+    stream_decoder.reset()
+    sample_tracker.reset()
+    messages.clear()
+    summaries.clear()
+    received.clear()
+
+def send_command(command_type, *args):
+    ''' Send a command (tagged with a new request ID) without waiting for it to take effect,
+        returning its request ID (see wait_for_acks) '''
+    return send_commands([(command_type, *args)])[0]
 
-def read_data():
-    ''' Read all data samples available '''
-    samples = []
+def send_commands(commands):
+    ''' Send a list of (command_type, *args) commands in a single write (the device parses them
+        however the bytes are split), returning their request IDs (see wait_for_acks) '''
+    global next_request_id
+    request_ids = list(range(next_request_id + 1, next_request_id + len(commands) + 1))
+    next_request_id += len(commands)
+    usb.send(''.join(f"@{x} {' '.join(str(y) for y in command)}\n" for x, command in zip(request_ids, commands)).encode())
+    pending_ids.extend(request_ids)
+    return request_ids
+
+def wait_for_acks(request_ids=None, timeout=USB_ACK_TIMEOUT):
+    ''' Wait for the device to acknowledge the given commands (all the commands sent so far by
+        default), returning a {request_id: (err, value)} dict. 'err' is 0 on success (negative
+        errno otherwise), and 'value' is the value the command actually applied (rates in mHz).
+        The samples received in the meantime are returned by the next read_samples call '''
+    request_ids = list(pending_ids) if request_ids is None else request_ids
+    deadline = time.monotonic() + timeout
     while True:
-        data = usb.read()
-        if not data:
+        collect_acks()
+        missing = [x for x in request_ids if x not in acks]
+        if not missing:
             break
-        data = data.decode().strip().split('\n')
-        samples += [float(x) for x in data]
+        if time.monotonic() > deadline:
+            raise TimeoutError(f"Commands not acknowledged: {missing}")
+        new_samples = read_chunk()
+        if new_samples:
+            received.extend(new_samples)
+
+    for request_id in request_ids:
+        pending_ids.remove(request_id)
+    return {x: acks.pop(x) for x in request_ids}
+
+def collect_acks():
+    ''' Move the command acks received from 'messages' to 'acks' '''
+    for message in [x for x in messages if x.startswith(('ack ', 'nack '))]:
+        fields = dict(x.split('=') for x in message.split()[1:])
+        acks[int(fields['id'])] = (int(fields['err']), int(fields['value']))
+        messages.remove(message)
+
+def execute_command(command_type, *args, timeout=USB_ACK_TIMEOUT):
+    ''' Send a command and wait for it to take effect, returning its (err, value) ack (or None
+        when pipelining, as the ack is only waited for at the end) '''
+    request_id = send_command(command_type, *args)
+    if pipelining:
+        return None
+    return wait_for_acks([request_id], timeout)[request_id]
+
+@contextmanager
+def pipelined():
+    ''' Send the commands issued in a 'with' block back to back, and only wait for them to take
+        effect at the end of it (so reconfiguring the device takes a single round trip) '''
+    global pipelining
+    pipelining = True
+    try:
+        yield
+    finally:
+        pipelining = False
+    wait_for_acks()
+
+def read_chunk():
+    ''' Read and decode the data available, returning the samples received (None if no data
+        arrived within the read timeout). The messages and the window summaries of the aggregated
+        channels are appended to 'messages' and 'summaries' '''
+    data = usb.read()
+    if not data:
+        return None
+    if current_stream_mode != STREAM_MODE_TEXT:
+        new_samples = stream_decoder.feed(data)
+        messages.extend(stream_decoder.messages)
+        stream_decoder.messages.clear()
+        summaries.extend(stream_decoder.summaries)
+        stream_decoder.summaries.clear()
+    else:
+        lines = data.decode().strip().split('\n')
+        messages.extend([x[2:] for x in lines if x.startswith('# ')])
+        summaries.extend([Summary(*(int(x) for x in fields[1:5]), *(float(x) for x in fields[5:]))
+                          for fields in (x.split() for x in lines if x.startswith('S '))])
+        lines = [x for x in lines if x and not x.startswith('#') and not x.startswith('S ')]
+        new_samples = [Sample(int(channel), int(index), int(timestamp), float(value))
+                       for channel, index, timestamp, value in (x.split() for x in lines)]
+    sample_tracker.track(new_samples, time.monotonic())
+    return new_samples
+
+def read_samples():
+    ''' Read all data samples available (with their index and capture timestamp). The window
+        summaries of the aggregated channels are appended to 'summaries' '''
+    samples = list(received)
+    received.clear()
+    while True:
+        new_samples = read_chunk()
+        if new_samples is None:
+            break
+        samples += new_samples
 
     return samples
-    
-
-def set_data_rate(data_rate, restore=True):
-    ''' Set the rate at which the simulated data is produced '''
-    global current_data_rate
-    if data_rate != current_data_rate:
-        usb.send(f"{COMMAND_SET_DATA_RATE} {data_rate}".encode())
-        time.sleep(USB_COMMAND_INTERVAL)
-        current_data_rate = data_rate
-
-def set_read_rate(read_rate, restore=True):
-    ''' Set the rate at which the simulated data is read '''
-    global current_read_rate
-    if read_rate != current_read_rate:
-        usb.send(f"{COMMAND_SET_READ_RATE} {read_rate}".encode())
-        time.sleep(USB_COMMAND_INTERVAL)
-        current_read_rate = read_rate
+
+def read_data(channel=None):
+    ''' Read all data samples available (values only), from all the channels or a single one '''
+    return [sample.value for sample in read_samples() if channel is None or sample.channel == channel]
+
+def read_summaries(channel=None):
+    ''' Read all data available, returning the window summaries received so far (from all the
+        aggregated channels or a single one) '''
+    read_samples()
+    return [summary for summary in summaries if channel is None or summary.channel == channel]
+
+def get_sample_stats():
+    ''' Gaps, duplicates and latency of the samples read since the buffers were last cleared '''
+    return sample_tracker.report()
+
+def set_stream_mode(stream_mode):
+    ''' Set the mode used to stream the data samples ('text', 'binary' or 'compressed') '''
+    global current_stream_mode
+    if STREAM_MODES[stream_mode] != current_stream_mode:
+        received.extend(read_samples()) # the data sent in the previous mode
+        request_id = send_command(COMMAND_SET_STREAM_MODE, STREAM_MODES[stream_mode])
+        current_stream_mode = STREAM_MODES[stream_mode]
+        stream_decoder.reset()
+        wait_for_acks([request_id]) # sent after the stream declaration (with the format of the values)
+
+def get_telemetry():
+    ''' Get a snapshot of the pipeline telemetry, as a {stage: {key: value}} dict
+        (histograms are returned as lists of counts) '''
+    execute_command(COMMAND_GET_TELEMETRY) # acknowledged after the telemetry is sent
+
+    telemetry = {}
+    for message in messages:
+        fields = message.split()
+        if len(fields) < 2 or fields[0] != 'telemetry':
+            continue
+        stage = telemetry.setdefault(fields[1], {})
+        for field in fields[2:]:
+            key, value = field.split('=')
+            stage[key] = [int(x) for x in value.split(',')] if ',' in value else int(value)
+    messages.clear()
+
+    return telemetry
+
+def benchmark_patterns(n_samples=0):
+    ''' Measure how fast the device generates the samples of each pattern, as a
+        {pattern: {key: value}} dict (n_samples=0 uses the device default) '''
+    # The device only acknowledges the command once every pattern is done
+    execute_command(COMMAND_BENCHMARK_PATTERNS, n_samples, timeout=USB_BENCHMARK_TIMEOUT)
+
+    results = {}
+    for message in messages:
+        fields = dict(x.split('=') for x in message.split()[1:] if '=' in x)
+        if message.startswith('benchmark ') and 'pattern' in fields:
+            results[PATTERNS[int(fields.pop('pattern'))]] = {key: float(value) if '.' in value else int(value)
+                                                             for key, value in fields.items()}
+    messages.clear()
+
+    return results
+
+def benchmark_ring_buffer(n_items=0):
+    ''' Measure how long the device takes to add/get an item to/from a ring buffer, as a
+        {key: value} dict (n_items=0 uses the device default) '''
+    # The device only acknowledges the command once the benchmark is done
+    execute_command(COMMAND_BENCHMARK_RING, n_items, timeout=USB_BENCHMARK_TIMEOUT)
+
+    results = {}
+    for message in messages:
+        if message.startswith('benchmark ring_buffer '):
+            results = {key: float(value) if '.' in value else int(value)
+                       for key, value in (x.split('=') for x in message.split()[2:] if '=' in x)}
+    messages.clear()
+
+    return results
+
+def stress_ring_buffer(n_items=0):
+    ''' Run a producer and a consumer thread on a ring buffer at once (on separate cores, on SMP
+        builds), and return what the consumer got as a {key: value} dict (n_items=0 uses the
+        device default) '''
+    # The device only acknowledges the command once both threads are done
+    execute_command(COMMAND_STRESS_RING, n_items, timeout=USB_BENCHMARK_TIMEOUT)
+
+    results = {}
+    for message in messages:
+        if message.startswith('stress ring_buffer '):
+            results = {key: int(value) for key, value in (x.split('=') for x in message.split()[2:] if '=' in x)}
+    messages.clear()
+
+    return results
+
+def reset_telemetry():
+    ''' Reset the pipeline counters and timing stats '''
+    execute_command(COMMAND_RESET_TELEMETRY)
+
+def set_data_rate(data_rate, restore=True, channel=0):
+    ''' Set the rate at which the simulated data is produced (on a given channel) '''
+    if data_rate != current_data_rates.get(channel):
+        execute_command(COMMAND_SET_DATA_RATE, data_rate, channel)
+        current_data_rates[channel] = data_rate
+
+def set_read_rate(read_rate, restore=True, channel=0):
+    ''' Set the rate at which the simulated data is read (from a given channel) '''
+    if read_rate != current_read_rates.get(channel):
+        execute_command(COMMAND_SET_READ_RATE, read_rate, channel)
+        current_read_rates[channel] = read_rate
+
+def set_resampling(n_taps, channel=0):
+    ''' Resample the data of a given channel to its read rate, with a FIR filter of 'n_taps'
+        taps (the data is then read at the data rate), or stop resampling it (n_taps=0) '''
+    if n_taps != current_resampling.get(channel, 0):
+        execute_command(COMMAND_SET_RESAMPLING, n_taps, channel)
+        current_resampling[channel] = n_taps
+
+def set_aggregation(window_samples, window_ms=0, channel=0):
+    ''' Send the data of a given channel as one summary (min/max/mean/RMS) per window of up to
+        'window_samples' samples and/or 'window_ms' ms, or send it sample by sample (both 0) '''
+    if (window_samples, window_ms) != current_aggregation.get(channel, (0, 0)):
+        execute_command(COMMAND_SET_AGGREGATION, window_samples, window_ms, channel)
+        current_aggregation[channel] = (window_samples, window_ms)
+
+def set_noise(amplitude, channel=0):
+    ''' Overlay noise of up to 'amplitude' on the waveform patterns of a given channel,
+        or stop overlaying it (amplitude=0) '''
+    if amplitude != current_noise.get(channel, 0):
+        execute_command(COMMAND_SET_NOISE, amplitude, channel)
+        current_noise[channel] = amplitude
+
+def set_overflow_policy(policy, timeout_ms=0):
+    ''' Set what happens to new samples when the ring buffer is full (drop the oldest ones,
+        drop the new ones, or block the sensor thread for up to 'timeout_ms') '''
+    global current_overflow_policy
+    if (policy, timeout_ms) != current_overflow_policy:
+        execute_command(COMMAND_SET_OVERFLOW, policy, timeout_ms)
+        current_overflow_policy = (policy, timeout_ms)
+
+def set_adaptive_send(enabled):
+    ''' Send at the send rate, but burst at link speed whenever the ring buffer fills up (enabled),
+        or always send at the send rate (disabled) '''
+    global current_adaptive_send
+    if enabled != current_adaptive_send:
+        execute_command(COMMAND_SET_ADAPTIVE_SEND, int(enabled))
+        current_adaptive_send = enabled
+
+def set_latency_mode(enabled, coalesce_samples=0, coalesce_us=0):
+    ''' Send the samples as soon as they are read, waking the data thread up on new samples (enabled),
+        or send them at the send rate (disabled). The samples can be coalesced into frames of up to
+        'coalesce_samples' samples, waiting up to 'coalesce_us' for them '''
+    global current_latency_mode
+    if (enabled, coalesce_samples, coalesce_us) != current_latency_mode:
+        execute_command(COMMAND_SET_LATENCY_MODE, int(enabled), coalesce_samples, coalesce_us)
+        current_latency_mode = (enabled, coalesce_samples, coalesce_us)
 
 def set_send_rate(send_rate, restore=True):
     ''' Set the rate at which the simulated data is sent '''
     global current_send_rate
     if send_rate != current_send_rate:
-        usb.send(f"{COMMAND_SET_SEND_RATE} {send_rate}".encode())
-        time.sleep(USB_COMMAND_INTERVAL)
+        execute_command(COMMAND_SET_SEND_RATE, send_rate)
         current_send_rate = send_rate
 
-def simulate_const_pattern(value, n_samples):
+def start_pattern(pattern, arg1, arg2, arg3, channel=0):
+    ''' Start a pattern simulation on a given channel (without reading its data) '''
+    execute_command(COMMAND_START_PATTERN, pattern, arg1, arg2, arg3, channel)
+
+def start_playlist(patterns, channel=0):
+    ''' Queue a list of (pattern, arg1, arg2, arg3[, data_rate[, n_repeats]]) patterns on a given channel,
+        in a single write, to be played back to back on the device (without reading their data).
+        A data rate of 0 keeps the current one, and each pattern is played 1 + n_repeats times '''
+    start_pattern(PATTERN_NONE, 0, 0, 0, channel) # stop the current simulation (and clear the patterns queued)
+    commands = [(COMMAND_QUEUE_PATTERN, *(tuple(x) + (0, 0))[:6], channel) for x in patterns]
+    acks = wait_for_acks(send_commands(commands))
+    assert all(err == 0 for err, _ in acks.values()), f"Failed to queue the patterns: {acks}"
+    # The patterns can change the data rate of the channel (so it's set again when restoring the defaults)
+    if any(len(x) > 4 and x[4] for x in patterns):
+        current_data_rates[channel] = None
+
+def simulate_const_pattern(value, n_samples, channel=0):
     ''' Start a 'const' pattern simulation '''
-    usb.send(f"{COMMAND_START_PATTERN} {PATTERN_CONST} {value} {n_samples}".encode())
-    time.sleep(USB_COMMAND_INTERVAL)
-    return read_data()
+    start_pattern(PATTERN_CONST, value, n_samples, 0, channel)
+    return read_data(channel)
 
-def simulate_increasing_pattern(start_value, increment, max_value):
+def simulate_increasing_pattern(start_value, increment, max_value, channel=0):
     ''' Start a 'increasing' pattern simulation '''
-    usb.send(f"{COMMAND_START_PATTERN} {PATTERN_INCREASING} {start_value} {increment} {max_value}".encode())
-    time.sleep(USB_COMMAND_INTERVAL)
-    return read_data()
+    start_pattern(PATTERN_INCREASING, start_value, increment, max_value, channel)
+    return read_data(channel)
 
-def simulate_decreasing_pattern(start_value, decrement, min_value):
+def simulate_decreasing_pattern(start_value, decrement, min_value, channel=0):
     ''' Start a 'decreasing' pattern simulation '''
-    usb.send(f"{COMMAND_START_PATTERN} {PATTERN_DECREASING} {start_value} {decrement} {min_value}".encode())
-    time.sleep(USB_COMMAND_INTERVAL)
-    return read_data()
+    start_pattern(PATTERN_DECREASING, start_value, decrement, min_value, channel)
+    return read_data(channel)
 
-def simulate_random_pattern(min_value, max_value, n_samples):
+def simulate_random_pattern(min_value, max_value, n_samples, channel=0):
     ''' Start a 'random' pattern simulation '''
-    usb.send(f"{COMMAND_START_PATTERN} {PATTERN_RANDOM} {min_value} {max_value} {n_samples}".encode())
-    time.sleep(USB_COMMAND_INTERVAL)
-    return read_data()
\ No newline at end of file
+    start_pattern(PATTERN_RANDOM, min_value, max_value, n_samples, channel)
+    return read_data(channel)
+
+def simulate_waveform(pattern, amplitude, period, n_samples, channel=0):
+    ''' Start a periodic waveform ('sine', 'square', 'triangle' or 'sawtooth') or 'chirp' pattern simulation
+        (the period of a chirp is the one it reaches at its last sample) '''
+    start_pattern(pattern, amplitude, period, n_samples, channel)
+    return read_data(channel)
+
+def simulate_noise_pattern(value, amplitude, n_samples, channel=0):
+    ''' Start a 'noise' pattern simulation '''
+    start_pattern(PATTERN_NOISE, value, amplitude, n_samples, channel)
+    return read_data(channel)
\ No newline at end of file
@@ -47,7 +47,7 @@ def read(size = None):
 
 def send(data):
     global ser
-    print(f"Sending data: {data.decode('utf-8')}")
+    print(f"Sending data: {data.decode('utf-8').strip()}")
     ser.write(data)
 
 def clear_input():
@@ -71,8 +71,8 @@ def main():
             if usr_cmd == "exit" or usr_cmd == "quit" or usr_cmd == "q":
                 os._exit(0)
 
-            # Otherwise send the command over USB
-            usb.send(usr_cmd.encode('utf-8'))
+            # Otherwise send the command over USB (commands are terminated by a newline)
+            usb.send(f"{usr_cmd}\n".encode('utf-8'))
 
         except Exception as e:
             print(f"Unhandled exception on 'main' loop: {e}\n")